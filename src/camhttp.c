@@ -4,574 +4,2532 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <sys/timerfd.h>
 #include "util.h"
 #include "video_manager.h"
 #include "v4l2port.h"
-#include "md5.h"
-#include "uthash.h"
+#include "digest.h"
+#include "upgrade.h"
+#include "multicast.h"
+#include "recorder.h"
+#include "playback.h"
+#include "motion.h"
+#include "jpeg.h"
+#include "pevent.h"
 
 #define REQUEST_TYPE_SNAPSHORT	 1
 #define REQUEST_TYPE_STREAM		 2
+#define REQUEST_TYPE_REPLAY		 3
+#define REQUEST_TYPE_MULTI		 4
+
+#define CAMHTTP_IP_MAX_CONN		16
+#define CAMHTTP_IP_MAX_STREAM	4
+#define CAMHTTP_IP_RATE			10
+#define CAMHTTP_IP_BURST		20
+
+#define CAMHTTP_MAX_STREAM			64
+#define CAMHTTP_MAX_DEVICE_STREAM	32
+#define CAMHTTP_MAX_QUEUED			(4 * 1024 * 1024)
+#define CAMHTTP_MAX_DEVICE_QUEUED	(2 * 1024 * 1024)
+#define CAMHTTP_RETRY_AFTER			10
+#define CAMHTTP_REPLAY_RETRY		20	//ms to wait for a replay viewer to drain
+#define CAMHTTP_MAX_SCALE			3	//1/8 size, one pixel per block
+#define CAMHTTP_MAX_FPS				100
+#define CAMHTTP_MAX_CROP			8192	//16 bits per field in the upgrade record
+#define CAMHTTP_ETAG_FRESH			1000	//ms a frame stays current without a newer one
+#define CAMHTTP_DEFAULT_WAIT		10000	//ms a long poll waits for the next frame
+#define CAMHTTP_MAX_WAIT			30000
+#define CAMHTTP_CACHE_TIME			10000	//ms the newest frame is kept after a long poll
+#define CAMHTTP_MAX_ALIGN			1000	//ms a multi camera tick waits for slow devices
+#define CAMHTTP_MAX_RECORDER		16		//addresses granted the recorder class
 
 
 
-#define MD5_UPDATE_STRING(c, s) md5_update(c, (const unsigned char *)s, strlen(s))
-
-#define HTTP_DIGEST_REALM			"camlite"
-#define HTTP_DIGEST_NONCE			"camlite"
-#define HTTP_DIGEST_MAX				1000
-#define HTTP_DIGEST_EXPIRETIME		3600
-
 struct comond_patten
 {
 	char path[32];
 	http_response_t * (*command_callback)(http_request_t *);
 };
 
+//a cropped and or downscaled copy of the frame, size -1 when the frame
+//could not be converted
+typedef struct _camhttp_variant
+{
+	int scale;
+	int crop[4];
+	char *buf;
+	int size;
+
+	struct _camhttp_variant *next;
+} camhttp_variant_t;
+
 typedef struct _video_read_data
 {
 	char *buf;
 	int size;
 	struct timeval *timestamp;
 	unsigned int index;
+	unsigned int sequence;
+
+	//made for the first subscriber asking and shared by the others,
+	//parsed is 0 until then and -1 for frames the decoder rejects
+	int parsed;
+	jpeg_frame_t frame;
+	camhttp_variant_t *variants;
+
+	//where the standard huffman tables go in, 0 not looked at yet and -1
+	//when the frame carries its own
+	int dht_offset;
 } video_read_data_t;
 
-typedef struct _http_parameter
+typedef struct _camhttp_replay
 {
-	char *key;
-	char *value;
-} http_parameter_t;
+	playback_cursor_t cursor;
+	pevent_t *timer;
+	uint64_t end_us;
+	double speed;
+	int done;
+
+	uint64_t first_us;		//recording time of the first frame
+	uint64_t start_ns;		//monotonic time it was due
+} camhttp_replay_t;
 
-typedef struct _http_digest
+typedef struct _camhttp_slot
 {
-	char nonce[33];
-	time_t check_time;
-	unsigned int ip;
-	int count;
+	char *buf;
+	int size;
+	int max;
+	struct timeval timestamp;
+} camhttp_slot_t;
+
+//aligned multi camera viewers of the same devices, align and scale share
+//the frames of a tick and the parts built from them
+typedef struct _camhttp_group
+{
+	unsigned int devices;
+	int align;
+	int scale;
+	int refs;
+
+	unsigned long tick;		//first frame of the pending tick arrived
+	unsigned int ready;		//devices with a frame in the pending tick
+	unsigned int live;		//devices that made the last tick, the ones waited for
+	unsigned int sequence[MAX_VIDEO_COUNT];	//frames taken, each once for all viewers
+
+	//frames of the pending tick, copied as they come in
+	camhttp_slot_t slots[MAX_VIDEO_COUNT];
+
+	//the last tick sent: the first frame, then headers and frame of the others
+	unsigned int gen;
+	unsigned int sent;		//devices in it
+	int first;
+	int first_size;
+	struct timeval first_timestamp;
+	char *parts;
+	int parts_size;
+	int parts_max;
+
+	struct _camhttp_group *next;
+} camhttp_group_t;
+
+//several devices over one multipart connection
+typedef struct _camhttp_multi
+{
+	unsigned int devices;	//bit per device
+	int align;				//ms, 0 sends every frame as it comes
+	camhttp_group_t *group;	//with align
+	unsigned int gen;		//tick of the group sent last
+} camhttp_multi_t;
+
+typedef struct _camhttp_subscriber
+{
+	int type;
+	int index;
+	int priority;
+	int scale;		//frames are sent at 1 / (1 << scale) size
+	int crop[4];	//x, y, width, height, no crop while the width is 0
+	int fps;		//0 sends every frame
+	uint64_t due_us;	//capture time the next frame is wanted from
+	unsigned int after;		//long poll, sequence the client has
+	unsigned long deadline;	//tick it gets 304, 0 waits as long as it takes
+	int frame_size;		//last frame sent at the requested scale
+	int sent_size;		//last frame sent, whatever the scale
+	int downgrade;		//the link can not carry the requested scale, sent one step smaller
+	int shed;			//picked to make room, closed once the request is admitted
+	http_client_t *client;
+	camhttp_replay_t *replay;
+	camhttp_multi_t *multi;
+
+	struct _camhttp_subscriber *prev;
+	struct _camhttp_subscriber *next;
+} camhttp_subscriber_t;
+
+typedef struct _camhttp_device
+{
+	camhttp_subscriber_t *subscribers;
+	int streams;
+
+	unsigned int sent;		//stream frames handed to clients
+	unsigned int decimated;	//skipped for a lower fps
+	unsigned int paced;		//skipped while the kernel still held the previous one
+	unsigned int downgraded;	//sent a scale step smaller for a slow link
+	unsigned int dht_frames;	//frames sent with the standard tables spliced in
+	unsigned int dht_sends;
+
+	unsigned int sequence;		//of the last frame captured
+	unsigned long frame_time;	//tick it arrived
+	unsigned int not_modified;
+
+	//a copy of the newest frame for long polls arriving between frames,
+	//kept up only while such polls come in
+	video_read_data_t cache;
+	struct timeval cache_timestamp;
+	int cache_max;
+	unsigned long cache_until;
+	unsigned int long_polls;
+	unsigned int long_poll_timeouts;
+} camhttp_device_t;
+
+typedef struct _camhttp_manage
+{
+	camhttp_device_t devices[MAX_VIDEO_COUNT];
+	int streams;
 
-	UT_hash_handle hh;
-} http_digest_t;
+	camhttp_admission_t admission;
+	unsigned int shed;
+	unsigned int refused;
 
+	//network order, from CAMHTTP_RECORDER_ENV
+	unsigned int recorders[CAMHTTP_MAX_RECORDER];
+	int recorder_count;
 
+	camhttp_group_t *groups;
+} camhttp_manage_t;
 
 static http_server_t *g_service;
 
-static char g_digest_ha1[64];
+static pevent_base_t *g_base;
+
+//etags of an earlier process never match
+static unsigned int g_epoch;
+
+//expires long polls, armed for the earliest deadline
+static pevent_t *g_wait_timer;
+static unsigned long g_wait_deadline;
+
+void camhttp_on_wait_timer(pevent_t *pevent, int event, void *ptr);
 
-static http_digest_t *g_digest_list;
+static camhttp_manage_t g_camhttp = {
+	.admission = {
+		CAMHTTP_MAX_STREAM,
+		CAMHTTP_MAX_DEVICE_STREAM,
+		CAMHTTP_MAX_QUEUED,
+		CAMHTTP_MAX_DEVICE_QUEUED,
+	},
+};
 
-static char HEX_DICT[0x10] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+static const char *CAMHTTP_CLASS_NAME[CAMHTTP_CLASS_COUNT] = { "public", "operator", "recorder" };
 
-static void hex2string(unsigned char *hex, int hex_len, char *buff, int buf_len)
+//value of key in "0&key=value&...", the leading device number has no key
+int camhttp_get_param(const char *param, const char *key, char *value, int size)
 {
-	int i;
-	unsigned char *pc;
+	const char *p, *end;
+	int key_len, len;
 
-	i = 0;
-    pc = hex + hex_len;
-    while(i < buf_len - 1 && hex < pc)
+	key_len = strlen(key);
+	p = param;
+
+	while (p != NULL && *p != '\0')
 	{
-        unsigned char c1 = (*hex) >> 4;
-        unsigned char c2 = (*hex) & 0x0f;
-        buff[i++] = HEX_DICT[c1];
-        buff[i++] = HEX_DICT[c2];
-        hex++;
-    }
+		end = strchr(p, '&');
+		len = end ? end - p : strlen(p);
+
+		if (len > key_len && strncmp(p, key, key_len) == 0 && p[key_len] == '=')
+		{
+			len -= key_len + 1;
+			if (len >= size)
+				len = size - 1;
+
+			memcpy(value, p + key_len + 1, len);
+			value[len] = '\0';
+			return 0;
+		}
 
-    buff[i] = 0;
+		p = end ? end + 1 : NULL;
+	}
+
+	return -1;
 }
 
-int get_http_parameter(char *src, http_parameter_t param[], int count)
+//scale=2, 4 or 8 as a shift, 0 without the parameter and -1 when invalid
+int camhttp_get_scale(http_request_t *request)
 {
-	int len, nel, i;
-	char *q, *name, *value, *temp;
+	int scale;
+	char value[16];
 
-	q = src;
-	len = strlen(src);
-	nel = 1;
+	if (camhttp_get_param(request->param, "scale", value, sizeof(value)) == -1)
+		return 0;
 
+	for (scale = 1; scale <= CAMHTTP_MAX_SCALE; ++scale)
+	{
+		if (atoi(value) == 1 << scale)
+			return scale;
+	}
 
-	while (strsep(&q, ","))
-		nel++;
+	return -1;
+}
 
+//fps=1 to CAMHTTP_MAX_FPS, 0 without the parameter and -1 when invalid
+int camhttp_get_fps(http_request_t *request)
+{
+	int fps;
+	char value[16];
 
-	for (q = src; q < (src + len);)
-	{
-		value = name = q;
-		for (q += strlen(q); q < (src + len) && !*q; q++);
+	if (camhttp_get_param(request->param, "fps", value, sizeof(value)) == -1)
+		return 0;
 
-		name = strsep(&value, "=");
-		if (name == NULL || value == NULL)
-			break;
+	fps = atoi(value);
+	if (fps < 1 || fps > CAMHTTP_MAX_FPS)
+		return -1;
 
-		//trim name
-		while (*name != '\0' && (*name == '\t' || *name == ' '))
-			++name;
+	return fps;
+}
 
-		temp = name;
-		while (*temp != '\0')
-			++temp;
+//crop=x,y,width,height in pixels, the rectangle grows to whole blocks
+//and has to lie inside the frame the device was set up for
+int camhttp_get_crop(http_request_t *request, v4l2port_t *video, int *crop)
+{
+	char value[64];
 
-		while (temp > name)
-		{
-			if (*temp == '\0' || *temp == '\t' || *temp == ' ')
-				*temp = '\0';
-			else
-				break;
+	memset(crop, 0, sizeof(int) * 4);
 
-			--temp;
-		}
+	if (camhttp_get_param(request->param, "crop", value, sizeof(value)) == -1)
+		return 0;
 
-		//trim value
-		while (*value != '\0' && (*value == '\t' || *value == ' ' || *value == '"'))
-		{
-			if (*value == '"')
-			{
-				++value;
-				break;
-			}
+	if (sscanf(value, "%d,%d,%d,%d", &crop[0], &crop[1], &crop[2], &crop[3]) != 4
+		|| crop[0] < 0 || crop[1] < 0 || crop[2] <= 0 || crop[3] <= 0
+		|| crop[2] > CAMHTTP_MAX_CROP || crop[3] > CAMHTTP_MAX_CROP
+		|| crop[0] > CAMHTTP_MAX_CROP - crop[2] || crop[1] > CAMHTTP_MAX_CROP - crop[3]
+		|| crop[0] > video->profile.width - crop[2] || crop[1] > video->profile.height - crop[3])
+	{
+		return -1;
+	}
 
-			++value;
-		}
+	return 0;
+}
 
-		temp = value;
-		while (*temp != '\0')
-			++temp;
+//the class is granted, not claimed: recorder for the configured addresses,
+//operator for a digest user, public otherwise; class= may only lower it
+int camhttp_get_class(http_request_t *request)
+{
+	int i, granted;
+	unsigned int ip;
+	char value[16];
 
-		while (temp >= value)
-		{
-			if (*temp == '\0' || *temp == '\t' || *temp == ' ')
-				*temp = '\0';
-			else if (*temp == '"')
-			{
-				*temp = '\0';
-				break;
-			}
-			else
-			{
-				break;
-			}
+	granted = digest_enabled() ? CAMHTTP_CLASS_OPERATOR : CAMHTTP_CLASS_PUBLIC;
 
-			--temp;
+	ip = inet_addr(http_client_getip(request->client));
+	for (i = 0; i < g_camhttp.recorder_count; ++i)
+	{
+		if (g_camhttp.recorders[i] == ip)
+		{
+			granted = CAMHTTP_CLASS_RECORDER;
+			break;
 		}
-		
-		for (i = 0; i < count; ++i)
+	}
+
+	if (camhttp_get_param(request->param, "class", value, sizeof(value)) == 0)
+	{
+		for (i = 0; i < granted; ++i)
 		{
-			if (strcmp(name, param[i].key) == 0)
-			{
-				param[i].value = value;
-			}
+			if (strcmp(value, CAMHTTP_CLASS_NAME[i]) == 0)
+				return i;
 		}
 	}
 
-	for (i = 0; i < count; ++i)
+	return granted;
+}
+
+camhttp_subscriber_t * camhttp_subscriber_new(http_client_t *client,
+	int type, int index, int priority)
+{
+	camhttp_subscriber_t *sub;
+	camhttp_device_t *device;
+
+	device = &g_camhttp.devices[index];
+
+	sub = fcalloc(1, sizeof(camhttp_subscriber_t));
+	sub->type = type;
+	sub->index = index;
+	sub->priority = priority;
+	sub->client = client;
+
+	sub->next = device->subscribers;
+	if (device->subscribers)
+		device->subscribers->prev = sub;
+	device->subscribers = sub;
+
+	if (type == REQUEST_TYPE_STREAM || type == REQUEST_TYPE_MULTI || type == REQUEST_TYPE_REPLAY)
 	{
-		if (!param[i].value)
-			return 0;
+		++device->streams;
+		++g_camhttp.streams;
 	}
 
-	return 1;
+	http_client_set_delay(client, sub);
+
+	return sub;
 }
 
-void check_digest_expire()
+static void camhttp_group_release(camhttp_group_t *group)
 {
-	http_digest_t *dt, *temp_dt;
-	unsigned int timenow;
+	int i;
+	camhttp_group_t **p;
+
+	if (--group->refs > 0)
+		return;
+
+	for (p = &g_camhttp.groups; *p != group; p = &(*p)->next);
+	*p = group->next;
 
-	timenow = time(NULL);
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+		free(group->slots[i].buf);
 
-	HASH_ITER(hh, g_digest_list, dt, temp_dt)
+	free(group->parts);
+	free(group);
+}
+
+static camhttp_group_t * camhttp_group_get(unsigned int devices, int align, int scale)
+{
+	camhttp_group_t *group;
+
+	for (group = g_camhttp.groups; group; group = group->next)
 	{
-		if (dt->check_time + HTTP_DIGEST_EXPIRETIME < timenow)
+		if (group->devices == devices && group->align == align && group->scale == scale)
 		{
-			LOGDEBUG("digest expire('%s')\n", dt->nonce);
-			HASH_DEL(g_digest_list, dt);
-
-			free(dt);
+			++group->refs;
+			return group;
 		}
 	}
+
+	group = fcalloc(1, sizeof(camhttp_group_t));
+	group->devices = devices;
+	group->align = align;
+	group->scale = scale;
+	group->live = devices;
+	group->refs = 1;
+
+	group->next = g_camhttp.groups;
+	g_camhttp.groups = group;
+
+	return group;
 }
 
-http_digest_t * new_digest(http_request_t *request)
+//the subscriber is listed and counted on its first device, the stream
+//counts on the others of the set too
+static void camhttp_multi_attach(camhttp_subscriber_t *sub, unsigned int devices, int align)
 {
-	md5ctx ctx;
-	unsigned char digest[16];
-	http_digest_t *dt, dt_temp;
-	static unsigned int digest_count = 0;
-	
+	int i;
 
-	if (HASH_COUNT(g_digest_list) >= HTTP_DIGEST_MAX)
+	sub->multi = fcalloc(1, sizeof(camhttp_multi_t));
+	sub->multi->devices = devices;
+	sub->multi->align = align;
+
+	if (align)
 	{
-		LOGERROR("http digest data count >= HTTP_DIGEST_MAX\n");
-		return NULL;
+		sub->multi->group = camhttp_group_get(devices, align, sub->scale);
+		sub->multi->gen = sub->multi->group->gen;
 	}
 
-	dt_temp.check_time = time(NULL);
-	dt_temp.ip = inet_addr(http_client_getip(request->client));
-	dt_temp.count = 1;
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		if (i != sub->index && (devices & 1 << i))
+			++g_camhttp.devices[i].streams;
+	}
+}
 
-	md5_init(&ctx);
-	md5_update(&ctx, (uint8_t *)&digest_count, sizeof(digest_count));
-	md5_update(&ctx, (uint8_t *)&dt_temp.check_time, sizeof(dt_temp.check_time));
-	md5_update(&ctx, (uint8_t *)&dt_temp.ip, sizeof(dt_temp.ip));
-	md5_final(digest, &ctx);
-	hex2string(digest, 16, dt_temp.nonce, 33);
+static void camhttp_multi_detach(camhttp_subscriber_t *sub)
+{
+	int i;
 
-	dt = NULL;
-	HASH_FIND(hh, g_digest_list, dt_temp.nonce, 32, dt);
-	if (dt != NULL)
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
 	{
-		LOGERROR("http digest data exist:%s\n", dt_temp.nonce);
-		return NULL;
+		if (i != sub->index && (sub->multi->devices & 1 << i))
+			--g_camhttp.devices[i].streams;
 	}
 
-	dt = fmalloc(sizeof(http_digest_t));
-	memcpy(dt, &dt_temp, sizeof(http_digest_t));
-	
-	HASH_ADD(hh, g_digest_list, nonce, 32, dt);
+	if (sub->multi->group)
+		camhttp_group_release(sub->multi->group);
 
-	++digest_count;
-	return dt;
+	free(sub->multi);
+	sub->multi = NULL;
 }
 
-http_response_t * on_check_digest(http_request_t *request)
+void camhttp_on_release(http_client_t *client, camhttp_subscriber_t *sub)
 {
-	//HA1=MD5(A1)=MD5(username:realm:password)
-	//HA2=MD5(A2)=MD5(method:digestURI)
-	//response=MD5(HA1:nonce:nonceCount:clientNonce:qop:HA2)
-	char temp[64];
-	md5ctx ctx;
-	unsigned char digest[16];
-	http_parameter_t parameter[4];
-	http_response_t *response;
-	http_digest_t *dt;
+	camhttp_device_t *device;
 
-	check_digest_expire();
+	device = &g_camhttp.devices[sub->index];
 
-	if (!g_digest_ha1[0])
-		return NULL;
+	if (sub->prev)
+		sub->prev->next = sub->next;
+	else
+		device->subscribers = sub->next;
+
+	if (sub->next)
+		sub->next->prev = sub->prev;
 
-	if (request->digest[0] == '\0')
+	if (sub->type == REQUEST_TYPE_STREAM || sub->type == REQUEST_TYPE_MULTI
+		|| sub->type == REQUEST_TYPE_REPLAY)
 	{
-		goto __proc_failure;
+		--device->streams;
+		--g_camhttp.streams;
 	}
 
+	if (sub->multi)
+		camhttp_multi_detach(sub);
 
-	memset(parameter, 0, sizeof(parameter));
-	parameter[0].key = "nonce";
-	parameter[1].key = "nc";
-	parameter[2].key = "cnonce";
-	parameter[3].key = "response";
-
-	if (!get_http_parameter(request->digest, parameter, sizeof(parameter) / sizeof(http_parameter_t)))
+	if (sub->replay)
 	{
-		LOGWARN("get_http_parameter failed\n");
-		goto __proc_failure;
+		pevent_free(sub->replay->timer);
+		playback_close(&sub->replay->cursor);
+		free(sub->replay);
 	}
 
+	free(sub);
+}
 
-	//ha2
-	md5_init(&ctx);
-	MD5_UPDATE_STRING(&ctx, "GET:");
-	MD5_UPDATE_STRING(&ctx, request->path);
+//upgrade records carry the subscriber as one int
+int camhttp_subscriber_encode(camhttp_subscriber_t *sub)
+{
+	return sub->fps << 24 | sub->scale << 20 | sub->type << 16 | sub->priority << 8 | sub->index;
+}
 
-	if (request->param[0])
+camhttp_subscriber_t * camhttp_subscriber_decode(http_client_t *client, int value)
+{
+	int fps, scale, type, priority, index;
+	camhttp_subscriber_t *sub;
+
+	fps = value >> 24 & 0x7f;
+	scale = value >> 20 & 0x3;
+	type = value >> 16 & 0xf;
+	priority = value >> 8 & 0xff;
+	index = value & 0xff;
+
+	if (index >= MAX_VIDEO_COUNT || priority >= CAMHTTP_CLASS_COUNT
+		|| (type != REQUEST_TYPE_SNAPSHORT && type != REQUEST_TYPE_STREAM
+			&& type != REQUEST_TYPE_MULTI))
 	{
-		MD5_UPDATE_STRING(&ctx, "?");
-		MD5_UPDATE_STRING(&ctx, request->param);
+		return NULL;
 	}
 
-	md5_final(digest, &ctx);
-	hex2string(digest, 16, temp, 64);
+	sub = camhttp_subscriber_new(client, type, index, priority);
+	sub->scale = scale;
+	sub->fps = fps;
 
+	return sub;
+}
 
-	//response
-	md5_init(&ctx);
-	MD5_UPDATE_STRING(&ctx, g_digest_ha1);
-	MD5_UPDATE_STRING(&ctx, ":");
-	MD5_UPDATE_STRING(&ctx, parameter[0].value);
-	MD5_UPDATE_STRING(&ctx, ":");
-	MD5_UPDATE_STRING(&ctx, parameter[1].value);
-	MD5_UPDATE_STRING(&ctx, ":");
-	MD5_UPDATE_STRING(&ctx, parameter[2].value);
-	MD5_UPDATE_STRING(&ctx, ":");
-	MD5_UPDATE_STRING(&ctx, "auth");
-	MD5_UPDATE_STRING(&ctx, ":");
-	MD5_UPDATE_STRING(&ctx, temp);
-	md5_final(digest, &ctx);
-	hex2string(digest, 16, temp, 64);
+int camhttp_get_queued(int index)
+{
+	int i, queued;
+	camhttp_subscriber_t *sub;
 
-	LOGDEBUG("response:%s %s\n", temp, parameter[3].value);
+	queued = 0;
 
-	if (memcmp(temp, parameter[3].value, 16) == 0)
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
 	{
-		if (strcmp(parameter[0].value, HTTP_DIGEST_NONCE) == 0)
+		if (index >= 0 && i != index)
+			continue;
+
+		for (sub = g_camhttp.devices[i].subscribers; sub; sub = sub->next)
 		{
-			dt = new_digest(request);
-			if (dt == NULL)
-				return http_response_new(500, NULL, "can not create digest data");
+			queued += http_client_get_queued(sub->client);
+		}
+	}
 
-			response = http_response_new(401, NULL);
-			http_response_addheader(response, "WWW-Authenticate: Digest "\
-				"realm=\"" HTTP_DIGEST_REALM "\","
-				"qop=\"auth\","
-				"nonce=\"%s\","
-				"stale=TRUE",
-				dt->nonce);
+	return queued;
+}
 
-			LOGINFO("login success(%s:%u new digest:%s)\n",
-				http_client_getip(request->client),
-				http_client_getport(request->client),
-				dt->nonce);
+//heap behind the stream viewers, connection and subscriber
+int camhttp_get_stream_memory()
+{
+	int i, j, bytes;
+	camhttp_subscriber_t *sub;
+	camhttp_group_t *group;
 
-			return response;
-		}
-		else
-		{
-			if (strlen(parameter[0].value) != 32)
-				goto __proc_failure;
+	bytes = 0;
 
-			HASH_FIND(hh, g_digest_list, parameter[0].value, 32, dt);
-			if (dt == NULL)
-				goto __proc_failure;
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		for (sub = g_camhttp.devices[i].subscribers; sub; sub = sub->next)
+		{
+			if (sub->type != REQUEST_TYPE_STREAM && sub->type != REQUEST_TYPE_MULTI)
+				continue;
 
-			if (dt->count != strtol(parameter[1].value, NULL, 16))
-				goto __proc_failure;
+			bytes += sizeof(camhttp_subscriber_t) + http_client_get_memory(sub->client);
 
-			++dt->count;
-			dt->check_time = time(NULL);
-			return NULL;
+			if (sub->multi)
+				bytes += sizeof(camhttp_multi_t);
 		}
 	}
 
+	for (group = g_camhttp.groups; group; group = group->next)
+	{
+		bytes += sizeof(camhttp_group_t) + group->parts_max;
+		for (j = 0; j < MAX_VIDEO_COUNT; ++j)
+			bytes += group->slots[j].max;
+	}
 
-__proc_failure:
-	response = http_response_new(401, NULL);
-	http_response_addheader(response, "WWW-Authenticate: Digest "\
-		"realm=\"" HTTP_DIGEST_REALM "\","
-		"qop=\"auth\","
-		"nonce=\"" HTTP_DIGEST_NONCE "\"");
-
-	return response;
+	return bytes;
 }
 
-http_response_t * camhttp_on_send_jpeg(http_client_t *client, video_read_data_t *data, int flag)
+//lowest class first, the most backlogged viewer inside a class
+camhttp_subscriber_t * camhttp_find_victim(int index, int priority)
 {
-	http_response_t *response;
+	int i;
+	camhttp_subscriber_t *sub, *victim;
 
+	victim = NULL;
 
-	if (data == NULL || data->index != flag << 16 >> 16)
-		return NULL;
+	//multi camera viewers are listed on their first device only
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		for (sub = g_camhttp.devices[i].subscribers; sub; sub = sub->next)
+		{
+			if (index >= 0 && i != index
+				&& (sub->multi == NULL || !(sub->multi->devices & 1 << index)))
+			{
+				continue;
+			}
 
-	
-	if (flag >> 16 == REQUEST_TYPE_SNAPSHORT)
+			if ((sub->type != REQUEST_TYPE_STREAM && sub->type != REQUEST_TYPE_MULTI
+				&& sub->type != REQUEST_TYPE_REPLAY) || sub->priority >= priority || sub->shed)
+			{
+				continue;
+			}
+
+			if (victim == NULL
+				|| sub->priority < victim->priority
+				|| (sub->priority == victim->priority
+				&& http_client_get_queued(sub->client) > http_client_get_queued(victim->client)))
+			{
+				victim = sub;
+			}
+		}
+	}
+
+	return victim;
+}
+
+//room on every device of the mask. the viewers to shed are only picked
+//while planning, none is closed unless all devices have room then
+int camhttp_admit(int type, unsigned int devices, int priority)
+{
+	int i, j, scope, queued;
+	int streams[MAX_VIDEO_COUNT], device_queued[MAX_VIDEO_COUNT];
+	int total_streams, total_queued;
+	camhttp_admission_t *admission;
+	camhttp_device_t *device;
+	camhttp_subscriber_t *sub, *victim;
+
+	admission = &g_camhttp.admission;
+
+	//what the picked viewers free once they are closed
+	memset(streams, 0, sizeof(streams));
+	memset(device_queued, 0, sizeof(device_queued));
+	total_streams = 0;
+	total_queued = 0;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
 	{
-		response = http_response_new(200, NULL);
+		if (!(devices & 1 << i))
+			continue;
 
-		http_response_addheader(response, "Pragma: no-cache");
-		http_response_addheader(response,
-			"Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0");
-		http_response_addheader(response, "Content-Type: image/jpeg");
+		device = &g_camhttp.devices[i];
 
-		http_response_set_data(response, data->buf, data->size);
+		while (1)
+		{
+			if (type == REQUEST_TYPE_STREAM
+				&& admission->max_device_stream > 0
+				&& device->streams - streams[i] >= admission->max_device_stream)
+			{
+				scope = i;
+			}
+			else if (type == REQUEST_TYPE_STREAM
+				&& admission->max_stream > 0
+				&& g_camhttp.streams - total_streams >= admission->max_stream)
+			{
+				scope = -1;
+			}
+			else if (admission->max_device_queued > 0
+				&& camhttp_get_queued(i) - device_queued[i] >= admission->max_device_queued)
+			{
+				scope = i;
+			}
+			else if (admission->max_queued > 0
+				&& camhttp_get_queued(-1) - total_queued >= admission->max_queued)
+			{
+				scope = -1;
+			}
+			else
+			{
+				break;
+			}
 
-		http_client_set_delay(client, NULL);
+			//snapshots never push out a running stream
+			victim = type == REQUEST_TYPE_STREAM ? camhttp_find_victim(scope, priority) : NULL;
+			if (victim == NULL)
+				goto __refuse;
 
-		return response;
+			victim->shed = 1;
+
+			++total_streams;
+			for (j = 0; j < MAX_VIDEO_COUNT; ++j)
+			{
+				if (j == victim->index || (victim->multi && (victim->multi->devices & 1 << j)))
+					++streams[j];
+			}
+
+			queued = http_client_get_queued(victim->client);
+			device_queued[victim->index] += queued;
+			total_queued += queued;
+		}
 	}
-	else if (flag >> 16 == REQUEST_TYPE_STREAM)
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
 	{
-		response = http_response_new(0, NULL);
+		sub = g_camhttp.devices[i].subscribers;
+		while (sub)
+		{
+			if (!sub->shed)
+			{
+				sub = sub->next;
+				continue;
+			}
 
-		http_response_addheader(response, "--[data-boundary-data]");
-		http_response_addheader(response, "Content-Type: image/jpeg");
-		http_response_addheader(response, "Content-Length: %d", data->size);
-		http_response_addheader(response, "X-Timestamp  /: %d.%06d",
-			(int)data->timestamp->tv_sec,
-			(int)data->timestamp->tv_usec);
+			LOGINFO("shed stream(%s:%u class:%s device:%d)\n",
+				http_client_getip(sub->client),
+				http_client_getport(sub->client),
+				CAMHTTP_CLASS_NAME[sub->priority],
+				sub->index);
 
-		http_response_set_data(response, data->buf, data->size);
+			++g_camhttp.shed;
+			http_client_close(sub->client);
 
-		return response;
+			//the list changed under the closed viewer
+			sub = g_camhttp.devices[i].subscribers;
+		}
 	}
 
-	http_client_set_delay(client, NULL);
-	return NULL;
+	return 0;
+
+__refuse:
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		for (sub = g_camhttp.devices[i].subscribers; sub; sub = sub->next)
+			sub->shed = 0;
+	}
+
+	++g_camhttp.refused;
+	return -1;
 }
 
-void camhttp_on_video_read(const char *buf, int size, struct timeval *timestamp, v4l2port_t *video)
+http_response_t * camhttp_refuse()
 {
-	video_read_data_t data;
-
+	http_response_t *response;
 
-	data.buf = (char *)buf;
-	data.size = size;
-	data.timestamp = timestamp;
-	data.index = video->profile.value;
+	response = http_response_new(503, NULL);
+	http_response_addheader(response, "Retry-After: %d", CAMHTTP_RETRY_AFTER);
 
-	if (http_server_keeplive_delay_iter(g_service, (http_delay_callback)camhttp_on_send_jpeg, &data) > 0)
-	{
-		video_manager_set_check_time(video);
-	}
+	return response;
 }
 
-http_response_t * on_get_root(http_request_t *request)
+void camhttp_set_admission(const camhttp_admission_t *admission)
 {
-	return http_response_new(200, "<html><body>"\
-		"<a href='/snapshot'>snapshot</a><br>"\
-		"<a href='/stream'>stream</a><br>"\
-		"<a href='/status'>status</a><br>"\
-		"</body></html>");
+	memcpy(&g_camhttp.admission, admission, sizeof(camhttp_admission_t));
 }
 
-http_response_t * on_get_snapshot(http_request_t *request)
+//comma separated addresses, a bad one is skipped
+int camhttp_set_recorders(const char *list)
 {
-	int n;
-	v4l2port_t *video;
-	
+	char addr[16];
+	const char *p, *end;
+	int len;
+	unsigned int ip;
 
-	n = atoi(request->param);
+	g_camhttp.recorder_count = 0;
 
-	video = video_manager_get(n);
-	if (video == NULL)
+	for (p = list; *p != '\0'; p = *end == ',' ? end + 1 : end)
 	{
-		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
-	}
+		end = strchr(p, ',');
+		if (end == NULL)
+			end = p + strlen(p);
 
-	if (video_manager_stream_start(n) == -1)
-	{
-		return http_response_new(200, "<html><body>start stream failure:%d</body></html>", n);
-	}
+		len = end - p;
+		if (len <= 0 || len >= (int)sizeof(addr))
+			continue;
 
-	http_client_set_delay(request->client, (void *)(REQUEST_TYPE_SNAPSHORT << 16 | n));
+		memcpy(addr, p, len);
+		addr[len] = '\0';
 
-	return NULL;
+		ip = inet_addr(addr);
+		if (ip == INADDR_NONE)
+		{
+			LOGWARN("recorder address invalid(%s)\n", addr);
+			continue;
+		}
+
+		if (g_camhttp.recorder_count >= CAMHTTP_MAX_RECORDER)
+		{
+			LOGWARN("recorder addresses over %d\n", CAMHTTP_MAX_RECORDER);
+			break;
+		}
+
+		g_camhttp.recorders[g_camhttp.recorder_count++] = ip;
+	}
+
+	return g_camhttp.recorder_count;
 }
 
-http_response_t * on_get_stream(http_request_t *request)
+http_response_t * on_check_digest(http_request_t *request)
 {
-	int n;
+	int ret;
+	char uri[HTTP_MAX_URI_SIZE];
+	char challenge[128];
+	unsigned int ip;
 	http_response_t *response;
 
+	if (!digest_enabled())
+		return NULL;
+
+	snprintf(uri, sizeof(uri), "%s%s%s",
+		request->path,
+		request->param[0] ? "?" : "",
+		request->param);
+
+	ip = inet_addr(http_client_getip(request->client));
 
-	if (strlen(request->param) == 0)
+	ret = digest_verify("GET", uri, request->digest, ip);
+	if (ret == DIGEST_OK)
+		return NULL;
+
+	if (ret == DIGEST_STALE)
 	{
-		return http_response_new(200, "<html><body><img src='/stream?0'/></body></html>");
+		LOGINFO("digest stale(%s:%u)\n",
+			http_client_getip(request->client),
+			http_client_getport(request->client));
 	}
-	else
+
+	digest_challenge(challenge, sizeof(challenge), ip, ret == DIGEST_STALE);
+
+	response = http_response_new(401, NULL);
+	http_response_addheader(response, "WWW-Authenticate: %s", challenge);
+
+	return response;
+}
+
+static camhttp_variant_t * camhttp_variant_new(video_read_data_t *data, int scale, const int *crop)
+{
+	camhttp_variant_t *variant;
+	jpeg_frame_t cropped;
+	char *buf;
+	int max;
+
+	variant = fcalloc(1, sizeof(camhttp_variant_t));
+	variant->scale = scale;
+	memcpy(variant->crop, crop, sizeof(variant->crop));
+	variant->size = -1;
+
+	variant->next = data->variants;
+	data->variants = variant;
+
+	if (data->parsed == -1 || crop[2] == -1)
+		return variant;
+
+	//the standard huffman tables may code worse than the camera's own
+	max = data->size + data->size / 4 + 1024;
+	variant->buf = fmalloc(max);
+
+	if (crop[2] == 0)
+	{
+		variant->size = jpeg_scale(&data->frame, scale, variant->buf, max);
+		return variant;
+	}
+
+	variant->size = jpeg_crop(&data->frame, crop[0], crop[1], crop[2], crop[3], variant->buf, max);
+	if (variant->size == -1 || scale == 0)
+		return variant;
+
+	buf = variant->buf;
+	variant->buf = fmalloc(max);
+
+	if (jpeg_parse(buf, variant->size, &cropped) == 0)
+		variant->size = jpeg_scale(&cropped, scale, variant->buf, max);
+	else
+		variant->size = -1;
+
+	free(buf);
+
+	return variant;
+}
+
+//the frame as the subscriber asked for it, converted once per frame for
+//everyone asking the same. frames the decoder rejects go out untouched
+static void camhttp_get_variant(video_read_data_t *data, camhttp_subscriber_t *sub, char **buf, int *size)
+{
+	camhttp_variant_t *variant;
+	int crop[4];
+
+	*buf = data->buf;
+	*size = data->size;
+
+	if (sub->scale == 0 && sub->crop[2] == 0)
+		return;
+
+	if (data->parsed == 0)
+		data->parsed = jpeg_parse(data->buf, data->size, &data->frame) == 0 ? 1 : -1;
+
+	//crops covering the same mcus share one variant, width -1 marks a
+	//rectangle off this frame
+	memcpy(crop, sub->crop, sizeof(crop));
+	if (crop[2] && data->parsed == 1 && jpeg_crop_align(&data->frame, crop) == -1)
+		memset(crop, -1, sizeof(crop));
+
+	for (variant = data->variants; variant; variant = variant->next)
+	{
+		if (variant->scale == sub->scale
+			&& memcmp(variant->crop, crop, sizeof(crop)) == 0)
+		{
+			break;
+		}
+	}
+
+	if (variant == NULL)
+		variant = camhttp_variant_new(data, sub->scale, crop);
+
+	if (variant->size > 0)
+	{
+		*buf = variant->buf;
+		*size = variant->size;
+	}
+}
+
+//the frame goes out in up to three pieces, the huffman tables missing in
+//many uvc frames are spliced in from a static buffer instead of a copy
+//where the standard huffman tables go into buf, -1 when they are not needed.
+//converted frames are written with the tables
+static int camhttp_get_dht(video_read_data_t *data, const char *buf)
+{
+	if (buf != data->buf)
+		return -1;
+
+	if (data->dht_offset == 0)
+	{
+		data->dht_offset = jpeg_dht_offset(data->buf, data->size);
+		if (data->dht_offset > 0)
+			++g_camhttp.devices[data->index].dht_frames;
+	}
+
+	return data->dht_offset;
+}
+
+static int camhttp_set_jpeg(http_response_t *response, video_read_data_t *data, char *buf, int size)
+{
+	const char *dht;
+	int dht_size, offset;
+
+	offset = camhttp_get_dht(data, buf);
+	if (offset < 0)
+	{
+		http_response_set_data(response, buf, size);
+		return size;
+	}
+
+	dht = jpeg_std_dht(&dht_size);
+
+	http_response_set_data(response, buf, offset);
+	http_response_add_data(response, dht, dht_size);
+	http_response_add_data(response, buf + offset, size - offset);
+
+	++g_camhttp.devices[data->index].dht_sends;
+
+	return size + dht_size;
+}
+
+static void camhttp_slot_copy(camhttp_slot_t *slot, video_read_data_t *data, char *buf, int size)
+{
+	const char *dht;
+	int dht_size, offset;
+
+	dht = NULL;
+	dht_size = 0;
+
+	offset = camhttp_get_dht(data, buf);
+	if (offset > 0)
+	{
+		dht = jpeg_std_dht(&dht_size);
+		++g_camhttp.devices[data->index].dht_sends;
+	}
+
+	if (slot->max < size + dht_size)
+	{
+		slot->max = size + dht_size;
+		slot->buf = frealloc(slot->buf, slot->max);
+	}
+
+	if (dht)
+	{
+		memcpy(slot->buf, buf, offset);
+		memcpy(slot->buf + offset, dht, dht_size);
+		memcpy(slot->buf + offset + dht_size, buf + offset, size - offset);
+	}
+	else
+	{
+		memcpy(slot->buf, buf, size);
+	}
+
+	slot->size = size + dht_size;
+	slot->timestamp = *data->timestamp;
+}
+
+static void camhttp_group_append(camhttp_group_t *group, const char *buf, int size)
+{
+	if (group->parts_max < group->parts_size + size)
+	{
+		group->parts_max = ((group->parts_size + size) / 4096 + 1) * 4096;
+		group->parts = frealloc(group->parts, group->parts_max);
+	}
+
+	memcpy(group->parts + group->parts_size, buf, size);
+	group->parts_size += size;
+}
+
+//the frame goes into the pending tick. the tick is sent once all devices
+//that made the last one have a frame or it is align ms old, its parts are
+//built here once for all viewers of the group
+static void camhttp_group_feed(camhttp_group_t *group,
+	video_read_data_t *data, char *buf, int size)
+{
+	camhttp_slot_t *slot;
+	char header[256];
+	unsigned int bit, ahead;
+	int i, len;
+
+	if (group->ready == 0)
+		group->tick = gettickcount();
+
+	bit = 1 << data->index;
+	ahead = group->ready & bit;
+
+	group->ready |= bit;
+	camhttp_slot_copy(&group->slots[data->index], data, buf, size);
+
+	//a stalled device is waited for once, then left out until it is back.
+	//a device a frame ahead of the others closes the tick with its newer frame
+	if (!ahead && (group->live | group->ready) != group->ready
+		&& gettickcount() - group->tick < group->align)
+	{
+		return;
+	}
+
+	group->first = -1;
+	group->parts_size = 0;
+	group->live = group->ready;
+	group->sent = group->ready;
+	group->ready = 0;
+	++group->gen;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		if (!(group->sent & 1 << i))
+			continue;
+
+		slot = &group->slots[i];
+
+		//its headers go into the response, the frame leads the parts
+		if (group->first == -1)
+		{
+			group->first = i;
+			group->first_size = slot->size;
+			group->first_timestamp = slot->timestamp;
+			camhttp_group_append(group, slot->buf, slot->size);
+			continue;
+		}
+
+		len = snprintf(header, sizeof(header),
+			"--[data-boundary-data]\r\n"
+			"Content-Type: image/jpeg\r\n"
+			"Content-Length: %d\r\n"
+			"X-Camera: %d\r\n"
+			"X-Timestamp: %d.%06d\r\n\r\n",
+			slot->size, i,
+			(int)slot->timestamp.tv_sec,
+			(int)slot->timestamp.tv_usec);
+
+		camhttp_group_append(group, header, len);
+		camhttp_group_append(group, slot->buf, slot->size);
+	}
+}
+
+//each part names its camera. with align the devices' frames leave together
+static http_response_t * camhttp_on_send_multi(video_read_data_t *data,
+	camhttp_subscriber_t *sub)
+{
+	camhttp_multi_t *multi;
+	camhttp_group_t *group;
+	http_response_t *response;
+	char *buf;
+	int i, size;
+
+	multi = sub->multi;
+	group = multi->group;
+
+	if (group == NULL)
+	{
+		camhttp_get_variant(data, sub, &buf, &size);
+
+		response = http_response_new(0, NULL);
+
+		http_response_addheader(response, "--[data-boundary-data]");
+		http_response_addheader(response, "Content-Type: image/jpeg");
+		http_response_addheader(response, "Content-Length: %d",
+			camhttp_set_jpeg(response, data, buf, size));
+		http_response_addheader(response, "X-Camera: %d", data->index);
+		http_response_addheader(response, "X-Timestamp: %d.%06d",
+			(int)data->timestamp->tv_sec,
+			(int)data->timestamp->tv_usec);
+
+		++g_camhttp.devices[data->index].sent;
+
+		return response;
+	}
+
+	//the first viewer of the group to see the frame hands it over
+	if (group->sequence[data->index] != data->sequence)
+	{
+		group->sequence[data->index] = data->sequence;
+
+		camhttp_get_variant(data, sub, &buf, &size);
+		camhttp_group_feed(group, data, buf, size);
+	}
+
+	if (multi->gen == group->gen)
+		return NULL;
+
+	multi->gen = group->gen;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		if (group->sent & 1 << i)
+			++g_camhttp.devices[i].sent;
+	}
+
+	response = http_response_new(0, NULL);
+
+	http_response_addheader(response, "--[data-boundary-data]");
+	http_response_addheader(response, "Content-Type: image/jpeg");
+	http_response_addheader(response, "Content-Length: %d", group->first_size);
+	http_response_addheader(response, "X-Camera: %d", group->first);
+	http_response_addheader(response, "X-Timestamp: %d.%06d",
+		(int)group->first_timestamp.tv_sec,
+		(int)group->first_timestamp.tv_usec);
+
+	http_response_set_data(response, group->parts, group->parts_size);
+
+	return response;
+}
+
+//true for frames a slower subscriber skips. due times advance by the
+//interval so the rate holds on average whatever the capture rate, a
+//quarter interval of slack absorbs the capture jitter
+static int camhttp_decimate(camhttp_subscriber_t *sub, struct timeval *timestamp)
+{
+	uint64_t now_us, interval_us;
+
+	if (sub->fps == 0)
+		return 0;
+
+	now_us = timestamp->tv_sec * 1000000ULL + timestamp->tv_usec;
+	interval_us = 1000000 / sub->fps;
+
+	if (now_us + interval_us / 4 < sub->due_us)
+		return 1;
+
+	//behind by more than a frame after a stall or a clock step, a frame
+	//inside the slack ahead of due_us keeps the schedule
+	if (now_us > sub->due_us + interval_us)
+		sub->due_us = now_us;
+
+	sub->due_us += interval_us;
+
+	return 0;
+}
+
+//skip a frame while half of the previous one is still unsent in the kernel,
+//pushing it would only pile up in write_buf. a congestion window that can
+//not carry the frames at their rate gets them one scale step smaller, back
+//once it carries twice the rate
+static int camhttp_pace(http_client_t *client, camhttp_subscriber_t *sub)
+{
+	http_pace_t pace;
+	v4l2port_t *video;
+	long long need;
+	int fps;
+
+	if (http_client_get_pace(client, &pace) == -1)
+		return 0;
+
+	if (pace.unsent > sub->sent_size / 2)
+		return 1;
+
+	video = video_manager_get(sub->index);
+	fps = sub->fps ? sub->fps : (video ? video->profile.fps : 0);
+
+	if (pace.rate == 0 || fps == 0 || sub->scale >= CAMHTTP_MAX_SCALE)
+		return 0;
+
+	need = (long long)sub->frame_size * fps;
+
+	if (!sub->downgrade && pace.rate < need)
+	{
+		LOGDEBUG("downgrade stream(%s:%u rate:%d need:%lld)\n",
+			http_client_getip(client), http_client_getport(client), pace.rate, need);
+		sub->downgrade = 1;
+	}
+	else if (sub->downgrade && pace.rate >= need * 2)
+	{
+		LOGDEBUG("restore stream(%s:%u rate:%d need:%lld)\n",
+			http_client_getip(client), http_client_getport(client), pace.rate, need);
+		sub->downgrade = 0;
+	}
+
+	return 0;
+}
+
+http_response_t * camhttp_on_send_jpeg(http_client_t *client, video_read_data_t *data, camhttp_subscriber_t *sub)
+{
+	http_response_t *response;
+	camhttp_subscriber_t low;
+	uint64_t due_us;
+	char *buf;
+	int size;
+
+
+	if (data == NULL || sub->type == REQUEST_TYPE_REPLAY)
+		return NULL;
+
+	if (sub->type == REQUEST_TYPE_MULTI)
+	{
+		if (!(sub->multi->devices & 1 << data->index))
+			return NULL;
+
+		return camhttp_on_send_multi(data, sub);
+	}
+
+	if (data->index != sub->index)
+		return NULL;
+
+	due_us = sub->due_us;
+
+	if (sub->type == REQUEST_TYPE_STREAM
+		&& camhttp_decimate(sub, data->timestamp))
+	{
+		++g_camhttp.devices[sub->index].decimated;
+		return NULL;
+	}
+
+	//a paced frame was never sent, it must not use up its slot in the schedule
+	if (sub->type == REQUEST_TYPE_STREAM && camhttp_pace(client, sub))
+	{
+		sub->due_us = due_us;
+		++g_camhttp.devices[sub->index].paced;
+		return NULL;
+	}
+
+	if (sub->type == REQUEST_TYPE_STREAM && sub->downgrade)
+	{
+		low = *sub;
+		++low.scale;
+		camhttp_get_variant(data, &low, &buf, &size);
+
+		++g_camhttp.devices[sub->index].downgraded;
+	}
+	else
+	{
+		camhttp_get_variant(data, sub, &buf, &size);
+		sub->frame_size = size;
+	}
+
+	sub->sent_size = size;
+
+	
+	if (sub->type == REQUEST_TYPE_SNAPSHORT)
+	{
+		response = http_response_new(200, NULL);
+
+		//stored but revalidated, pollers come back with If-None-Match
+		http_response_addheader(response, "Cache-Control: no-cache, max-age=0");
+		http_response_addheader(response, "ETag: \"%x-%u\"", g_epoch, data->sequence);
+		http_response_addheader(response, "X-Sequence: %u", data->sequence);
+		http_response_addheader(response, "Content-Type: image/jpeg");
+
+		camhttp_set_jpeg(response, data, buf, size);
+
+		http_client_set_delay(client, NULL);
+
+		return response;
+	}
+	else if (sub->type == REQUEST_TYPE_STREAM)
+	{
+		response = http_response_new(0, NULL);
+
+		http_response_addheader(response, "--[data-boundary-data]");
+		http_response_addheader(response, "Content-Type: image/jpeg");
+		http_response_addheader(response, "Content-Length: %d",
+			camhttp_set_jpeg(response, data, buf, size));
+		http_response_addheader(response, "X-Timestamp  /: %d.%06d",
+			(int)data->timestamp->tv_sec,
+			(int)data->timestamp->tv_usec);
+
+		++g_camhttp.devices[sub->index].sent;
+
+		return response;
+	}
+
+	http_client_set_delay(client, NULL);
+	return NULL;
+}
+
+//drops the converted copies, the frame itself stays
+static void camhttp_data_clear(video_read_data_t *data)
+{
+	camhttp_variant_t *variant;
+
+	while (data->variants)
+	{
+		variant = data->variants;
+		data->variants = variant->next;
+
+		free(variant->buf);
+		free(variant);
+	}
+
+	data->parsed = 0;
+	data->dht_offset = 0;
+}
+
+static void camhttp_cache_frame(camhttp_device_t *device, video_read_data_t *data)
+{
+	video_read_data_t *cache;
+
+	cache = &device->cache;
+	camhttp_data_clear(cache);
+
+	if (gettickcount() > device->cache_until)
+	{
+		free(cache->buf);
+		cache->buf = NULL;
+		cache->sequence = 0;
+		device->cache_max = 0;
+		return;
+	}
+
+	if (device->cache_max < data->size)
+	{
+		device->cache_max = data->size;
+		cache->buf = frealloc(cache->buf, device->cache_max);
+	}
+
+	memcpy(cache->buf, data->buf, data->size);
+	cache->size = data->size;
+	cache->dht_offset = data->dht_offset;
+	cache->index = data->index;
+	cache->sequence = data->sequence;
+
+	device->cache_timestamp = *data->timestamp;
+	cache->timestamp = &device->cache_timestamp;
+}
+
+void camhttp_on_video_read(const char *buf, int size, struct timeval *timestamp, v4l2port_t *video)
+{
+	video_read_data_t data;
+	camhttp_device_t *device;
+
+
+	memset(&data, 0, sizeof(data));
+	data.buf = (char *)buf;
+	data.size = size;
+	data.timestamp = timestamp;
+	data.index = video->profile.value;
+
+	device = &g_camhttp.devices[data.index];
+	data.sequence = ++device->sequence;
+	device->frame_time = gettickcount();
+
+	if (http_server_keeplive_delay_iter(g_service, (http_delay_callback)camhttp_on_send_jpeg, &data) > 0)
+	{
+		video_manager_set_check_time(video);
+	}
+
+	camhttp_cache_frame(device, &data);
+
+	camhttp_data_clear(&data);
+}
+
+http_response_t * on_get_root(http_request_t *request)
+{
+	return http_response_new(200, "<html><body>"\
+		"<a href='/snapshot'>snapshot</a><br>"\
+		"<a href='/stream'>stream</a><br>"\
+		"<a href='/streams'>streams</a><br>"\
+		"<a href='/status'>status</a><br>"\
+		"<a href='/log'>log</a><br>"\
+		"<a href='/metrics'>metrics</a><br>"\
+		"<a href='/multicast'>multicast</a><br>"\
+		"<a href='/record'>record</a><br>"\
+		"<a href='/playback'>playback</a><br>"\
+		"<a href='/motion'>motion</a><br>"\
+		"</body></html>");
+}
+
+static int camhttp_wait_arm(unsigned long deadline)
+{
+	struct itimerspec spec;
+	unsigned long now;
+	int fd;
+
+	if (g_wait_timer == NULL)
+	{
+		fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd == -1)
+			return -1;
+
+		g_wait_timer = pevent_new(g_base, fd, (pevent_callback)camhttp_on_wait_timer, NULL);
+		pevent_set_priority(g_wait_timer, PEVENT_PRIORITY_HIGH);
+		if (pevent_set(g_wait_timer, PEVENT_READ) == -1)
+		{
+			pevent_free(g_wait_timer);
+			g_wait_timer = NULL;
+			return -1;
+		}
+	}
+
+	if (g_wait_deadline && g_wait_deadline <= deadline)
+		return 0;
+
+	g_wait_deadline = deadline;
+
+	now = gettickcount();
+	deadline = deadline > now ? deadline - now : 1;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = deadline / 1000;
+	spec.it_value.tv_nsec = deadline % 1000 * 1000000;
+
+	return timerfd_settime(pevent_get_fd(g_wait_timer), 0, &spec, NULL);
+}
+
+//parked long polls past their deadline get 304 and the sequence they have
+void camhttp_on_wait_timer(pevent_t *pevent, int event, void *ptr)
+{
+	uint64_t expirations;
+	unsigned long now, next;
+	unsigned int after;
+	int i;
+	camhttp_subscriber_t *sub, *next_sub;
+	http_client_t *client;
+	http_response_t *response;
+
+	if (read(pevent_get_fd(pevent), &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	now = gettickcount();
+	next = 0;
+	g_wait_deadline = 0;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		for (sub = g_camhttp.devices[i].subscribers; sub; sub = next_sub)
+		{
+			next_sub = sub->next;
+
+			if (sub->deadline == 0)
+				continue;
+
+			if (sub->deadline > now)
+			{
+				if (next == 0 || sub->deadline < next)
+					next = sub->deadline;
+
+				continue;
+			}
+
+			++g_camhttp.devices[i].long_poll_timeouts;
+
+			client = sub->client;
+			after = sub->after;
+
+			http_client_set_delay(client, NULL);
+
+			response = http_response_new(304, NULL);
+			http_response_addheader(response, "Cache-Control: no-cache, max-age=0");
+			http_response_addheader(response, "X-Sequence: %u", after);
+			http_client_respond(client, response);
+		}
+	}
+
+	if (next)
+		camhttp_wait_arm(next);
+}
+
+//after=N answers with the newest frame when the client has not seen it yet,
+//otherwise the client waits for the next one up to wait=ms
+http_response_t * camhttp_long_poll(http_request_t *request, camhttp_subscriber_t *wanted,
+	unsigned int after, int wait)
+{
+	camhttp_device_t *device;
+	camhttp_subscriber_t *sub;
+	http_response_t *response;
+
+	device = &g_camhttp.devices[wanted->index];
+	device->cache_until = gettickcount() + wait + CAMHTTP_CACHE_TIME;
+	++device->long_polls;
+
+	if (device->cache.buf && device->cache.sequence != after)
+	{
+		//converted copies stay with the cache until the next frame
+		response = camhttp_on_send_jpeg(request->client, &device->cache, wanted);
+		if (response)
+			return response;
+	}
+
+	if (camhttp_wait_arm(gettickcount() + wait) == -1)
+		return http_response_new(500, NULL);
+
+	sub = camhttp_subscriber_new(request->client, REQUEST_TYPE_SNAPSHORT, wanted->index, wanted->priority);
+	sub->scale = wanted->scale;
+	memcpy(sub->crop, wanted->crop, sizeof(sub->crop));
+	sub->after = after;
+	sub->deadline = gettickcount() + wait;
+
+	return NULL;
+}
+
+//the poller already has the newest frame while the device keeps capturing,
+//answered at once instead of waiting for the next one
+http_response_t * camhttp_not_modified(http_request_t *request, int index, v4l2port_t *video)
+{
+	camhttp_device_t *device;
+	char etag[HTTP_MAX_ETAG_SIZE];
+	http_response_t *response;
+
+	device = &g_camhttp.devices[index];
+
+	if (request->etag[0] == '\0' || device->sequence == 0
+		|| gettickcount() - device->frame_time > CAMHTTP_ETAG_FRESH)
+	{
+		return NULL;
+	}
+
+	snprintf(etag, sizeof(etag), "\"%x-%u\"", g_epoch, device->sequence);
+	if (strcmp(request->etag, etag) != 0)
+		return NULL;
+
+	++device->not_modified;
+
+	//pollers count as viewers, the device keeps running for them
+	video_manager_set_check_time(video);
+
+	response = http_response_new(304, NULL);
+	http_response_addheader(response, "Cache-Control: no-cache, max-age=0");
+	http_response_addheader(response, "ETag: %s", etag);
+
+	return response;
+}
+
+http_response_t * on_get_snapshot(http_request_t *request)
+{
+	int n;
+	int priority;
+	int scale;
+	int crop[4];
+	int wait;
+	unsigned int after;
+	char value[16];
+	v4l2port_t *video;
+	camhttp_subscriber_t *sub, wanted;
+	http_response_t *response;
+	
+
+	n = atoi(request->param);
+
+	video = video_manager_get(n);
+	if (video == NULL)
+	{
+		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+	}
+
+	scale = camhttp_get_scale(request);
+	if (scale == -1)
+	{
+		return http_response_new(400, "<html><body>scale is 2, 4 or 8</body></html>");
+	}
+
+	if (camhttp_get_crop(request, video, crop) == -1)
+	{
+		return http_response_new(400, "<html><body>crop is x,y,width,height inside %dx%d</body></html>",
+			video->profile.width, video->profile.height);
+	}
+
+	wait = 0;
+	if (camhttp_get_param(request->param, "after", value, sizeof(value)) == 0)
+	{
+		after = strtoul(value, NULL, 10);
+		wait = CAMHTTP_DEFAULT_WAIT;
+
+		if (camhttp_get_param(request->param, "wait", value, sizeof(value)) == 0)
+		{
+			wait = atoi(value);
+			if (wait < 1 || wait > CAMHTTP_MAX_WAIT)
+				return http_response_new(400, "<html><body>wait is 1 to %d ms</body></html>", CAMHTTP_MAX_WAIT);
+		}
+	}
+	else
+	{
+		response = camhttp_not_modified(request, n, video);
+		if (response)
+			return response;
+	}
+
+	priority = camhttp_get_class(request);
+	if (camhttp_admit(REQUEST_TYPE_SNAPSHORT, 1 << n, priority) == -1)
+	{
+		return camhttp_refuse();
+	}
+
+	if (video_manager_stream_start(n) == -1)
+	{
+		return http_response_new(200, "<html><body>start stream failure:%d</body></html>", n);
+	}
+
+	if (wait)
+	{
+		memset(&wanted, 0, sizeof(wanted));
+		wanted.type = REQUEST_TYPE_SNAPSHORT;
+		wanted.index = n;
+		wanted.priority = priority;
+		wanted.scale = scale;
+		memcpy(wanted.crop, crop, sizeof(wanted.crop));
+
+		return camhttp_long_poll(request, &wanted, after, wait);
+	}
+
+	sub = camhttp_subscriber_new(request->client, REQUEST_TYPE_SNAPSHORT, n, priority);
+	sub->scale = scale;
+	memcpy(sub->crop, crop, sizeof(sub->crop));
+
+	return NULL;
+}
+
+http_response_t * on_get_stream(http_request_t *request)
+{
+	int n;
+	int priority;
+	int scale;
+	int fps;
+	int crop[4];
+	v4l2port_t *video;
+	http_response_t *response;
+	camhttp_subscriber_t *sub;
+
+
+	if (strlen(request->param) == 0)
+	{
+		return http_response_new(200, "<html><body><img src='/stream?0'/></body></html>");
+	}
+	else
+	{
+		n = atoi(request->param);
+
+		video = video_manager_get(n);
+		if (video == NULL)
+		{
+			return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+		}
+
+		scale = camhttp_get_scale(request);
+		if (scale == -1)
+		{
+			return http_response_new(400, "<html><body>scale is 2, 4 or 8</body></html>");
+		}
+
+		fps = camhttp_get_fps(request);
+		if (fps == -1)
+		{
+			return http_response_new(400, "<html><body>fps is 1 to %d</body></html>", CAMHTTP_MAX_FPS);
+		}
+
+		if (camhttp_get_crop(request, video, crop) == -1)
+		{
+			return http_response_new(400, "<html><body>crop is x,y,width,height inside %dx%d</body></html>",
+				video->profile.width, video->profile.height);
+		}
+
+		if (http_client_set_stream(request->client) == -1)
+		{
+			response = http_response_new(429, NULL);
+			http_response_addheader(response, "Retry-After: 5");
+			return response;
+		}
+
+		priority = camhttp_get_class(request);
+		if (camhttp_admit(REQUEST_TYPE_STREAM, 1 << n, priority) == -1)
+		{
+			http_client_clear_stream(request->client);
+			return camhttp_refuse();
+		}
+
+		if (video_manager_stream_start(n) == -1)
+		{
+			http_client_clear_stream(request->client);
+			return http_response_new(200, "<html><body>start stream failure:%d</body></html>", n);
+		}
+
+		response = http_response_new(200, NULL);
+		http_response_addheader(response, "Pragma: no-cache");
+		http_response_addheader(response,
+			"Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0");
+
+		http_response_addheader(response,
+			"Content-Type: multipart/x-mixed-replace;boundary=[data-boundary-data]");
+
+		sub = camhttp_subscriber_new(request->client, REQUEST_TYPE_STREAM, n, priority);
+		sub->scale = scale;
+		sub->fps = fps;
+		memcpy(sub->crop, crop, sizeof(sub->crop));
+
+		return response;
+	}
+}
+
+//devices are the comma list ahead of the other parameters, /streams?0,1&align=40
+http_response_t * on_get_streams(http_request_t *request)
+{
+	int n;
+	int i;
+	int first;
+	int priority;
+	int scale;
+	int align;
+	unsigned int devices;
+	char value[16];
+	const char *p;
+	char *end;
+	http_response_t *response;
+	camhttp_subscriber_t *sub;
+
+
+	if (strlen(request->param) == 0)
+	{
+		return http_response_new(200, "<html><body><img src='/streams?0,1'/></body></html>");
+	}
+
+	devices = 0;
+	first = -1;
+	p = request->param;
+
+	while (1)
+	{
+		n = strtol(p, &end, 10);
+		if (end == p || n < 0 || n >= MAX_VIDEO_COUNT || video_manager_get(n) == NULL)
+		{
+			return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+		}
+
+		devices |= 1 << n;
+		if (first == -1)
+			first = n;
+
+		if (*end != ',')
+			break;
+
+		p = end + 1;
+	}
+
+	align = 0;
+	if (camhttp_get_param(request->param, "align", value, sizeof(value)) == 0)
+	{
+		align = atoi(value);
+		if (align < 1 || align > CAMHTTP_MAX_ALIGN)
+			return http_response_new(400, "<html><body>align is 1 to %d ms</body></html>", CAMHTTP_MAX_ALIGN);
+	}
+
+	scale = camhttp_get_scale(request);
+	if (scale == -1)
+	{
+		return http_response_new(400, "<html><body>scale is 2, 4 or 8</body></html>");
+	}
+
+	if (http_client_set_stream(request->client) == -1)
+	{
+		response = http_response_new(429, NULL);
+		http_response_addheader(response, "Retry-After: 5");
+		return response;
+	}
+
+	//held to the stream limit of every device in the set
+	priority = camhttp_get_class(request);
+	if (camhttp_admit(REQUEST_TYPE_STREAM, devices, priority) == -1)
+	{
+		http_client_clear_stream(request->client);
+		return camhttp_refuse();
+	}
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		if ((devices & 1 << i) && video_manager_stream_start(i) == -1)
+		{
+			http_client_clear_stream(request->client);
+			return http_response_new(503, "<html><body>start stream failure:%d</body></html>", i);
+		}
+	}
+
+	response = http_response_new(200, NULL);
+	http_response_addheader(response, "Pragma: no-cache");
+	http_response_addheader(response,
+		"Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0");
+
+	http_response_addheader(response,
+		"Content-Type: multipart/x-mixed-replace;boundary=[data-boundary-data]");
+
+	sub = camhttp_subscriber_new(request->client, REQUEST_TYPE_MULTI, first, priority);
+	sub->scale = scale;
+	camhttp_multi_attach(sub, devices, align);
+
+	return response;
+}
+
+http_response_t * on_get_status(http_request_t *request)
+{
+	int n;
+	v4l2port_t *video;
+	
+	n = atoi(request->param);
+
+	video = video_manager_get(n);
+	if (video == NULL)
+	{
+		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+	}
+
+	return http_response_new(200, "<html><body>"\
+		"<p>init:<a href='/control?n=%d&c=reinit'>%s</a></p>"\
+		"<p>stream:%s</p>"\
+		"<p>card:%s</p>"\
+		"<p>path:%s</p>"\
+		"<p>width:%u</p>"\
+		"<p>height:%u</p>"\
+		"<p>timeperframe:%d/%d</p>"\
+		"<p>support:%s&nbsp;%s&nbsp;%s</p>"\
+		"<p>timeout:%d</p>"\
+		"<p>error:%s</p>"\
+		"<p>errno:%s</p>"\
+		"<p>cache:%u</p>"\
+		"<p>memory:%uk</p>"\
+		"<p>jiffies:%u</p>"\
+		"<p>digest:%u</p>"\
+		"<a href='/'>back</a><br/></body></html>",
+		n, video->init_flag ? "true" : "false",
+		video->stream_flag ? "on" : "off",
+		video->cap.card,
+		video->profile.device,
+		video->profile.width,
+		video->profile.height,
+		video->streamparm.parm.capture.timeperframe.numerator,
+		video->streamparm.parm.capture.timeperframe.denominator,
+		video->fmtdesc[0].description,
+		video->fmtdesc[1].description,
+		video->fmtdesc[2].description,
+		video_manager_get_timeout(),
+		v4l2port_strerror(video),
+		v4l2port_strerrno(video),
+		REQ_BUFFER_MAX,
+		read_memory_status(),
+		read_cpu_jiffies(),
+		digest_count());
+}
+
+http_response_t * on_get_control(http_request_t *request)
+{
+	int n;
+	char control[25];
+	v4l2port_t *video;
+	
+
+	if (sscanf(request->param, "n=%d&c=%24s", &n, control) != 2)
+	{
+		return http_response_new(200, "<html><body>param erro(%s)</body></html>", request->param);
+	}
+
+	if (strcmp(control, "upgrade") == 0)
+	{
+		upgrade_request();
+		return http_response_new(200, "<html><body>upgrade start<br/><a href='/'>back</a></body></html>");
+	}
+
+	video = video_manager_get(n);
+	if (video == NULL)
+	{
+		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+	}
+
+	if (strcmp(control, "reinit") == 0)
+	{
+		if (video_manager_init_video(n) == -1)
+		{
+			return http_response_new(200, "<html><body>reinit failure(%d)<br/><a href='/'>back</a></body></html>", n);
+		}
+		else
+		{
+			return http_response_new(200, "<html><body>reinit success(%d)<br/><a href='/'>back</a></body></html>", n);
+		}
+	}
+	else
+	{
+		return http_response_new(200, "<html><body>unknow control:%s</body></html>", control);
+	}
+
+	return NULL;
+}
+
+http_response_t * on_get_multicast(http_request_t *request)
+{
+	int n, port, ttl;
+	char group[16], value[16];
+	char sdp[512];
+	http_response_t *response;
+
+	n = atoi(request->param);
+
+	if (video_manager_get(n) == NULL)
+	{
+		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+	}
+
+	if (camhttp_get_param(request->param, "stop", value, sizeof(value)) == 0)
+	{
+		multicast_stop(n);
+		return http_response_new(200, "<html><body>multicast stop(%d)<br/><a href='/'>back</a></body></html>", n);
+	}
+
+	if (camhttp_get_param(request->param, "group", group, sizeof(group)) == 0)
+	{
+		port = MULTICAST_DEFAULT_PORT;
+		if (camhttp_get_param(request->param, "port", value, sizeof(value)) == 0)
+			port = atoi(value);
+
+		ttl = MULTICAST_DEFAULT_TTL;
+		if (camhttp_get_param(request->param, "ttl", value, sizeof(value)) == 0)
+			ttl = atoi(value);
+
+		if (port <= 0 || port > 0xffff || multicast_start(n, group, port, ttl) == -1)
+		{
+			return http_response_new(200, "<html><body>multicast start failure(%d)<br/><a href='/'>back</a></body></html>", n);
+		}
+	}
+
+	//players open this description to join the group
+	if (multicast_describe(n, sdp, sizeof(sdp)) == -1)
+	{
+		return http_response_new(404, NULL);
+	}
+
+	response = http_response_new(200, "%s", sdp);
+	http_response_addheader(response, "Content-Type: application/sdp");
+
+	return response;
+}
+
+http_response_t * on_get_record(http_request_t *request)
+{
+	int n;
+	char value[16];
+	recorder_stat_t stat;
+
+	n = atoi(request->param);
+
+	if (recorder_get_dir() == NULL)
+	{
+		return http_response_new(200, "<html><body>recorder disabled, set %s<br/><a href='/'>back</a></body></html>", RECORDER_ENV);
+	}
+
+	if (video_manager_get(n) == NULL)
+	{
+		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+	}
+
+	if (camhttp_get_param(request->param, "stop", value, sizeof(value)) == 0)
+	{
+		recorder_stop(n);
+	}
+	else if (camhttp_get_param(request->param, "start", value, sizeof(value)) == 0
+		&& recorder_start(n) == -1)
+	{
+		return http_response_new(200, "<html><body>record start failure(%d)<br/><a href='/'>back</a></body></html>", n);
+	}
+
+	recorder_get_stat(n, &stat);
+
+	return http_response_new(200, "<html><body>"\
+		"<p>device:%d</p>"\
+		"<p>recording:%d</p>"\
+		"<p>segment:%s/cam%d/seg%03d</p>"\
+		"<p>frames:%u</p>"\
+		"<p>dropped:%u</p>"\
+		"<p>bytes:%llu</p>"\
+		"<a href='/record?%d&start=1'>start</a>&nbsp;"\
+		"<a href='/record?%d&stop=1'>stop</a><br/>"\
+		"<a href='/'>back</a><br/></body></html>",
+		n, stat.recording, recorder_get_dir(), n, stat.slot,
+		stat.frames, stat.dropped, stat.bytes, n, n);
+}
+
+//recording time in a parameter, seconds since the epoch
+int camhttp_get_time(http_request_t *request, const char *key, uint64_t *timestamp_us)
+{
+	char value[32];
+	double seconds;
+
+	if (camhttp_get_param(request->param, key, value, sizeof(value)) == -1)
+		return -1;
+
+	seconds = strtod(value, NULL);
+	if (seconds <= 0)
+		return -1;
+
+	*timestamp_us = (uint64_t)(seconds * 1000000);
+
+	return 0;
+}
+
+http_response_t * on_get_playback(http_request_t *request)
+{
+	int n;
+	uint64_t timestamp_us;
+	playback_cursor_t cursor;
+	const recorder_index_t *frame;
+	http_response_t *response;
+
+	if (recorder_get_dir() == NULL)
+	{
+		return http_response_new(200, "<html><body>recorder disabled, set %s<br/><a href='/'>back</a></body></html>", RECORDER_ENV);
+	}
+
+	n = atoi(request->param);
+
+	if (n < 0 || n >= MAX_VIDEO_COUNT || camhttp_get_time(request, "t", &timestamp_us) == -1)
+	{
+		return http_response_new(200, "<html><body>"\
+			"<p>/playback?N&t=SECONDS frame of device N at a time</p>"\
+			"<p>/replay?N&t=SECONDS[&end=SECONDS][&speed=X] recording from a time</p>"\
+			"<a href='/'>back</a><br/></body></html>");
+	}
+
+	if (playback_seek(&cursor, n, timestamp_us) == -1)
+	{
+		return http_response_new(404, NULL);
+	}
+
+	frame = playback_frame(&cursor);
+	if (frame->timestamp_us > timestamp_us + PLAYBACK_MAX_GAP * 1000000ULL
+		|| !playback_valid(&cursor))
+	{
+		playback_close(&cursor);
+		return http_response_new(404, NULL);
+	}
+
+	response = http_response_new(200, NULL);
+	http_response_addheader(response, "Content-Type: image/jpeg");
+	http_response_addheader(response, "Content-Length: %u", frame->size);
+	http_response_addheader(response, "X-Timestamp: %llu.%06llu",
+		(unsigned long long)(frame->timestamp_us / 1000000),
+		(unsigned long long)(frame->timestamp_us % 1000000));
+
+	if (http_response_set_file(response, cursor.data_fd, frame->offset, frame->size) == -1)
+	{
+		http_response_free(response);
+		response = http_response_new(500, NULL);
+	}
+
+	playback_close(&cursor);
+
+	return response;
+}
+
+static uint64_t camhttp_now_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void camhttp_replay_arm(camhttp_replay_t *replay, uint64_t due_ns)
+{
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = due_ns / 1000000000;
+	spec.it_value.tv_nsec = due_ns % 1000000000;
+
+	//a zero time would disarm
+	if (due_ns == 0)
+		spec.it_value.tv_nsec = 1;
+
+	timerfd_settime(pevent_get_fd(replay->timer), TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void camhttp_on_replay_timer(pevent_t *pevent, int event, camhttp_subscriber_t *sub)
+{
+	uint64_t expirations;
+	uint64_t last_us;
+	camhttp_replay_t *replay;
+	http_client_t *client;
+	http_response_t *response;
+	const recorder_index_t *frame;
+
+	if (read(pevent_get_fd(pevent), &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	replay = sub->replay;
+	client = sub->client;
+
+	//the viewer sets the pace when it cannot keep up
+	if (http_client_get_queued(client) > 0)
+	{
+		replay->start_ns += CAMHTTP_REPLAY_RETRY * 1000000ULL;
+		camhttp_replay_arm(replay, camhttp_now_ns() + CAMHTTP_REPLAY_RETRY * 1000000ULL);
+		return;
+	}
+
+	frame = playback_frame(&replay->cursor);
+	if (replay->done || frame == NULL
+		|| frame->timestamp_us > replay->end_us
+		|| !playback_valid(&replay->cursor))
+	{
+		http_client_set_delay(client, NULL);
+		http_client_close(client);
+		return;
+	}
+
+	response = http_response_new(0, NULL);
+	http_response_addheader(response, "--[data-boundary-data]");
+	http_response_addheader(response, "Content-Type: image/jpeg");
+	http_response_addheader(response, "Content-Length: %u", frame->size);
+	http_response_addheader(response, "X-Timestamp: %llu.%06llu",
+		(unsigned long long)(frame->timestamp_us / 1000000),
+		(unsigned long long)(frame->timestamp_us % 1000000));
+
+	//mid stream there is no status left to send, the viewer sees the end
+	if (http_response_set_file(response, replay->cursor.data_fd, frame->offset, frame->size) == -1)
+	{
+		LOGWARN("replay file error fd:%d\n", replay->cursor.data_fd);
+		http_response_free(response);
+		http_client_set_delay(client, NULL);
+		http_client_close(client);
+		return;
+	}
+
+	if (http_client_respond(client, response) == -1)
+		return; //already free
+
+	last_us = frame->timestamp_us;
+
+	if (playback_next(&replay->cursor) == -1
+		|| playback_frame(&replay->cursor)->timestamp_us > replay->end_us)
+	{
+		replay->done = 1;
+		camhttp_replay_arm(replay, 0);
+		return;
+	}
+
+	//a stop of the recorder is not waited out, the clock skips past it
+	frame = playback_frame(&replay->cursor);
+	if (frame->timestamp_us - last_us > PLAYBACK_MAX_GAP * 1000000ULL)
+	{
+		replay->start_ns -= (uint64_t)((frame->timestamp_us - last_us
+			- PLAYBACK_MAX_GAP * 1000000ULL) * 1000 / replay->speed);
+	}
+
+	camhttp_replay_arm(replay, replay->start_ns
+		+ (uint64_t)((frame->timestamp_us - replay->first_us) * 1000 / replay->speed));
+}
+
+http_response_t * on_get_replay(http_request_t *request)
+{
+	int n, fd;
+	int priority;
+	char value[16];
+	uint64_t timestamp_us;
+	camhttp_replay_t *replay;
+	camhttp_subscriber_t *sub;
+	http_response_t *response;
+
+	n = atoi(request->param);
+
+	if (recorder_get_dir() == NULL || n < 0 || n >= MAX_VIDEO_COUNT
+		|| camhttp_get_time(request, "t", &timestamp_us) == -1)
+	{
+		return on_get_playback(request);
+	}
+
+	replay = fcalloc(1, sizeof(camhttp_replay_t));
+	replay->speed = 1;
+	replay->end_us = UINT64_MAX;
+
+	camhttp_get_time(request, "end", &replay->end_us);
+
+	if (camhttp_get_param(request->param, "speed", value, sizeof(value)) == 0)
+		replay->speed = strtod(value, NULL);
+
+	if (replay->speed <= 0 || replay->speed > PLAYBACK_MAX_SPEED)
+	{
+		free(replay);
+		return http_response_new(400, NULL);
+	}
+
+	if (playback_seek(&replay->cursor, n, timestamp_us) == -1)
+	{
+		free(replay);
+		return http_response_new(404, NULL);
+	}
+
+	if (http_client_set_stream(request->client) == -1)
+	{
+		playback_close(&replay->cursor);
+		free(replay);
+
+		response = http_response_new(429, NULL);
+		http_response_addheader(response, "Retry-After: 5");
+		return response;
+	}
+
+	//a replay is a stream to the admission, it may shed and be shed
+	priority = camhttp_get_class(request);
+	if (camhttp_admit(REQUEST_TYPE_STREAM, 1 << n, priority) == -1)
+	{
+		playback_close(&replay->cursor);
+		free(replay);
+		http_client_clear_stream(request->client);
+		return camhttp_refuse();
+	}
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd >= 0)
 	{
-		n = atoi(request->param);
+		replay->timer = pevent_new(g_base, fd, (pevent_callback)camhttp_on_replay_timer, NULL);
+		pevent_set_priority(replay->timer, PEVENT_PRIORITY_HIGH);
+		if (pevent_set(replay->timer, PEVENT_READ) == -1)
+		{
+			pevent_free(replay->timer);
+			fd = -1;
+		}
+	}
+
+	if (fd == -1)
+	{
+		playback_close(&replay->cursor);
+		free(replay);
+		return http_response_new(500, NULL);
+	}
+
+	replay->first_us = playback_frame(&replay->cursor)->timestamp_us;
+	replay->start_ns = camhttp_now_ns();
+
+	sub = camhttp_subscriber_new(request->client, REQUEST_TYPE_REPLAY, n, priority);
+	sub->replay = replay;
+
+	pevent_set_ptr(replay->timer, sub);
+	camhttp_replay_arm(replay, replay->start_ns);
+
+	response = http_response_new(200, NULL);
+	http_response_addheader(response, "Cache-Control: no-store");
+	http_response_addheader(response,
+		"Content-Type: multipart/x-mixed-replace;boundary=[data-boundary-data]");
+
+	return response;
+}
+
+http_response_t * on_get_motion(http_request_t *request)
+{
+	int n, i, z, count;
+	char value[32];
+	motion_zone_t zone;
+	motion_stat_t stat;
+	motion_event_t events[MOTION_MAX_EVENT];
+	http_response_t *response;
+
+	n = atoi(request->param);
+
+	if (video_manager_get(n) == NULL)
+	{
+		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+	}
 
-		if (video_manager_get(n) == NULL)
+	//polled by alert scripts, one event per line
+	if (camhttp_get_param(request->param, "after", value, sizeof(value)) == 0)
+	{
+		response = http_response_new(200, NULL);
+		http_response_addheader(response, "Content-Type: text/plain");
+
+		count = motion_get_events(strtoul(value, NULL, 10), events, MOTION_MAX_EVENT);
+		for (i = 0; i < count; ++i)
 		{
-			return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+			if (events[i].index != n)
+				continue;
+
+			http_response_append_data(response, "%u %d %d %ld %ld %d\n",
+				events[i].id, events[i].index, events[i].zone,
+				(long)events[i].start, (long)events[i].end, events[i].peak);
 		}
 
-		if (video_manager_stream_start(n) == -1)
+		return response;
+	}
+
+	if (camhttp_get_param(request->param, "enable", value, sizeof(value)) == 0
+		&& motion_enable(n, atoi(value)) == -1)
+	{
+		return http_response_new(200, "<html><body>motion enable failure(%d)<br/><a href='/'>back</a></body></html>", n);
+	}
+
+	if (camhttp_get_param(request->param, "zone", value, sizeof(value)) == 0)
+	{
+		z = atoi(value);
+
+		if (motion_get_zone(n, z, &zone) == -1)
+			return http_response_new(400, NULL);
+
+		if (zone.threshold == 0)
 		{
-			return http_response_new(200, "<html><body>start stream failure:%d</body></html>", n);
+			zone.width = 100;
+			zone.height = 100;
+			zone.threshold = MOTION_DEFAULT_THRESHOLD;
+			zone.area = MOTION_DEFAULT_AREA;
 		}
 
-		response = http_response_new(200, NULL);
-		http_response_addheader(response, "Pragma: no-cache");
-		http_response_addheader(response,
-			"Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0");
+		zone.enabled = 1;
 
-		http_response_addheader(response,
-			"Content-Type: multipart/x-mixed-replace;boundary=[data-boundary-data]");
+		if (camhttp_get_param(request->param, "rect", value, sizeof(value)) == 0
+			&& sscanf(value, "%d,%d,%d,%d", &zone.x, &zone.y, &zone.width, &zone.height) != 4)
+		{
+			return http_response_new(400, NULL);
+		}
 
-		http_client_set_delay(request->client, (void *)(REQUEST_TYPE_STREAM << 16 | n));
+		if (camhttp_get_param(request->param, "threshold", value, sizeof(value)) == 0)
+			zone.threshold = atoi(value);
 
-		return response;
+		if (camhttp_get_param(request->param, "area", value, sizeof(value)) == 0)
+			zone.area = atoi(value);
+
+		if (camhttp_get_param(request->param, "off", value, sizeof(value)) == 0)
+			zone.enabled = 0;
+
+		if (motion_set_zone(n, z, &zone) == -1)
+			return http_response_new(400, NULL);
+	}
+
+	motion_get_stat(n, &stat);
+
+	response = http_response_new(200, "<html><body>"\
+		"<p>device:%d</p>"\
+		"<p>enabled:%d <a href='/motion?%d&enable=1'>on</a>&nbsp;<a href='/motion?%d&enable=0'>off</a></p>"\
+		"<p>blocks:%dx%d</p>"\
+		"<p>frames:%u</p>"\
+		"<p>skipped:%u</p>"\
+		"<p>errors:%u</p>"\
+		"<p>events:%u</p>",
+		n, stat.enabled, n, n, stat.width, stat.height,
+		stat.frames, stat.skipped, stat.errors, stat.events);
+
+	for (z = 0; z < MOTION_MAX_ZONE; ++z)
+	{
+		motion_get_zone(n, z, &zone);
+		if (!zone.enabled)
+			continue;
+
+		http_response_append(response,
+			"<p>zone %d:%d,%d,%d,%d threshold:%d area:%d%% level:%d%%%s</p>",
+			z, zone.x, zone.y, zone.width, zone.height,
+			zone.threshold, zone.area, stat.level[z], stat.active[z] ? " motion" : "");
+	}
+
+	count = motion_get_events(0, events, MOTION_MAX_EVENT);
+	for (i = count - 1; i >= 0; --i)
+	{
+		if (events[i].index == n)
+		{
+			http_response_append(response, "<p>event %u zone:%d start:%ld end:%ld peak:%d%%</p>",
+				events[i].id, events[i].zone, (long)events[i].start, (long)events[i].end, events[i].peak);
+		}
 	}
+
+	http_response_append(response, "<a href='/'>back</a><br/></body></html>");
+
+	return response;
 }
 
-http_response_t * on_get_status(http_request_t *request)
+http_response_t * on_get_log(http_request_t *request)
 {
-	int n;
-	v4l2port_t *video;
-	
-	n = atoi(request->param);
+	int level;
 
-	video = video_manager_get(n);
-	if (video == NULL)
+	if (sscanf(request->param, "level=%d", &level) == 1)
 	{
-		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
+		log_set_level(level);
 	}
 
 	return http_response_new(200, "<html><body>"\
-		"<p>init:<a href='/control?n=%d&c=reinit'>%s</a></p>"\
-		"<p>stream:%s</p>"\
-		"<p>card:%s</p>"\
-		"<p>path:%s</p>"\
-		"<p>width:%u</p>"\
-		"<p>height:%u</p>"\
-		"<p>timeperframe:%d/%d</p>"\
-		"<p>support:%s&nbsp;%s&nbsp;%s</p>"\
-		"<p>timeout:%d</p>"\
-		"<p>error:%s</p>"\
-		"<p>errno:%s</p>"\
-		"<p>cache:%u</p>"\
-		"<p>memory:%uk</p>"\
-		"<p>jiffies:%u</p>"\
-		"<p>digest:%u</p>"\
+		"<p>level:%d</p>"\
+		"<p>dropped:%u</p>"\
+		"<p>suppressed:%u</p>"\
+		"<a href='/log?level=0'>error</a>&nbsp;"\
+		"<a href='/log?level=1'>warn</a>&nbsp;"\
+		"<a href='/log?level=2'>info</a>&nbsp;"\
+		"<a href='/log?level=3'>debug</a><br/>"\
 		"<a href='/'>back</a><br/></body></html>",
-		n, video->init_flag ? "true" : "false",
-		video->stream_flag ? "on" : "off",
-		video->cap.card,
-		video->profile.device,
-		video->profile.width,
-		video->profile.height,
-		video->streamparm.parm.capture.timeperframe.numerator,
-		video->streamparm.parm.capture.timeperframe.denominator,
-		video->fmtdesc[0].description,
-		video->fmtdesc[1].description,
-		video->fmtdesc[2].description,
-		video_manager_get_timeout(),
-		v4l2port_strerror(video),
-		v4l2port_strerrno(video),
-		REQ_BUFFER_MAX,
-		read_memory_status(),
-		read_cpu_jiffies(),
-		HASH_COUNT(g_digest_list));
+		log_get_level(),
+		log_get_dropped(),
+		log_get_suppressed());
 }
 
-http_response_t * on_get_control(http_request_t *request)
+http_response_t * on_get_metrics(http_request_t *request)
 {
-	int n;
-	char control[25];
+	int i;
+	multicast_stat_t stat;
+	recorder_stat_t record;
+	motion_stat_t motion;
+	http_pace_t pace;
+	int z;
+	char client[48];
 	v4l2port_t *video;
-	
+	camhttp_subscriber_t *sub;
+	http_response_t *response;
 
-	if (sscanf(request->param, "n=%d&c=%24s", &n, control) != 2)
-	{
-		return http_response_new(200, "<html><body>param erro(%s)</body></html>", request->param);
-	}
+	response = http_response_new(200, NULL);
+	http_response_addheader(response, "Content-Type: text/plain");
 
-	video = video_manager_get(n);
-	if (video == NULL)
-	{
-		return http_response_new(200, "<html><body>can not find device:%d</body></html>", n);
-	}
+	http_server_metrics(g_service, response);
 
-	if (strcmp(control, "reinit") == 0)
+	http_response_append_data(response, "stream_viewers %d\n", g_camhttp.streams);
+	http_response_append_data(response, "stream_queued_bytes %d\n", camhttp_get_queued(-1));
+	http_response_append_data(response, "stream_memory_bytes %d\n", camhttp_get_stream_memory());
+	http_response_append_data(response, "stream_shed %u\n", g_camhttp.shed);
+	http_response_append_data(response, "stream_refused %u\n", g_camhttp.refused);
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
 	{
-		if (video_manager_init_video(n) == -1)
+		video = video_manager_get(i);
+		if (video == NULL)
+			continue;
+
+		http_response_append_data(response, "device_frames_captured{device=\"%d\"} %u\n",
+			i, video->frames);
+		http_response_append_data(response, "device_frames_trimmed{device=\"%d\"} %u\n",
+			i, video->trimmed);
+		http_response_append_data(response, "device_frames_corrupt{device=\"%d\"} %u\n",
+			i, video->corrupt);
+		http_response_append_data(response, "device_viewers{device=\"%d\"} %d\n",
+			i, g_camhttp.devices[i].streams);
+		http_response_append_data(response, "device_queued_bytes{device=\"%d\"} %d\n",
+			i, camhttp_get_queued(i));
+		http_response_append_data(response, "device_frames_sent{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].sent);
+		http_response_append_data(response, "device_frames_decimated{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].decimated);
+		http_response_append_data(response, "device_frames_paced{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].paced);
+		http_response_append_data(response, "device_frames_downgraded{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].downgraded);
+		http_response_append_data(response, "device_dht_frames{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].dht_frames);
+		http_response_append_data(response, "device_dht_sends{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].dht_sends);
+		http_response_append_data(response, "device_snapshots_not_modified{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].not_modified);
+		http_response_append_data(response, "device_long_polls{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].long_polls);
+		http_response_append_data(response, "device_long_poll_timeouts{device=\"%d\"} %u\n",
+			i, g_camhttp.devices[i].long_poll_timeouts);
+
+		if (multicast_get_stat(i, &stat) == 0)
 		{
-			return http_response_new(200, "<html><body>reinit failure(%d)<br/><a href='/'>back</a></body></html>", n);
+			http_response_append_data(response, "multicast_frames{device=\"%d\",group=\"%s:%u\"} %u\n",
+				i, stat.group, stat.port, stat.frames);
+			http_response_append_data(response, "multicast_packets{device=\"%d\",group=\"%s:%u\"} %u\n",
+				i, stat.group, stat.port, stat.packets);
+			http_response_append_data(response, "multicast_dropped{device=\"%d\",group=\"%s:%u\"} %u\n",
+				i, stat.group, stat.port, stat.dropped);
 		}
-		else
+
+		if (recorder_get_stat(i, &record) == 0)
 		{
-			return http_response_new(200, "<html><body>reinit success(%d)<br/><a href='/'>back</a></body></html>", n);
+			http_response_append_data(response, "record_frames{device=\"%d\"} %u\n", i, record.frames);
+			http_response_append_data(response, "record_dropped{device=\"%d\"} %u\n", i, record.dropped);
+			http_response_append_data(response, "record_segments{device=\"%d\"} %u\n", i, record.segments);
+			http_response_append_data(response, "record_bytes{device=\"%d\"} %llu\n", i, record.bytes);
+		}
+
+		if (motion_get_stat(i, &motion) == 0 && motion.enabled)
+		{
+			http_response_append_data(response, "motion_frames{device=\"%d\"} %u\n", i, motion.frames);
+			http_response_append_data(response, "motion_skipped{device=\"%d\"} %u\n", i, motion.skipped);
+			http_response_append_data(response, "motion_errors{device=\"%d\"} %u\n", i, motion.errors);
+			http_response_append_data(response, "motion_events{device=\"%d\"} %u\n", i, motion.events);
+
+			for (z = 0; z < MOTION_MAX_ZONE; ++z)
+			{
+				http_response_append_data(response, "motion_active{device=\"%d\",zone=\"%d\"} %d\n",
+					i, z, motion.active[z]);
+			}
 		}
 	}
-	else
+
+	//the pacing view of every stream viewer
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
 	{
-		return http_response_new(200, "<html><body>unknow control:%s</body></html>", control);
+		for (sub = g_camhttp.devices[i].subscribers; sub; sub = sub->next)
+		{
+			if (sub->type != REQUEST_TYPE_STREAM
+				|| http_client_get_pace(sub->client, &pace) == -1)
+			{
+				continue;
+			}
+
+			snprintf(client, sizeof(client), "%s:%u",
+				http_client_getip(sub->client), http_client_getport(sub->client));
+
+			http_response_append_data(response, "stream_client_unsent_bytes{device=\"%d\",client=\"%s\"} %d\n",
+				i, client, pace.unsent);
+			http_response_append_data(response, "stream_client_rtt_us{device=\"%d\",client=\"%s\"} %d\n",
+				i, client, pace.rtt);
+			http_response_append_data(response, "stream_client_rate_bytes{device=\"%d\",client=\"%s\"} %d\n",
+				i, client, pace.rate);
+			http_response_append_data(response, "stream_client_downgraded{device=\"%d\",client=\"%s\"} %d\n",
+				i, client, sub->downgrade);
+			http_response_append_data(response, "stream_client_latency_us{device=\"%d\",client=\"%s\"} %d\n",
+				i, client, http_client_get_latency(sub->client));
+		}
 	}
 
-	return NULL;
+	http_response_append_data(response, "digest_nonces %d\n", digest_count());
+	http_response_append_data(response, "log_dropped %u\n", log_get_dropped());
+	http_response_append_data(response, "log_suppressed %u\n", log_get_suppressed());
+	http_response_append_data(response, "memory_kb %d\n", read_memory_status());
+
+	return response;
 }
 
 http_response_t * on_reuqest(http_request_t *request)
@@ -583,8 +2541,16 @@ http_response_t * on_reuqest(http_request_t *request)
 			{ "/", on_get_root },
 			{ "/snapshot", on_get_snapshot },
 			{ "/stream", on_get_stream },
+			{ "/streams", on_get_streams },
 			{ "/status", on_get_status },
 			{ "/control", on_get_control },
+			{ "/log", on_get_log },
+			{ "/metrics", on_get_metrics },
+			{ "/multicast", on_get_multicast },
+			{ "/record", on_get_record },
+			{ "/playback", on_get_playback },
+			{ "/replay", on_get_replay },
+			{ "/motion", on_get_motion },
 	};
 
 	LOGDEBUG("http request:%s%s%s(%s:%u)\n",
@@ -610,41 +2576,253 @@ http_response_t * on_reuqest(http_request_t *request)
 	return http_response_new(404, NULL);
 }
 
+int camhttp_takeover(int sock)
+{
+	int type, fd, value;
+	int clients;
+	uint32_t crop, crop_size;
+	int devices;
+	http_client_t *client;
+	camhttp_subscriber_t *sub;
+
+	clients = 0;
+	crop = 0;
+	crop_size = 0;
+	devices = 0;
+
+	while (upgrade_recv(sock, &type, &fd, &value) == 0)
+	{
+		if (type == UPGRADE_RECORD_DONE)
+		{
+			LOGINFO("takeover done(clients:%d)\n", clients);
+			return 0;
+		}
+		else if (type == UPGRADE_RECORD_LISTEN && fd >= 0)
+		{
+			if (http_server_start_fd(g_service, fd) == -1)
+				return -1;
+		}
+		else if (type == UPGRADE_RECORD_CROP)
+		{
+			crop = value;
+		}
+		else if (type == UPGRADE_RECORD_CROP_SIZE)
+		{
+			crop_size = value;
+		}
+		else if (type == UPGRADE_RECORD_DEVICES)
+		{
+			devices = value;
+		}
+		else if (type == UPGRADE_RECORD_CLIENT && fd >= 0)
+		{
+			client = http_server_adopt(g_service, fd, NULL);
+			if (client == NULL)
+			{
+				crop = 0;
+				crop_size = 0;
+				devices = 0;
+				continue;
+			}
+
+			sub = camhttp_subscriber_decode(client, value);
+			if (sub == NULL || (sub->type == REQUEST_TYPE_MULTI && devices == 0))
+			{
+				http_client_close(client);
+				crop = 0;
+				crop_size = 0;
+				devices = 0;
+				continue;
+			}
+
+			//the per address stream count and latency follow the viewer
+			if (sub->type == REQUEST_TYPE_STREAM || sub->type == REQUEST_TYPE_MULTI
+				|| sub->type == REQUEST_TYPE_REPLAY)
+			{
+				http_client_keep_stream(client);
+			}
+
+			if (sub->type == REQUEST_TYPE_MULTI)
+			{
+				camhttp_multi_attach(sub, devices & 0xffff, devices >> 16);
+				devices = 0;
+			}
+
+			if (crop_size)
+			{
+				sub->crop[0] = crop >> 16;
+				sub->crop[1] = crop & 0xffff;
+				sub->crop[2] = crop_size >> 16;
+				sub->crop[3] = crop_size & 0xffff;
+				crop = 0;
+				crop_size = 0;
+			}
+
+			++clients;
+		}
+		else if (fd >= 0)
+		{
+			close(fd);
+		}
+	}
+
+	LOGERROR("takeover interrupted(clients:%d)\n", clients);
+
+	return http_server_get_fd(g_service) == -1 ? -1 : 0;
+}
+
 int camhttp_start(pevent_base_t *base,
 	unsigned short port,
-	const char *username, const char *password)
+	const char *username, const char *password,
+	int takeover_fd)
 {
-	md5ctx ctx;
-	unsigned char digest[16];
+	http_limit_t limit;
 
+	g_base = base;
+	g_epoch = time(NULL);
 	g_service = http_server_create(base, "0.0.0.0", port, on_reuqest);
 	if (!g_service)
 		return -1;
 
-	if (http_server_start(g_service) == -1)
-		return -1;
+	http_server_set_release_callback(g_service, (http_release_callback)camhttp_on_release);
 
-	
+	limit.max_conn = CAMHTTP_IP_MAX_CONN;
+	limit.max_stream = CAMHTTP_IP_MAX_STREAM;
+	limit.rate = CAMHTTP_IP_RATE;
+	limit.burst = CAMHTTP_IP_BURST;
+	http_server_set_limit(g_service, &limit);
+
+	if (takeover_fd >= 0)
+	{
+		if (camhttp_takeover(takeover_fd) == -1)
+		{
+			LOGWARN("takeover failure, start a new listener\n");
 
-	if (username && password)
+			if (http_server_start(g_service) == -1)
+				return -1;
+		}
+	}
+	else if (http_server_start(g_service) == -1)
 	{
-		md5_init(&ctx);
-		MD5_UPDATE_STRING(&ctx, username);
-		MD5_UPDATE_STRING(&ctx, ":" HTTP_DIGEST_REALM ":");
-		MD5_UPDATE_STRING(&ctx, password);
-		md5_final(digest, &ctx);
-		hex2string(digest, 16, g_digest_ha1, 64);
+		return -1;
 	}
+
+	
+
+	digest_init(username, password);
 	
 	LOGINFO("http server start(%s:%u)\n", "0.0.0.0", port);
 
 	return 0;
 }
 
+http_response_t * camhttp_on_resume(http_client_t *client, void *ptr, camhttp_subscriber_t *sub)
+{
+	int i;
+
+	if (sub->multi)
+	{
+		for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+		{
+			if ((sub->multi->devices & 1 << i) && video_manager_stream_start(i) == -1)
+			{
+				http_client_set_delay(client, NULL);
+				break;
+			}
+		}
+	}
+	else if (sub->type != REQUEST_TYPE_REPLAY
+		&& video_manager_stream_start(sub->index) == -1)
+	{
+		http_client_set_delay(client, NULL);
+	}
+
+	return NULL;
+}
+
+void camhttp_resume()
+{
+	http_server_keeplive_delay_iter(g_service, (http_delay_callback)camhttp_on_resume, NULL);
+}
+
+http_response_t * camhttp_on_handoff(http_client_t *client, int *sock, camhttp_subscriber_t *sub)
+{
+	//the replay position lives here, such viewers end with this process
+	if (sub->type == REQUEST_TYPE_REPLAY)
+		return NULL;
+
+	//the crop goes ahead of its client in pixels as asked, the new process
+	//aligns it to the mcus of its frames the same way
+	if (sub->crop[2] && (upgrade_send(*sock, UPGRADE_RECORD_CROP, -1,
+			(int)((uint32_t)sub->crop[0] << 16 | (uint32_t)sub->crop[1])) == -1
+		|| upgrade_send(*sock, UPGRADE_RECORD_CROP_SIZE, -1,
+			(int)((uint32_t)sub->crop[2] << 16 | (uint32_t)sub->crop[3])) == -1))
+	{
+		return NULL;
+	}
+
+	if (sub->multi && upgrade_send(*sock, UPGRADE_RECORD_DEVICES, -1,
+		sub->multi->align << 16 | sub->multi->devices) == -1)
+	{
+		return NULL;
+	}
+
+	if (upgrade_send(*sock, UPGRADE_RECORD_CLIENT,
+		http_client_getfd(client), camhttp_subscriber_encode(sub)) == 0)
+	{
+		//the new process owns the connection now
+		http_client_set_delay(client, NULL);
+	}
+
+	return NULL;
+}
+
+int camhttp_handoff(int sock)
+{
+	int count;
+
+	if (upgrade_send(sock, UPGRADE_RECORD_LISTEN, http_server_get_fd(g_service), 0) == -1)
+	{
+		LOGERROR("send listen fd error\n");
+		return -1;
+	}
+
+	//clients in the middle of a frame finish it here and are closed
+	count = http_server_keeplive_delay_iter(g_service,
+		(http_delay_callback)camhttp_on_handoff, &sock);
+
+	LOGINFO("handoff clients:%d\n", count);
+
+	return 0;
+}
+
+int camhttp_drain()
+{
+	http_server_stop(g_service);
+
+	return http_server_drain(g_service);
+}
+
+int camhttp_client_count()
+{
+	return http_server_client_count(g_service);
+}
+
 void camhttp_stop()
 {
+	int i;
+
 	http_server_stop(g_service);
 	http_server_cleanup(g_service);
-}
 
-void camhttp_stop();
+	if (g_wait_timer)
+		pevent_free(g_wait_timer);
+	g_wait_timer = NULL;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		camhttp_data_clear(&g_camhttp.devices[i].cache);
+		free(g_camhttp.devices[i].cache.buf);
+		g_camhttp.devices[i].cache.buf = NULL;
+	}
+}
\ No newline at end of file
@@ -5,15 +5,44 @@
 #include <sys/time.h>
 
 
+#define CAMHTTP_CLASS_PUBLIC		0
+#define CAMHTTP_CLASS_OPERATOR		1
+#define CAMHTTP_CLASS_RECORDER		2
+#define CAMHTTP_CLASS_COUNT			3
+
+#define CAMHTTP_RECORDER_ENV		"CAMLITE_RECORDER_ADDR"
+
+
 typedef struct _pevent_base pevent_base_t;
 typedef struct _v4l2port v4l2port_t;
 
+typedef struct _camhttp_admission
+{
+	int max_stream;			//stream viewers over all devices, 0 no limit
+	int max_device_stream;	//stream viewers per device, 0 no limit
+	int max_queued;			//bytes queued to clients over all devices
+	int max_device_queued;	//bytes queued to clients per device
+} camhttp_admission_t;
+
 void camhttp_on_video_read(const char *buf,
 	int size, struct timeval *timestamp, v4l2port_t *video);
 
 int camhttp_start(pevent_base_t *base,
 	unsigned short port,
-	const char *username, const char *password);
+	const char *username, const char *password,
+	int takeover_fd);
+
+void camhttp_set_admission(const camhttp_admission_t *admission);
+
+int camhttp_set_recorders(const char *list);
+
+void camhttp_resume();
+
+int camhttp_handoff(int sock);
+
+int camhttp_drain();
+
+int camhttp_client_count();
 
 void camhttp_stop();
 
@@ -1,35 +1,233 @@
 #include <signal.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
 #include "util.h"
 #include "camhttp.h"
+#include "pevent.h"
 #include "pevent_base.h"
 #include "video_manager.h"
+#include "upgrade.h"
+#include "rtsp.h"
+#include "multicast.h"
+#include "shmring.h"
+#include "recorder.h"
+#include "motion.h"
 
 #define CAMLITE_VERSION		"0.1"
+#define CAMLITE_DRAIN_TIMEOUT	2000
+#define CAMLITE_DRAIN_INTERVAL	100
 
 static pevent_base_t *g_base;
 
-void signal_handler(int sig)
+static pevent_t *g_signal_event;
+
+static int g_running = 1;
+
+static int g_shutdown;
+
+static unsigned long g_shutdown_deadline;
+
+//the new process of an upgrade not yet acked
+static pevent_t *g_upgrade_event;
+static pid_t g_upgrade_pid;
+static unsigned long g_upgrade_deadline;
+
+
+void camlite_shutdown()
 {
-	camhttp_stop();
-	LOGINFO("http cleanup\n");
+	if (g_shutdown)
+	{
+		//second request, stop waiting for the clients
+		g_shutdown_deadline = gettickcount();
+		return;
+	}
+
+	g_shutdown = 1;
+	g_shutdown_deadline = gettickcount() + CAMLITE_DRAIN_TIMEOUT;
+
+	LOGINFO("shutdown(clients:%d)\n", camhttp_drain());
+
+	//rtsp and shared ring clients reconnect on their own, nothing to drain
+	rtsp_stop();
+	shmring_stop();
+}
+
+void camlite_on_video_read(const char *buf, int size, struct timeval *timestamp, v4l2port_t *video)
+{
+	camhttp_on_video_read(buf, size, timestamp, video);
+	rtsp_on_video_read(buf, size, timestamp, video);
+	multicast_on_video_read(buf, size, timestamp, video);
+	shmring_on_video_read(buf, size, timestamp, video);
+	recorder_on_video_read(buf, size, timestamp, video);
+	motion_on_video_read(buf, size, timestamp, video);
+}
+
+void on_signal_event(pevent_t *pevent, int event, void *ptr)
+{
+	struct signalfd_siginfo info;
+
+	if (event != PEVENT_READ)
+	{
+		LOGERROR("signal event error\n");
+		return;
+	}
+
+	while (read(pevent_get_fd(pevent), &info, sizeof(info)) == sizeof(info))
+	{
+		switch (info.ssi_signo)
+		{
+		case SIGINT:
+		case SIGTERM:
+			camlite_shutdown();
+			break;
+		case SIGHUP:
+			LOGINFO("reload(failure:%d)\n", video_manager_reload());
+			camhttp_resume();
+			multicast_resume();
+			shmring_resume();
+			recorder_resume();
+			motion_resume();
+			break;
+		case SIGUSR2:
+			upgrade_request();
+			break;
+		}
+	}
+}
+
+int camlite_signal_init()
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
 
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		return -1;
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	g_signal_event = pevent_new(g_base, fd, on_signal_event, NULL);
+	if (pevent_set(g_signal_event, PEVENT_READ) == -1)
+	{
+		pevent_free(g_signal_event);
+		g_signal_event = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void camlite_upgrade_cancel()
+{
+	LOGERROR("upgrade process(%d) cancel\n", g_upgrade_pid);
+
+	pevent_free(g_upgrade_event);
+	g_upgrade_event = NULL;
+
+	upgrade_abort(g_upgrade_pid);
+}
+
+int camlite_handoff(int sock)
+{
+	if (camhttp_handoff(sock) == -1)
+	{
+		close(sock);
+		return -1;
+	}
+
+	//the new process opens the cameras once it gets the done record
+	multicast_cleanup();
+	recorder_cleanup();
+	motion_cleanup();
 	video_manager_cleanup();
-	LOGINFO("video cleanup\n");
+	upgrade_send(sock, UPGRADE_RECORD_DONE, -1, 0);
+	close(sock);
+
+	LOGINFO("upgrade success\n");
+
+	camlite_shutdown();
+
+	return 0;
+}
+
+//nothing is given away before the new binary runs
+void on_upgrade_event(pevent_t *pevent, int event, void *ptr)
+{
+	int sock, ret;
+
+	sock = pevent_get_fd(pevent);
+
+	ret = event == PEVENT_READ ? upgrade_ack(sock) : -1;
+	if (ret == 0)
+		return;
+
+	if (ret == -1)
+	{
+		camlite_upgrade_cancel();
+		return;
+	}
+
+	pevent_free_no_close(g_upgrade_event);
+	g_upgrade_event = NULL;
+
+	LOGINFO("upgrade process(%d) started\n", g_upgrade_pid);
+
+	camlite_handoff(sock);
+}
+
+//the ack is waited for in the loop, the cameras keep streaming meanwhile
+int camlite_upgrade(char *argv[])
+{
+	int sock;
+
+	if (g_upgrade_event != NULL)
+		return 0;
+
+	sock = upgrade_start(argv, &g_upgrade_pid);
+	if (sock == -1)
+		return -1;
+
+	g_upgrade_event = pevent_new(g_base, sock, on_upgrade_event, NULL);
+	if (pevent_set(g_upgrade_event, PEVENT_READ) == -1)
+	{
+		camlite_upgrade_cancel();
+		return -1;
+	}
+
+	g_upgrade_deadline = gettickcount() + UPGRADE_ACK_TIMEOUT;
+
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {	
 	char *device, *username, *password;
-	int width, height, fps, timeout, port;
+	int width, height, fps, timeout, port, rtsp_port;
+	int takeover_fd;
+	int wait;
+	unsigned long now;
+	const char *shm_path, *record_dir, *recorders;
 
 
+	if (log_init() == -1)
+	{
+		LOGWARN("log thread start failure, log to stderr directly\n");
+	}
+
 	LOGINFO("camlite version:%s\n\n", CAMLITE_VERSION);
 
-	if (argc != 9)
+	if (argc != 9 && argc != 10)
 	{
-		LOGINFO("usage: camlite DEVICE WIDTH HEIGHT FPS TIMEOUT PORT USERNAME PASSWORD\n\n");
+		LOGINFO("usage: camlite DEVICE WIDTH HEIGHT FPS TIMEOUT PORT USERNAME PASSWORD [RTSP_PORT]\n\n");
 		return 0;
 	}
 
@@ -41,6 +239,7 @@ int main(int argc, char *argv[])
 	port = atoi(argv[6]);
 	username = argv[7];
 	password = argv[8];
+	rtsp_port = argc > 9 ? atoi(argv[9]) : 0;
 
 	LOGINFO("device:%s\n", device);
 	LOGINFO("width:%d\n", width);
@@ -50,39 +249,113 @@ int main(int argc, char *argv[])
 	LOGINFO("port:%d\n", port);
 	LOGINFO("username:%s\n", username);
 	LOGINFO("password:%s\n", password);
+	LOGINFO("rtsp port:%d\n", rtsp_port);
 	LOGINFO("\n");
 
 	signal(SIGPIPE, SIG_IGN);
 
+	takeover_fd = upgrade_get_fd();
+
+	g_base = pevent_base_create();
+	if (g_base == NULL)
+	{
+		LOGERROR("pevent_base_create error\n");
+		exit(EXIT_FAILURE);
+	}
 
-	if(signal(SIGINT, signal_handler) == SIG_ERR)
+	if (camlite_signal_init() == -1)
 	{
         LOGERROR("could not register signal handler\n");
         exit(EXIT_FAILURE);
     }
 
-	g_base = pevent_base_create();
-	if (g_base == NULL)
+	recorders = getenv(CAMHTTP_RECORDER_ENV);
+	if (recorders != NULL)
 	{
-		LOGERROR("pevent_base_create error\n");
-		exit(EXIT_FAILURE);
+		LOGINFO("recorder addresses:%d\n", camhttp_set_recorders(recorders));
 	}
 
-	if (camhttp_start(g_base, port, username, password) == -1)
+	if (camhttp_start(g_base, port, username, password, takeover_fd) == -1)
 	{
 		LOGERROR("http start error\n");
 		exit(EXIT_FAILURE);
 	}
 
-	video_manager_init(g_base, (v4l2_read_callback)camhttp_on_video_read, timeout);
+	if (takeover_fd >= 0)
+		close(takeover_fd);
+
+	if (rtsp_port > 0 && rtsp_start(g_base, rtsp_port) == -1)
+	{
+		LOGERROR("rtsp start error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	shm_path = getenv(SHMRING_ENV);
+	if (shm_path != NULL && shmring_start(g_base, shm_path) == -1)
+	{
+		LOGWARN("shared ring start failure(%s)\n", shm_path);
+	}
+
+	video_manager_init(g_base, (v4l2_read_callback)camlite_on_video_read, timeout);
 
 	video_manager_add(device, width, height, fps);
 
+	record_dir = getenv(RECORDER_ENV);
+	if (record_dir != NULL && (recorder_init(record_dir) == -1 || recorder_start(0) == -1))
+	{
+		LOGWARN("recorder start failure(%s)\n", record_dir);
+	}
+
+	camhttp_resume();
+
 
-	while (pevent_base_loop(g_base, -1) != -1);
+	while (g_running)
+	{
+		wait = g_shutdown ? CAMLITE_DRAIN_INTERVAL : -1;
+		if (g_upgrade_event != NULL)
+		{
+			now = gettickcount();
+			if (now >= g_upgrade_deadline)
+				wait = 0;
+			else if (wait == -1 || g_upgrade_deadline - now < (unsigned long)wait)
+				wait = g_upgrade_deadline - now;
+		}
+
+		if (pevent_base_loop(g_base, wait) == -1
+			&& errno != EINTR)
+			break;
+
+		if (g_upgrade_event != NULL
+			&& (g_shutdown || gettickcount() >= g_upgrade_deadline))
+			camlite_upgrade_cancel();
+
+		if (upgrade_pending() && !g_shutdown)
+			camlite_upgrade(argv);
+
+		if (g_shutdown && (camhttp_client_count() == 0
+			|| gettickcount() >= g_shutdown_deadline))
+			g_running = 0;
+	}
+
+	if (g_upgrade_event != NULL)
+		camlite_upgrade_cancel();
 
+	multicast_cleanup();
+	recorder_cleanup();
+	motion_cleanup();
+	video_manager_cleanup();
+	LOGINFO("video cleanup\n");
+
+	camhttp_stop();
+	rtsp_stop();
+	shmring_stop();
+	LOGINFO("http cleanup\n");
+
+	pevent_free(g_signal_event);
 	pevent_base_cleanup(g_base);
 	LOGINFO("event loop cleanup\n");
 
+	log_cleanup();
+
 	return 0;
 }
@@ -0,0 +1,466 @@
+#include "digest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "util.h"
+#include "md5.h"
+#include "uthash.h"
+
+#define MD5_UPDATE_STRING(c, s) md5_update(c, (const unsigned char *)s, strlen(s))
+
+//nonce = hex(issue time) + hex(serial) + hex(HMAC-MD5(secret, issue time:serial:ip))
+#define DIGEST_NONCE_TIME_SIZE	8
+#define DIGEST_NONCE_SERIAL_SIZE	8
+#define DIGEST_NONCE_SIZE		(DIGEST_NONCE_TIME_SIZE + DIGEST_NONCE_SERIAL_SIZE + 32)
+
+
+typedef struct _digest_parameter
+{
+	char *key;
+	char *value;
+} digest_parameter_t;
+
+typedef struct _digest_nonce
+{
+	char nonce[DIGEST_NONCE_SIZE + 1];
+	time_t check_time;
+	unsigned int nc;
+
+	struct _digest_nonce *prev;
+	struct _digest_nonce *next;
+
+	UT_hash_handle hh;
+} digest_nonce_t;
+
+typedef struct _digest_manage
+{
+	char ha1[33];
+	unsigned char secret[16];
+	unsigned int serial;	//keeps challenges of the same second apart
+
+	digest_nonce_t *nonces;
+
+	//least recently used first, so expiry only looks at the head
+	digest_nonce_t *head;
+	digest_nonce_t *tail;
+} digest_manage_t;
+
+
+static digest_manage_t g_digest;
+
+static char HEX_DICT[0x10] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+static void hex2string(unsigned char *hex, int hex_len, char *buff, int buf_len)
+{
+	int i;
+	unsigned char *pc;
+
+	i = 0;
+    pc = hex + hex_len;
+    while(i < buf_len - 1 && hex < pc)
+	{
+        unsigned char c1 = (*hex) >> 4;
+        unsigned char c2 = (*hex) & 0x0f;
+        buff[i++] = HEX_DICT[c1];
+        buff[i++] = HEX_DICT[c2];
+        hex++;
+    }
+
+    buff[i] = 0;
+}
+
+static int get_digest_parameter(char *src, digest_parameter_t param[], int count, int required)
+{
+	int len, nel, i;
+	char *q, *name, *value, *temp;
+
+	q = src;
+	len = strlen(src);
+	nel = 1;
+
+
+	while (strsep(&q, ","))
+		nel++;
+
+
+	for (q = src; q < (src + len);)
+	{
+		value = name = q;
+		for (q += strlen(q); q < (src + len) && !*q; q++);
+
+		name = strsep(&value, "=");
+		if (name == NULL || value == NULL)
+			break;
+
+		//trim name
+		while (*name != '\0' && (*name == '\t' || *name == ' '))
+			++name;
+
+		temp = name;
+		while (*temp != '\0')
+			++temp;
+
+		while (temp > name)
+		{
+			if (*temp == '\0' || *temp == '\t' || *temp == ' ')
+				*temp = '\0';
+			else
+				break;
+
+			--temp;
+		}
+
+		//trim value
+		while (*value != '\0' && (*value == '\t' || *value == ' ' || *value == '"'))
+		{
+			if (*value == '"')
+			{
+				++value;
+				break;
+			}
+
+			++value;
+		}
+
+		temp = value;
+		while (*temp != '\0')
+			++temp;
+
+		while (temp >= value)
+		{
+			if (*temp == '\0' || *temp == '\t' || *temp == ' ')
+				*temp = '\0';
+			else if (*temp == '"')
+			{
+				*temp = '\0';
+				break;
+			}
+			else
+			{
+				break;
+			}
+
+			--temp;
+		}
+		
+		for (i = 0; i < count; ++i)
+		{
+			if (strcmp(name, param[i].key) == 0)
+			{
+				param[i].value = value;
+			}
+		}
+	}
+
+	for (i = 0; i < required; ++i)
+	{
+		if (!param[i].value)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void digest_hmac(const unsigned char *data, int size, unsigned char digest[16])
+{
+	int i;
+	md5ctx ctx;
+	unsigned char pad[64];
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, g_digest.secret, sizeof(g_digest.secret));
+	for (i = 0; i < 64; ++i)
+		pad[i] ^= 0x36;
+
+	md5_init(&ctx);
+	md5_update(&ctx, pad, 64);
+	md5_update(&ctx, data, size);
+	md5_final(digest, &ctx);
+
+	for (i = 0; i < 64; ++i)
+		pad[i] ^= 0x36 ^ 0x5c;
+
+	md5_init(&ctx);
+	md5_update(&ctx, pad, 64);
+	md5_update(&ctx, digest, 16);
+	md5_final(digest, &ctx);
+}
+
+static void digest_make_nonce(unsigned int issue_time, unsigned int serial,
+	unsigned int ip, char *nonce)
+{
+	char data[32];
+	unsigned char digest[16];
+
+	snprintf(data, sizeof(data), "%08x:%08x:%08x", issue_time, serial, ip);
+	digest_hmac((unsigned char *)data, strlen(data), digest);
+
+	memcpy(nonce, data, DIGEST_NONCE_TIME_SIZE);
+	memcpy(nonce + DIGEST_NONCE_TIME_SIZE, data + DIGEST_NONCE_TIME_SIZE + 1,
+		DIGEST_NONCE_SERIAL_SIZE);
+	hex2string(digest, 16, nonce + DIGEST_NONCE_TIME_SIZE + DIGEST_NONCE_SERIAL_SIZE, 33);
+}
+
+//stateless check, any nonce we signed for this ip is valid until it expires
+static int digest_check_nonce(const char *nonce, unsigned int ip, time_t now)
+{
+	char expect[DIGEST_NONCE_SIZE + 1];
+	char time_string[DIGEST_NONCE_TIME_SIZE + 1];
+	char serial_string[DIGEST_NONCE_SERIAL_SIZE + 1];
+	unsigned int issue_time, serial;
+
+	if (strlen(nonce) != DIGEST_NONCE_SIZE)
+		return -1;
+
+	memcpy(time_string, nonce, DIGEST_NONCE_TIME_SIZE);
+	time_string[DIGEST_NONCE_TIME_SIZE] = '\0';
+	issue_time = strtoul(time_string, NULL, 16);
+
+	memcpy(serial_string, nonce + DIGEST_NONCE_TIME_SIZE, DIGEST_NONCE_SERIAL_SIZE);
+	serial_string[DIGEST_NONCE_SERIAL_SIZE] = '\0';
+	serial = strtoul(serial_string, NULL, 16);
+
+	if (issue_time > now || issue_time + DIGEST_EXPIRETIME < now)
+		return -1;
+
+	digest_make_nonce(issue_time, serial, ip, expect);
+
+	return memcmp(expect, nonce, DIGEST_NONCE_SIZE) == 0 ? 0 : -1;
+}
+
+static void digest_unlink(digest_nonce_t *dn)
+{
+	if (dn->prev)
+		dn->prev->next = dn->next;
+	else
+		g_digest.head = dn->next;
+
+	if (dn->next)
+		dn->next->prev = dn->prev;
+	else
+		g_digest.tail = dn->prev;
+
+	dn->prev = NULL;
+	dn->next = NULL;
+}
+
+static void digest_append(digest_nonce_t *dn)
+{
+	dn->prev = g_digest.tail;
+	dn->next = NULL;
+
+	if (g_digest.tail)
+		g_digest.tail->next = dn;
+	else
+		g_digest.head = dn;
+
+	g_digest.tail = dn;
+}
+
+static void digest_remove(digest_nonce_t *dn)
+{
+	LOGDEBUG("digest expire('%s')\n", dn->nonce);
+
+	digest_unlink(dn);
+	HASH_DEL(g_digest.nonces, dn);
+	free(dn);
+}
+
+static void digest_expire(time_t now)
+{
+	while (g_digest.head
+		&& g_digest.head->check_time + DIGEST_EXPIRETIME < now)
+	{
+		digest_remove(g_digest.head);
+	}
+}
+
+//the nonce table only guards against replayed nonce counts
+static int digest_track(const char *nonce, unsigned int nc, time_t now)
+{
+	digest_nonce_t *dn;
+
+	HASH_FIND(hh, g_digest.nonces, nonce, DIGEST_NONCE_SIZE, dn);
+	if (dn != NULL)
+	{
+		if (nc <= dn->nc)
+			return -1;
+
+		digest_unlink(dn);
+	}
+	else
+	{
+		if (HASH_COUNT(g_digest.nonces) >= DIGEST_MAX)
+			digest_remove(g_digest.head);
+
+		dn = fcalloc(1, sizeof(digest_nonce_t));
+		memcpy(dn->nonce, nonce, DIGEST_NONCE_SIZE);
+
+		HASH_ADD(hh, g_digest.nonces, nonce, DIGEST_NONCE_SIZE, dn);
+	}
+
+	dn->nc = nc;
+	dn->check_time = now;
+	digest_append(dn);
+
+	return 0;
+}
+
+int digest_init(const char *username, const char *password)
+{
+	md5ctx ctx;
+	unsigned char digest[16];
+	int fd;
+	pid_t pid;
+	time_t now;
+
+	if (username == NULL || password == NULL)
+		return -1;
+
+	md5_init(&ctx);
+	MD5_UPDATE_STRING(&ctx, username);
+	MD5_UPDATE_STRING(&ctx, ":" DIGEST_REALM ":");
+	MD5_UPDATE_STRING(&ctx, password);
+	md5_final(digest, &ctx);
+	hex2string(digest, 16, g_digest.ha1, 33);
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, g_digest.secret, sizeof(g_digest.secret)) != sizeof(g_digest.secret))
+	{
+		LOGWARN("read /dev/urandom failure, nonce secret is predictable\n");
+
+		pid = getpid();
+		now = time(NULL);
+
+		md5_init(&ctx);
+		md5_update(&ctx, (uint8_t *)&pid, sizeof(pid));
+		md5_update(&ctx, (uint8_t *)&now, sizeof(now));
+		md5_update(&ctx, (uint8_t *)g_digest.ha1, 32);
+		md5_final(g_digest.secret, &ctx);
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return 0;
+}
+
+int digest_enabled()
+{
+	return g_digest.ha1[0] != '\0';
+}
+
+int digest_verify(const char *method, const char *uri,
+	char *authorization, unsigned int ip)
+{
+	//HA1=MD5(A1)=MD5(username:realm:password)
+	//HA2=MD5(A2)=MD5(method:digestURI)
+	//response=MD5(HA1:nonce:nonceCount:clientNonce:qop:HA2)
+	//rfc2069 clients send no qop: response=MD5(HA1:nonce:HA2)
+	char temp[64];
+	md5ctx ctx;
+	unsigned char digest[16];
+	digest_parameter_t parameter[5];
+	time_t now;
+
+	if (!digest_enabled())
+		return DIGEST_OK;
+
+	if (authorization == NULL || authorization[0] == '\0')
+		return DIGEST_FAILURE;
+
+	memset(parameter, 0, sizeof(parameter));
+	parameter[0].key = "nonce";
+	parameter[1].key = "response";
+	parameter[2].key = "qop";
+	parameter[3].key = "nc";
+	parameter[4].key = "cnonce";
+
+	if (!get_digest_parameter(authorization, parameter, sizeof(parameter) / sizeof(digest_parameter_t), 2))
+	{
+		LOGWARN("get_digest_parameter failed\n");
+		return DIGEST_FAILURE;
+	}
+
+	//with a qop the nonce count and client nonce are mandatory
+	if (parameter[2].value
+		&& (strcmp(parameter[2].value, "auth") != 0 || !parameter[3].value || !parameter[4].value))
+	{
+		LOGWARN("digest qop:%s incomplete\n", parameter[2].value);
+		return DIGEST_FAILURE;
+	}
+
+
+	//ha2
+	md5_init(&ctx);
+	MD5_UPDATE_STRING(&ctx, method);
+	MD5_UPDATE_STRING(&ctx, ":");
+	MD5_UPDATE_STRING(&ctx, uri);
+	md5_final(digest, &ctx);
+	hex2string(digest, 16, temp, 64);
+
+
+	//response
+	md5_init(&ctx);
+	MD5_UPDATE_STRING(&ctx, g_digest.ha1);
+	MD5_UPDATE_STRING(&ctx, ":");
+	MD5_UPDATE_STRING(&ctx, parameter[0].value);
+	MD5_UPDATE_STRING(&ctx, ":");
+	if (parameter[2].value)
+	{
+		MD5_UPDATE_STRING(&ctx, parameter[3].value);
+		MD5_UPDATE_STRING(&ctx, ":");
+		MD5_UPDATE_STRING(&ctx, parameter[4].value);
+		MD5_UPDATE_STRING(&ctx, ":");
+		MD5_UPDATE_STRING(&ctx, "auth");
+		MD5_UPDATE_STRING(&ctx, ":");
+	}
+	MD5_UPDATE_STRING(&ctx, temp);
+	md5_final(digest, &ctx);
+	hex2string(digest, 16, temp, 64);
+
+	LOGDEBUG("response:%s %s\n", temp, parameter[1].value);
+
+	if (strlen(parameter[1].value) != 32
+		|| memcmp(temp, parameter[1].value, 32) != 0)
+	{
+		return DIGEST_FAILURE;
+	}
+
+	//the password is right, a bad nonce only needs a new challenge
+	now = time(NULL);
+	digest_expire(now);
+
+	if (digest_check_nonce(parameter[0].value, ip, now) == -1)
+		return DIGEST_STALE;
+
+	//without a qop there is no nonce count, the nonce is simply reused
+	if (DIGEST_MAX > 0 && parameter[2].value && digest_track(parameter[0].value,
+		strtoul(parameter[3].value, NULL, 16), now) == -1)
+	{
+		return DIGEST_STALE;
+	}
+
+	return DIGEST_OK;
+}
+
+int digest_challenge(char *buf, int size, unsigned int ip, int stale)
+{
+	char nonce[DIGEST_NONCE_SIZE + 1];
+
+	digest_make_nonce(time(NULL), g_digest.serial++, ip, nonce);
+
+	return snprintf(buf, size, "Digest "\
+		"realm=\"" DIGEST_REALM "\","
+		"qop=\"auth\","
+		"nonce=\"%s\"%s",
+		nonce, stale ? ",stale=TRUE" : "");
+}
+
+int digest_count()
+{
+	return HASH_COUNT(g_digest.nonces);
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef DIGEST_H_
+#define DIGEST_H_
+
+
+#define DIGEST_REALM			"camlite"
+//nonces tracked against a replayed nc, 0 keeps no table and checks
+//nonces by their signature alone
+#ifndef DIGEST_MAX
+#define DIGEST_MAX				1000
+#endif
+#define DIGEST_EXPIRETIME		3600
+
+#define DIGEST_OK				0
+#define DIGEST_STALE			1
+#define DIGEST_FAILURE			-1
+
+
+int digest_init(const char *username, const char *password);
+
+int digest_enabled();
+
+int digest_verify(const char *method, const char *uri,
+	char *authorization, unsigned int ip);
+
+int digest_challenge(char *buf, int size, unsigned int ip, int stale);
+
+int digest_count();
+
+#endif
\ No newline at end of file
@@ -6,15 +6,29 @@
 #include <string.h>
 #include <fcntl.h> 
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <sys/errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <linux/sockios.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 #include "util.h"
 #include "uthash.h"
 
 #define HTTP_MAX_STRING_SIZE	2048
 #define HTTP_MAX_HEADER			10
+#define HTTP_MAX_DATA			4
 #define HTTP_MAX_SEND_BUFFER	(200 * 1024)
+#define HTTP_MAX_IP_ENTRY		256
+#define HTTP_TOKEN_UNIT			1000
+#define HTTP_PACE_INTERVAL		200		//ms a TCP_INFO sample is reused
+#define HTTP_WRITE_BUDGET		(64 * 1024)	//queued bytes per client per loop iteration
+#define HTTP_KEEP_SEND_BUFFER	(16 * 1024)	//a drained write buffer above this is freed
 
 
 
@@ -26,16 +40,55 @@ typedef struct _io_buffer
 	int cur;
 } io_buffer_t;
 
+typedef struct _http_ip
+{
+	unsigned int addr;
+
+	int conns;
+	int streams;
+
+	int tokens;
+	unsigned long refill_time;
+
+	unsigned int requests;
+	unsigned int rejected;
+
+	//addresses without a connection, the oldest is forgotten first
+	struct _http_ip *idle_prev;
+	struct _http_ip *idle_next;
+
+	UT_hash_handle hh;
+} http_ip_t;
+
 struct _http_server
 {
 	pevent_t *pevent;
 	pevent_base_t *base;
 	struct sockaddr_in addr_in;
 	http_request_callback request_callback;
+	http_release_callback release_callback;
 
 	http_client_t *clients;
+
+	http_limit_t limit;
+	http_ip_t *ips;
+	http_ip_t *idle_head;
+	http_ip_t *idle_tail;
+	unsigned int rejected;
+
+	uint64_t iter_us;	//the delay iteration being served started
+	unsigned int deferred;	//writes cut at the budget and resumed next iteration
 };
 
+//only while a request is being read, streamers never hold one
+typedef struct _http_parser
+{
+	char buf[HTTP_MAX_STRING_SIZE + 1];
+	int cur;
+	int header_compile;
+	http_request_t request;
+} http_parser_t;
+
 typedef struct _http_client
 {
 	int fd;
@@ -45,6 +98,8 @@ typedef struct _http_client
 
 	char ip[32];
 	unsigned short port;
+	http_ip_t *ipstat;
+	int stream;
 
 	void *delay_ptr;
 
@@ -52,10 +107,21 @@ typedef struct _http_client
 	int writing;
 	io_buffer_t write_buf;
 
-	char request_buf[HTTP_MAX_STRING_SIZE + 1];
-	int request_buf_cur;
-	int request_header_compile;
-	http_request_t request;
+	//sent from the file after write_buf, nothing is queued behind it
+	int file_fd;
+	off_t file_offset;
+	int file_size;
+
+	//rtt and rate sampled from TCP_INFO
+	http_pace_t pace;
+	unsigned long pace_time;
+
+	//a delay response is on its way since frame_us, latency_us averages
+	//how long the last ones took to leave userspace
+	uint64_t frame_us;
+	int latency_us;
+
+	http_parser_t *parser;
 
 	UT_hash_handle hh;
 
@@ -69,8 +135,18 @@ typedef struct _http_response
 
 	char body[HTTP_MAX_STRING_SIZE + 1];
 
+	//filled by http_response_append_data
 	char *extra_buf;
 	int extra_size;
+	int extra_max;
+
+	//caller owned, sent in order behind the body
+	struct iovec data[HTTP_MAX_DATA];
+	int data_count;
+
+	int file_fd;
+	off_t file_offset;
+	int file_size;
 } http_response_t;
 
 void on_event(pevent_t *poll_event, int events, http_client_t *client);
@@ -110,6 +186,7 @@ const char *get_http_code_string(int code) {
         case 415: return "Unsupported Media Type";
         case 416: return "Requested Range Not Satisfiable";
         case 417: return "Expectation Failed";
+        case 429: return "Too Many Requests";
         case 500: return "Internal Server Error";
         case 501: return "Not Implemented";
         case 502: return "Bad Gateway";
@@ -120,10 +197,150 @@ const char *get_http_code_string(int code) {
     }
 }
 
-void http_client_clear_request(http_client_t *client)
+static void http_ip_idle_add(http_server_t *service, http_ip_t *ipstat)
 {
-	memset(&client->request, 0, sizeof(client->request));
-	client->request.client = client;
+	ipstat->idle_next = NULL;
+	ipstat->idle_prev = service->idle_tail;
+
+	if (service->idle_tail)
+		service->idle_tail->idle_next = ipstat;
+	else
+		service->idle_head = ipstat;
+
+	service->idle_tail = ipstat;
+}
+
+static void http_ip_idle_del(http_server_t *service, http_ip_t *ipstat)
+{
+	if (ipstat->idle_prev)
+		ipstat->idle_prev->idle_next = ipstat->idle_next;
+	else
+		service->idle_head = ipstat->idle_next;
+
+	if (ipstat->idle_next)
+		ipstat->idle_next->idle_prev = ipstat->idle_prev;
+	else
+		service->idle_tail = ipstat->idle_prev;
+
+	ipstat->idle_prev = NULL;
+	ipstat->idle_next = NULL;
+}
+
+void http_ip_hold(http_server_t *service, http_ip_t *ipstat)
+{
+	if (ipstat->conns++ == 0)
+		http_ip_idle_del(service, ipstat);
+}
+
+void http_ip_release(http_server_t *service, http_ip_t *ipstat)
+{
+	if (--ipstat->conns == 0)
+		http_ip_idle_add(service, ipstat);
+}
+
+//NULL while the table is full of addresses still connected or whose
+//bucket has not refilled, forgetting those would lift their limits
+http_ip_t * http_ip_get(http_server_t *service, unsigned int addr)
+{
+	http_ip_t *ipstat;
+
+	HASH_FIND_INT(service->ips, &addr, ipstat);
+	if (ipstat != NULL)
+		return ipstat;
+
+	if (HASH_COUNT(service->ips) >= HTTP_MAX_IP_ENTRY)
+	{
+		ipstat = service->idle_head;
+		if (ipstat == NULL
+			|| (service->limit.rate > 0
+			&& gettickcount() - ipstat->refill_time <= service->limit.burst * 1000 / service->limit.rate))
+		{
+			++service->rejected;
+			return NULL;
+		}
+
+		http_ip_idle_del(service, ipstat);
+		HASH_DEL(service->ips, ipstat);
+		free(ipstat);
+	}
+
+	ipstat = fcalloc(1, sizeof(http_ip_t));
+	ipstat->addr = addr;
+	ipstat->tokens = service->limit.burst * HTTP_TOKEN_UNIT;
+	ipstat->refill_time = gettickcount();
+
+	HASH_ADD_INT(service->ips, addr, ipstat);
+	http_ip_idle_add(service, ipstat);
+
+	return ipstat;
+}
+
+int http_ip_take_token(http_server_t *service, http_ip_t *ipstat)
+{
+	unsigned long now;
+	unsigned long elapsed;
+	int full;
+
+	++ipstat->requests;
+
+	if (service->limit.rate == 0)
+		return 0;
+
+	now = gettickcount();
+	elapsed = now - ipstat->refill_time;
+	full = service->limit.burst * HTTP_TOKEN_UNIT;
+
+	if (elapsed > 0)
+	{
+		if (elapsed >= full / service->limit.rate)
+			ipstat->tokens = full;
+		else
+			ipstat->tokens += elapsed * service->limit.rate;
+
+		if (ipstat->tokens > full)
+			ipstat->tokens = full;
+
+		ipstat->refill_time = now;
+	}
+
+	if (ipstat->tokens < HTTP_TOKEN_UNIT)
+	{
+		++ipstat->rejected;
+		++service->rejected;
+		return -1;
+	}
+
+	ipstat->tokens -= HTTP_TOKEN_UNIT;
+	return 0;
+}
+
+static uint64_t http_now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void http_client_delivered(http_client_t *client)
+{
+	int sample;
+
+	if (client->frame_us == 0)
+		return;
+
+	sample = http_now_us() - client->frame_us;
+	client->frame_us = 0;
+
+	client->latency_us = client->latency_us
+		? (client->latency_us * 7 + sample) / 8 : sample;
+}
+
+static void http_client_free_parser(http_client_t *client)
+{
+	free(client->parser);
+	client->parser = NULL;
 }
 
 http_client_t * http_client_new(http_server_t *service, int fd)
@@ -133,53 +350,155 @@ http_client_t * http_client_new(http_server_t *service, int fd)
 
 	client = fcalloc(1, sizeof(http_client_t));
 
+	//both for good, an edge of EPOLLOUT only comes after a write hit the
+	//full socket and nothing has to be switched per response
 	pevent = pevent_new(service->base, fd, (pevent_callback)on_event, client);
-	if (pevent_set(pevent, PEVENT_READ) == -1)
+	if (pevent_set(pevent, PEVENT_READ | PEVENT_WRITE) == -1)
 	{
 		free(client);
 		pevent_free(pevent);
 		return NULL;
 	}
 	client->fd = fd;
+	client->file_fd = -1;
 	client->pevent = pevent;
 	client->service = service;
 
-	http_client_clear_request(client);
-
-
 	HASH_ADD_INT(service->clients, fd, client);
 
 	return client;
 }
 
+static void http_client_release_delay(http_client_t *client)
+{
+	void *ptr;
+
+	ptr = client->delay_ptr;
+	client->delay_ptr = NULL;
+
+	if (ptr && client->service->release_callback)
+		client->service->release_callback(client, ptr);
+}
+
 void http_client_free(http_client_t *client)
 {
 	LOGDEBUG("disconnect(%s:%u) fd:%d\n", client->ip,
 		client->port, client->fd);
 
+	http_client_release_delay(client);
+
 	HASH_DEL(client->service->clients, client);
 
+	if (client->ipstat)
+	{
+		http_ip_release(client->service, client->ipstat);
+
+		if (client->stream)
+			--client->ipstat->streams;
+	}
+
 	pevent_free(client->pevent);
 
+	http_client_free_parser(client);
+
 	if (client->write_buf.buf != NULL)
 	{
 		free(client->write_buf.buf);
 		client->write_buf.buf = NULL;
 	}
+
+	if (client->file_fd >= 0)
+		close(client->file_fd);
 	
 	free(client);
 }
 
-int http_client_send(http_client_t *client, char *buf, int size)
+//1 all sent, 0 socket full, -1 error
+static int http_client_send_file(http_client_t *client)
+{
+	ssize_t sent;
+
+	while (client->file_size > 0)
+	{
+		sent = sendfile(client->fd, client->file_fd, &client->file_offset, client->file_size);
+		if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+
+		//0 means the file got shorter than the response promised
+		if (sent <= 0)
+		{
+			LOGWARN("http sendfile error fd:%d\n", client->fd);
+			return -1;
+		}
+
+		client->file_size -= sent;
+	}
+
+	close(client->file_fd);
+	client->file_fd = -1;
+
+	return 1;
+}
+
+//what the socket did not take waits in write_buf for on_write
+static int http_client_queue(http_client_t *client, const char *buf, int size)
 {
-	int write_bytes;
 	int need_size;
 	int alloc_size;
 
+	need_size = client->write_buf.size + size;
+
+	if (need_size > HTTP_MAX_SEND_BUFFER)
+	{
+		LOGWARN("http write buf overflow fd:%d\n", client->fd);
+		http_client_free(client);
+		return -1;
+	}
+
+	alloc_size = ((need_size / 4096) + 1) * 4096;
+
+	if (client->write_buf.buf == NULL)
+	{
+		client->write_buf.buf = fmalloc(alloc_size);
+		if (client->write_buf.buf == NULL)
+		{
+			LOGERROR("not enough memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		client->write_buf.max = alloc_size;
+	}
+	else if (client->write_buf.max < need_size)
+	{
+		char *new_buf = frealloc(client->write_buf.buf, alloc_size);
+		client->write_buf.buf = new_buf;
+		client->write_buf.max = alloc_size;
+	}
+
+
+	memcpy(client->write_buf.buf + client->write_buf.size,
+		buf, size);
+
+	client->write_buf.size += size;
+	client->writing = 1;
+
+	return 0;
+}
+
+//one writev for the whole frame straight from the caller's buffer, the
+//budget applies per frame so a frame is never cut for fairness, only what
+//the socket did not take gets copied
+int http_client_sendv(http_client_t *client, const struct iovec *iov, int count)
+{
+	int i;
+	int write_bytes;
+	int size;
+	int queued;
+
 	write_bytes = 0;
 	if (!client->writing)
 	{
-		write_bytes = pevent_write(client->pevent, buf, size);
+		write_bytes = pevent_writev(client->pevent, iov, count);
 		if (write_bytes == -1)
 		{
 			LOGWARN("http send error fd:%d\n", client->fd);
@@ -188,66 +507,159 @@ int http_client_send(http_client_t *client, char *buf, int size)
 		}
 	}
 
-	
-	buf += write_bytes;
-	size -= write_bytes;
-
-	if (size > 0)
-	{ 
-		need_size = client->write_buf.size + size;
+	queued = 0;
+	for (i = 0; i < count; ++i)
+	{
+		size = iov[i].iov_len;
 
-		if (need_size > HTTP_MAX_SEND_BUFFER)
+		if (write_bytes >= size)
 		{
-			LOGWARN("http write buf overflow fd:%d\n", client->fd);
-			http_client_free(client);
-			return -1;
+			write_bytes -= size;
+			continue;
 		}
 
-		alloc_size = ((need_size / 4096) + 1) * 4096;
+		if (http_client_queue(client, (char *)iov[i].iov_base + write_bytes, size - write_bytes) == -1)
+			return -1;
 
-		if (client->write_buf.buf == NULL)
-		{
-			client->write_buf.buf = fmalloc(alloc_size);
-			if (client->write_buf.buf == NULL)
-			{
-				LOGERROR("not enough memory\n");
-				exit(EXIT_FAILURE);
-			}
+		write_bytes = 0;
+		queued = 1;
+	}
 
-			client->write_buf.max = alloc_size;
-		}
-		else if (client->write_buf.max < need_size)
-		{
-			char *new_buf = frealloc(client->write_buf.buf, alloc_size);
-			client->write_buf.buf = new_buf;
-			client->write_buf.max = alloc_size;
-		}
+	if (!queued)
+		http_client_delivered(client);
 
+	return 0;
+}
 
-		memcpy(client->write_buf.buf + client->write_buf.size,
-			buf, size);
+int http_client_send(http_client_t *client, char *buf, int size)
+{
+	struct iovec iov;
 
-		client->write_buf.size += size;
-		
-		if (!client->writing)
+	iov.iov_base = buf;
+	iov.iov_len = size;
+
+	return http_client_sendv(client, &iov, 1);
+}
+
+void http_client_set_delay(http_client_t *client, void *ptr)
+{
+	if (client->delay_ptr != ptr)
+		http_client_release_delay(client);
+
+	client->delay_ptr = ptr;
+}
+
+void http_client_close(http_client_t *client)
+{
+	http_client_free(client);
+}
+
+int http_client_get_queued(http_client_t *client)
+{
+	return client->write_buf.size - client->write_buf.cur + client->file_size;
+}
+
+//heap held by the connection, a large write buffer is freed once drained
+int http_client_get_memory(http_client_t *client)
+{
+	return sizeof(http_client_t)
+		+ (client->parser ? sizeof(http_parser_t) : 0)
+		+ client->write_buf.max;
+}
+
+//set once the kernel refused SIOCOUTQNSD, SIOCOUTQ is used directly then
+static int g_outqnsd_failed;
+
+//the unsent queue is read every call, the congestion window only
+//every HTTP_PACE_INTERVAL
+int http_client_get_pace(http_client_t *client, http_pace_t *pace)
+{
+	struct tcp_info info;
+	socklen_t len;
+	unsigned long now;
+	long long rate;
+	int unsent;
+
+	if (g_outqnsd_failed
+		|| ioctl(client->fd, SIOCOUTQNSD, &unsent) == -1)
+	{
+		if (!g_outqnsd_failed && errno != EBADF)
+			g_outqnsd_failed = 1;
+
+		if (ioctl(client->fd, SIOCOUTQ, &unsent) == -1)
+			return -1;
+	}
+
+	client->pace.unsent = unsent;
+
+	now = gettickcount();
+	if (client->pace_time == 0 || now - client->pace_time >= HTTP_PACE_INTERVAL)
+	{
+		client->pace_time = now;
+
+		len = sizeof(info);
+		if (getsockopt(client->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0
+			&& info.tcpi_rtt > 0)
 		{
-			client->writing = 1;
+			rate = (long long)info.tcpi_snd_cwnd * info.tcpi_snd_mss * 1000000 / info.tcpi_rtt;
 
-			if (pevent_set(client->pevent, PEVENT_WRITE) == -1)
-			{
-				LOGERROR("pevent_set(client->pevent, PEVENT_WRITE) == -1 fd:%d\n", client->fd);
-				http_client_free(client);
-				return -1;
-			}
+			client->pace.rtt = info.tcpi_rtt;
+			client->pace.rate = rate > 0x7fffffff ? 0x7fffffff : rate;
 		}
 	}
 
+	*pace = client->pace;
+
 	return 0;
 }
 
-void http_client_set_delay(http_client_t *client, void *ptr)
+int http_client_get_latency(http_client_t *client)
 {
-	client->delay_ptr = ptr;
+	return client->latency_us;
+}
+
+int http_client_set_stream(http_client_t *client)
+{
+	http_server_t *service;
+
+	service = client->service;
+
+	if (client->stream)
+		return 0;
+
+	if (client->ipstat && service->limit.max_stream > 0
+		&& client->ipstat->streams >= service->limit.max_stream)
+	{
+		++client->ipstat->rejected;
+		++service->rejected;
+		return -1;
+	}
+
+	http_client_keep_stream(client);
+
+	return 0;
+}
+
+//counted even over the limit, a stream handed over by an upgrade is kept
+void http_client_keep_stream(http_client_t *client)
+{
+	if (client->stream)
+		return;
+
+	client->stream = 1;
+	if (client->ipstat)
+		++client->ipstat->streams;
+}
+
+//the stream was refused after all, its count goes back
+void http_client_clear_stream(http_client_t *client)
+{
+	if (!client->stream)
+		return;
+
+	client->stream = 0;
+	if (client->ipstat)
+		--client->ipstat->streams;
 }
 
 const char * http_client_getip(http_client_t *client)
@@ -260,27 +672,41 @@ unsigned short http_client_getport(http_client_t *client)
 	return client->port;
 }
 
+int http_client_getfd(http_client_t *client)
+{
+	return client->fd;
+}
+
 int http_request_parse_line(http_client_t *client, char *line)
 {
+	http_request_t *request;
+
+	request = &client->parser->request;
+
 	if (sscanf(line, "GET %255[^?^ ]?%255sHTTP",
-		client->request.path, client->request.param) > 0)
+		request->path, request->param) > 0)
 	{
-		client->request.method = HTTP_METHOD_GET;
+		request->method = HTTP_METHOD_GET;
 		return 0;
 	}
 	else if (sscanf(line, "POST %255[^?^ ]?%255sHTTP",
-		client->request.path, client->request.param) > 0)
+		request->path, request->param) > 0)
+	{
+		request->method = HTTP_METHOD_POST;
+		return 0;
+	}
+	else if (sscanf(line, "Host: %255s", request->host) > 0)
 	{
-		client->request.method = HTTP_METHOD_POST;
 		return 0;
 	}
-	else if (sscanf(line, "Host: %255s", client->request.host) > 0)
+	else if (sscanf(line, "If-None-Match: %63s", request->etag) > 0)
 	{
 		return 0;
 	}
 	else if (strstr(line, "Authorization: Digest") == line)
 	{
-		strncpy(client->request.digest, line + sizeof("Authorization: Digest") - 1, 255);
+		strncpy(request->digest, line + sizeof("Authorization: Digest") - 1,
+			HTTP_MAX_DIGEST_SIZE - 1);
 		return 0;
 	}
 
@@ -294,6 +720,7 @@ http_response_t * http_response_new(int code, const char *format, ...)
 	
 	response = fcalloc(1, sizeof(http_response_t));
 	response->code = code;
+	response->file_fd = -1;
 
 	if (format != NULL)
 	{
@@ -317,6 +744,14 @@ void http_response_free(http_response_t *response)
 		}
 	}
 
+	if (response->extra_buf)
+	{
+		free(response->extra_buf);
+	}
+
+	if (response->file_fd >= 0)
+		close(response->file_fd);
+
 	free(response);
 }
 
@@ -363,8 +798,74 @@ void http_response_append(http_response_t *response, const char *format, ...)
 
 void http_response_set_data(http_response_t *response, char *buf, int size)
 {
-	response->extra_buf = buf;
-	response->extra_size = size;
+	response->data_count = 0;
+	http_response_add_data(response, buf, size);
+}
+
+int http_response_add_data(http_response_t *response, const char *buf, int size)
+{
+	if (response->data_count == HTTP_MAX_DATA)
+		return -1;
+
+	response->data[response->data_count].iov_base = (char *)buf;
+	response->data[response->data_count].iov_len = size;
+	++response->data_count;
+
+	return 0;
+}
+
+//size bytes of fd from offset follow the body, fd stays with the caller
+int http_response_set_file(http_response_t *response, int fd, long long offset, int size)
+{
+	if (response->file_fd >= 0)
+		close(response->file_fd);
+
+	response->file_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (response->file_fd == -1)
+		return -1;
+
+	response->file_offset = offset;
+	response->file_size = size;
+
+	return 0;
+}
+
+void http_response_append_data(http_response_t *response, const char *format, ...)
+{
+	int len;
+	va_list ap;
+
+	while (1)
+	{
+		va_start(ap, format);
+		len = vsnprintf(response->extra_buf + response->extra_size,
+			response->extra_max - response->extra_size, format, ap);
+		va_end(ap);
+
+		if (len < response->extra_max - response->extra_size)
+			break;
+
+		response->extra_max = ((response->extra_size + len) / 4096 + 1) * 4096;
+		response->extra_buf = frealloc(response->extra_buf, response->extra_max);
+	}
+
+	response->extra_size += len;
+}
+
+//formats behind the first len bytes, the result stops at HTTP_MAX_STRING_SIZE
+static int http_string_append(char *buf, int len, const char *format, ...)
+{
+	int ret;
+	va_list ap;
+
+	va_start(ap, format);
+	ret = vsnprintf(buf + len, HTTP_MAX_STRING_SIZE + 1 - len, format, ap);
+	va_end(ap);
+
+	if (ret < 0)
+		return len;
+
+	return len + ret > HTTP_MAX_STRING_SIZE ? HTTP_MAX_STRING_SIZE : len + ret;
 }
 
 int http_response_compile(http_response_t *response, http_client_t *client)
@@ -373,19 +874,20 @@ int http_response_compile(http_response_t *response, http_client_t *client)
 	int has_type = 0;
 	int has_connection = 0;
 	char *send_string;
+	int len;
 	int ret;
+	struct iovec iov[HTTP_MAX_DATA + 2];
+	int count;
 
 	send_string = fmalloc(HTTP_MAX_STRING_SIZE + 1);
+	send_string[0] = '\0';
+	len = 0;
 
 	if (response->code > 0)
 	{
-		snprintf(send_string, HTTP_MAX_STRING_SIZE, "HTTP/1.1 %d %s\r\n",
+		len = http_string_append(send_string, len, "HTTP/1.1 %d %s\r\n",
 			response->code, get_http_code_string(response->code));
 	}
-	else
-	{
-		send_string[0] = '\0';
-	}
 
 	for (i = 0; i < HTTP_MAX_HEADER; ++i)
 	{
@@ -397,41 +899,75 @@ int http_response_compile(http_response_t *response, http_client_t *client)
 			if (strstr(response->headers[i], "Connection:") > 0)
 				has_connection = 1;
 
-			snprintf(send_string, HTTP_MAX_STRING_SIZE,
-				"%s%s\r\n", send_string, response->headers[i]);
+			len = http_string_append(send_string, len, "%s\r\n", response->headers[i]);
 		}
 	}
 
 	if (!has_type)
-		snprintf(send_string, HTTP_MAX_STRING_SIZE, "%sContent-type: text/html\r\n", send_string);
+		len = http_string_append(send_string, len, "Content-type: text/html\r\n");
 
 	if (!has_connection)
 	{
-		snprintf(send_string, HTTP_MAX_STRING_SIZE, "%sConnection: close\r\n", send_string);
+		len = http_string_append(send_string, len, "Connection: close\r\n");
 	}
 
-	snprintf(send_string, HTTP_MAX_STRING_SIZE, "%s\r\n", send_string);
+	len = http_string_append(send_string, len, "\r\n");
 
+	//304 ends with the headers
 	if (response->code
 		&& response->code != 200
+		&& response->code != 304
 		&& response->body[0] == '\0')
 	{
-		snprintf(send_string, HTTP_MAX_STRING_SIZE, "%s%d:%s",
-			send_string,
+		len = http_string_append(send_string, len, "%d:%s",
 			response->code,
 			get_http_code_string(response->code));
 	}
 	else
 	{
-		snprintf(send_string, HTTP_MAX_STRING_SIZE, "%s%s", send_string, response->body);
+		len = http_string_append(send_string, len, "%s", response->body);
 	}
 
 
+	iov[0].iov_base = send_string;
+	iov[0].iov_len = len;
+	count = 1;
+
+	if (response->extra_size)
+	{
+		iov[count].iov_base = response->extra_buf;
+		iov[count].iov_len = response->extra_size;
+		++count;
+	}
 
-	ret = http_client_send(client, send_string, strlen(send_string));
-	if (ret != -1 && response->extra_size)
+	for (i = 0; i < response->data_count; ++i)
 	{
-		ret = http_client_send(client, response->extra_buf, response->extra_size);
+		if (response->data[i].iov_len)
+			iov[count++] = response->data[i];
+	}
+
+	ret = http_client_sendv(client, iov, count);
+
+	if (ret != -1 && response->file_fd >= 0)
+	{
+		client->file_fd = response->file_fd;
+		client->file_offset = response->file_offset;
+		client->file_size = response->file_size;
+		response->file_fd = -1;
+
+		//behind queued data on_write sends the file once the buffer drained
+		if (!client->writing)
+		{
+			ret = http_client_send_file(client);
+			if (ret == -1)
+			{
+				http_client_free(client);
+			}
+			else if (ret == 0)
+			{
+				client->writing = 1; //EAGAIN, EPOLLOUT follows
+			}
+		}
 	}
 
 	//LOGINFO("send_string:%s\n", send_string);
@@ -463,11 +999,20 @@ static int set_nonblocking(int fd)
 void on_read(http_client_t *client)
 {
 	int i, read_bytes, wrap_pos, ret;
+	http_parser_t *parser;
 	http_response_t *response;
-	
+
+	if (client->parser == NULL)
+	{
+		client->parser = fcalloc(1, sizeof(http_parser_t));
+		client->parser->request.client = client;
+	}
+
+	parser = client->parser;
+
 	while (1)
 	{
-		if (client->request_buf_cur >= HTTP_MAX_STRING_SIZE)
+		if (parser->cur >= HTTP_MAX_STRING_SIZE)
 		{
 			LOGWARN("http request buffer overflow fd:%d\n", client->fd);
 			http_client_free(client);
@@ -475,8 +1020,8 @@ void on_read(http_client_t *client)
 		}
 
 		read_bytes = pevent_read(client->pevent,
-			client->request_buf + client->request_buf_cur,
-			HTTP_MAX_STRING_SIZE - client->request_buf_cur);
+			parser->buf + parser->cur,
+			HTTP_MAX_STRING_SIZE - parser->cur);
 
 		if (read_bytes < 0)
 		{
@@ -488,26 +1033,26 @@ void on_read(http_client_t *client)
 		if (read_bytes == 0)
 			break; //read end
 
-		client->request_buf_cur += read_bytes;
+		parser->cur += read_bytes;
 	}
 
 	wrap_pos = 0;
-	for (i = 1; i < client->request_buf_cur; ++i)
+	for (i = 1; i < parser->cur; ++i)
 	{
-		if (client->request_buf[i] == '\n' 
-			&& client->request_buf[i - 1] == '\r')
+		if (parser->buf[i] == '\n' 
+			&& parser->buf[i - 1] == '\r')
 		{
-			client->request_buf[i - 1] = '\0';
+			parser->buf[i - 1] = '\0';
 			
 			if (wrap_pos == i - 1)
 			{
-				client->request_buf_cur = 0;
-				client->request_header_compile = 1;
+				parser->cur = 0;
+				parser->header_compile = 1;
 				break;
 			}
 
 
-			ret = http_request_parse_line(client, client->request_buf + wrap_pos);
+			ret = http_request_parse_line(client, parser->buf + wrap_pos);
 
 			if (ret == -1)
 			{
@@ -520,27 +1065,37 @@ void on_read(http_client_t *client)
 		}
 	}
 
-	if (!client->request_header_compile)
+	if (!parser->header_compile)
 	{
-		client->request_buf_cur -= wrap_pos;
+		parser->cur -= wrap_pos;
 
-		if (client->request_buf_cur)
-			memcpy(client->request_buf,
-			client->request_buf + wrap_pos,
-			client->request_buf_cur);
+		if (parser->cur)
+			memcpy(parser->buf,
+			parser->buf + wrap_pos,
+			parser->cur);
 
 		client->reading = 1;
 		return;//continue read
 	}
 	
 	//header compile
-	if (client->request.method != HTTP_METHOD_GET)
+	if (parser->request.method != HTTP_METHOD_GET)
 	{
 		http_client_free(client);
 		return;
 	}
 
-	response = client->service->request_callback(&client->request);
+	if (client->ipstat
+		&& http_ip_take_token(client->service, client->ipstat) == -1)
+	{
+		response = http_response_new(429, NULL);
+		http_response_addheader(response, "Retry-After: 1");
+	}
+	else
+	{
+		response = client->service->request_callback(&parser->request);
+	}
+
 	if (response != NULL)
 	{
 		if (http_response_compile(response, client) == -1)
@@ -549,9 +1104,8 @@ void on_read(http_client_t *client)
 		}
 	}
 	
-	client->request_header_compile = 0;
 	client->reading = 0;
-	http_client_clear_request(client);
+	http_client_free_parser(client);
 
 	if (!client->writing && !client->delay_ptr)
 	{
@@ -564,33 +1118,64 @@ void on_write(http_client_t *client)
 {
 	int write_bytes;
 	int write_size;
+	int budget;
+	int ret;
 
+	//the socket has room again, nothing waits for it
 	if (!client->writing)
-	{
-		LOGERROR("!client->writing fd:%d\n", client->fd);
-		http_client_free(client);
 		return;
-	}
 
+	budget = HTTP_WRITE_BUDGET;
 
 	while (1)
 	{
 		write_size = client->write_buf.size - client->write_buf.cur;
+		if (write_size <= 0 && client->file_fd >= 0)
+		{
+			ret = http_client_send_file(client);
+			if (ret == -1)
+			{
+				http_client_free(client);
+				return;
+			}
+			else if (ret == 0)
+			{
+				return; //EAGAIN
+			}
+		}
+
 		if (write_size <= 0)
 		{
 			client->write_buf.cur = 0;
 			client->write_buf.size = 0;
 			client->writing = 0;
 
-			if (!client->delay_ptr)
+			//a frame tail grew it, small ones for headers stay
+			if (client->write_buf.max > HTTP_KEEP_SEND_BUFFER)
 			{
-				http_client_free(client);
-				return;
+				free(client->write_buf.buf);
+				client->write_buf.buf = NULL;
+				client->write_buf.max = 0;
 			}
 
-			if (pevent_set(client->pevent, PEVENT_READ) == -1)
+			http_client_delivered(client);
+
+			if (!client->delay_ptr)
+				http_client_free(client);
+
+			return;
+		}
+
+		//LOGDEBUG("client->write_buf.size:%d client->write_buf.cur:%d\n", client->write_buf.size, client->write_buf.cur);
+
+		//the others of this batch go first, re-arming reports the socket
+		//again in the next epoll_wait while it stays writable
+		if (budget <= 0)
+		{
+			++client->service->deferred;
+
+			if (pevent_signal(client->pevent, PEVENT_READ | PEVENT_WRITE) == -1)
 			{
-				LOGERROR("pevent_set(client->pevent, PEVENT_WRITE) == -1 fd:%d\n", client->fd);
 				http_client_free(client);
 				return;
 			}
@@ -598,7 +1183,8 @@ void on_write(http_client_t *client)
 			return;
 		}
 
-		//LOGDEBUG("client->write_buf.size:%d client->write_buf.cur:%d\n", client->write_buf.size, client->write_buf.cur);
+		if (write_size > budget)
+			write_size = budget;
 
 		write_bytes = pevent_write(client->pevent,
 			client->write_buf.buf + client->write_buf.cur, write_size);
@@ -615,6 +1201,7 @@ void on_write(http_client_t *client)
 		else
 		{
 			client->write_buf.cur += write_bytes;
+			budget -= write_bytes;
 		}
 	}
 }
@@ -647,6 +1234,7 @@ void on_accept(pevent_t *pevent, int event, http_server_t *service)
 	struct sockaddr in_addr;
 	socklen_t in_len;
 	http_client_t *client;
+	http_ip_t *ipstat;
 	int fd;
 
 	if (service == NULL || event != PEVENT_READ)
@@ -673,6 +1261,23 @@ void on_accept(pevent_t *pevent, int event, http_server_t *service)
 			}
 		}
 
+		ipstat = http_ip_get(service,
+			((struct sockaddr_in *)&in_addr)->sin_addr.s_addr);
+		if (ipstat == NULL)
+		{
+			close(fd);
+			continue;
+		}
+
+		if (service->limit.max_conn > 0
+			&& ipstat->conns >= service->limit.max_conn)
+		{
+			++ipstat->rejected;
+			++service->rejected;
+			close(fd);
+			continue;
+		}
+
 		if (set_nonblocking(fd) == -1)
 		{
 			LOGWARN("set_nonblocking(%s:%u) error\n",
@@ -688,6 +1293,9 @@ void on_accept(pevent_t *pevent, int event, http_server_t *service)
 			continue;
 		}
 
+		client->ipstat = ipstat;
+		http_ip_hold(service, ipstat);
+
 		strcpy(client->ip,
 			inet_ntoa(((struct sockaddr_in *)&in_addr)->sin_addr));
 
@@ -716,15 +1324,32 @@ http_server_t * http_server_create(pevent_base_t *base,
 	return service;
 }
 
+void http_server_set_release_callback(http_server_t *service,
+	http_release_callback release_callback)
+{
+	service->release_callback = release_callback;
+}
+
+void http_server_set_limit(http_server_t *service, const http_limit_t *limit)
+{
+	http_ip_t *ipstat;
+	http_ip_t *tmp_ipstat;
+
+	memcpy(&service->limit, limit, sizeof(http_limit_t));
+
+	HASH_ITER(hh, service->ips, ipstat, tmp_ipstat)
+	{
+		ipstat->tokens = service->limit.burst * HTTP_TOKEN_UNIT;
+	}
+}
+
 int http_server_start(http_server_t *service)
 {
 	int fd;
 	int opt;
-	pevent_t *pevent;
 
 	fd = -1;
 	opt = 1;
-	pevent = NULL;
 
 	if (service->pevent)
 		return -1;
@@ -754,11 +1379,33 @@ int http_server_start(http_server_t *service)
 		goto __error;
 	}
 
+	if (http_server_start_fd(service, fd) == -1)
+	{
+		return -1;
+	}
+
+	return 0;
+
+__error:
+	if (fd > 0)
+		close(fd);
+
+	return -1;
+}
+
+int http_server_start_fd(http_server_t *service, int fd)
+{
+	pevent_t *pevent;
+
+	if (service->pevent)
+		return -1;
+
 	if (set_nonblocking(fd) == -1)
 	{
 		LOGWARN("set_nonblocking(%s:%u) error\n",
 			inet_ntoa(service->addr_in.sin_addr), service->addr_in.sin_port);
-		goto __error;
+		close(fd);
+		return -1;
 	}
 
 	pevent = pevent_new(service->base, fd, (pevent_callback)on_accept, service);
@@ -766,21 +1413,67 @@ int http_server_start(http_server_t *service)
 	if (pevent_set(pevent, PEVENT_READ) == -1)
 	{
 		LOGERROR("pevent_set(fd:%d) error\n", fd);
-		goto __error;
+		pevent_free(pevent);
+		return -1;
 	}
 
 	service->pevent = pevent;
 
 	return 0;
+}
 
-__error:
-	if (fd > 0)
+int http_server_get_fd(http_server_t *service)
+{
+	if (service->pevent == NULL)
+		return -1;
+
+	return pevent_get_fd(service->pevent);
+}
+
+int http_server_client_count(http_server_t *service)
+{
+	return HASH_COUNT(service->clients);
+}
+
+http_client_t * http_server_adopt(http_server_t *service, int fd, void *delay_ptr)
+{
+	struct sockaddr_in in_addr;
+	socklen_t in_len;
+	http_client_t *client;
+
+	in_len = sizeof(in_addr);
+	if (getpeername(fd, (struct sockaddr *)&in_addr, &in_len) == -1)
+	{
+		LOGWARN("getpeername(fd:%d) error\n", fd);
 		close(fd);
+		return NULL;
+	}
 
-	if (!pevent)
-		pevent_free(pevent);
+	if (set_nonblocking(fd) == -1)
+	{
+		close(fd);
+		return NULL;
+	}
 
-	return -1;
+	client = http_client_new(service, fd);
+	if (client == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	strcpy(client->ip, inet_ntoa(in_addr.sin_addr));
+	client->port = in_addr.sin_port;
+	client->delay_ptr = delay_ptr;
+
+	//a full table leaves the adopted connection unlimited
+	client->ipstat = http_ip_get(service, in_addr.sin_addr.s_addr);
+	if (client->ipstat)
+		http_ip_hold(service, client->ipstat);
+
+	LOGDEBUG("adopt(%s:%u) fd:%d\n", client->ip, client->port, client->fd);
+
+	return client;
 }
 
 void http_server_stop(http_server_t *service)
@@ -792,11 +1485,128 @@ void http_server_stop(http_server_t *service)
 	}
 }
 
+int http_server_drain(http_server_t *service)
+{
+	http_client_t *client;
+	http_client_t *tmp_client;
+
+	HASH_ITER(hh, service->clients, client, tmp_client)
+	{
+		//writing clients are closed by on_write once the buffer is flushed
+		http_client_release_delay(client);
+
+		if (!client->writing)
+		{
+			http_client_free(client);
+		}
+	}
+
+	return HASH_COUNT(service->clients);
+}
+
+void http_server_metrics(http_server_t *service, http_response_t *response)
+{
+	http_ip_t *ipstat;
+	http_ip_t *tmp_ipstat;
+	http_client_t *client;
+	http_client_t *tmp_client;
+	struct in_addr addr;
+	char ip[32];
+	int bytes;
+	int parsers;
+	int fastest, slowest;
+
+	bytes = 0;
+	parsers = 0;
+	fastest = 0;
+	slowest = 0;
+
+	HASH_ITER(hh, service->clients, client, tmp_client)
+	{
+		bytes += http_client_get_memory(client);
+		parsers += client->parser != NULL;
+
+		if (!client->stream || client->latency_us == 0)
+			continue;
+
+		if (fastest == 0 || client->latency_us < fastest)
+			fastest = client->latency_us;
+
+		if (client->latency_us > slowest)
+			slowest = client->latency_us;
+	}
+
+	http_response_append_data(response, "http_clients %u\n", HASH_COUNT(service->clients));
+	http_response_append_data(response, "http_client_bytes %d\n", bytes);
+	http_response_append_data(response, "http_client_parsers %d\n", parsers);
+	http_response_append_data(response, "http_writes_deferred %u\n", service->deferred);
+	http_response_append_data(response, "http_delivery_latency_max_us %d\n", slowest);
+	http_response_append_data(response, "http_delivery_skew_us %d\n", slowest - fastest);
+	http_response_append_data(response, "http_rejected %u\n", service->rejected);
+
+	HASH_ITER(hh, service->ips, ipstat, tmp_ipstat)
+	{
+		addr.s_addr = ipstat->addr;
+		strcpy(ip, inet_ntoa(addr));
+
+		http_response_append_data(response,
+			"http_ip_connections{ip=\"%s\"} %d\n"
+			"http_ip_streams{ip=\"%s\"} %d\n"
+			"http_ip_tokens{ip=\"%s\"} %d\n"
+			"http_ip_requests{ip=\"%s\"} %u\n"
+			"http_ip_rejected{ip=\"%s\"} %u\n",
+			ip, ipstat->conns,
+			ip, ipstat->streams,
+			ip, ipstat->tokens / HTTP_TOKEN_UNIT,
+			ip, ipstat->requests,
+			ip, ipstat->rejected);
+	}
+}
+
 void http_server_cleanup(http_server_t *service)
 {
+	http_client_t *client;
+	http_client_t *tmp_client;
+
+	http_ip_t *ipstat;
+	http_ip_t *tmp_ipstat;
+
+	HASH_ITER(hh, service->clients, client, tmp_client)
+	{
+		http_client_free(client);
+	}
+
+	HASH_ITER(hh, service->ips, ipstat, tmp_ipstat)
+	{
+		HASH_DEL(service->ips, ipstat);
+		free(ipstat);
+	}
+
 	free(service);
 }
 
+//answer a waiting client outside of a request or the delay iteration,
+//-1 once the client is gone
+int http_client_respond(http_client_t *client, http_response_t *response)
+{
+	if (client->writing || client->reading)
+	{
+		http_response_free(response);
+		return 0;
+	}
+
+	if (http_response_compile(response, client) == -1)
+		return -1;
+
+	if (!client->writing && !client->delay_ptr)
+	{
+		http_client_free(client);
+		return -1;
+	}
+
+	return 0;
+}
+
 int http_server_keeplive_delay_iter(http_server_t *service,
 	http_delay_callback callback, void *ptr)
 {
@@ -809,6 +1619,16 @@ int http_server_keeplive_delay_iter(http_server_t *service,
 	client = NULL;
 	tmp_client = NULL;
 
+	//the first client goes last next time, nobody is always served first
+	client = service->clients;
+	if (client && client->hh.next)
+	{
+		HASH_DEL(service->clients, client);
+		HASH_ADD_INT(service->clients, fd, client);
+	}
+
+	service->iter_us = http_now_us();
+
 	HASH_ITER(hh, service->clients, client, tmp_client)
 	{
 		if (client->delay_ptr && !client->writing && !client->reading)
@@ -816,6 +1636,8 @@ int http_server_keeplive_delay_iter(http_server_t *service,
 			response = callback(client, ptr, client->delay_ptr);
 			if (response != NULL)
 			{
+				client->frame_us = service->iter_us;
+
 				if (http_response_compile(response, client) == -1)
 				{
 					continue; //already free
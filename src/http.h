@@ -5,6 +5,10 @@
 #define HTTP_METHOD_GET		1
 #define HTTP_METHOD_POST	2
 
+#define HTTP_MAX_URI_SIZE	(256 * 2 + 2)
+#define HTTP_MAX_DIGEST_SIZE	(HTTP_MAX_URI_SIZE + 256)
+#define HTTP_MAX_ETAG_SIZE		64
+
 typedef struct _pevent_base pevent_base_t;
 typedef struct _http_server http_server_t;
 typedef struct _http_client http_client_t;
@@ -27,37 +31,101 @@ typedef struct _http_request
 	char path[256];
 	char param[256];
 	char host[256];
-	char digest[256];
+	char digest[HTTP_MAX_DIGEST_SIZE];
+	char etag[HTTP_MAX_ETAG_SIZE];	//If-None-Match, quotes included
 
 	http_client_t *client;
 } http_request_t;
 
+typedef struct _http_pace
+{
+	int unsent;		//bytes in the kernel not on the wire yet
+	int rtt;		//us, 0 unknown
+	int rate;		//bytes per second the congestion window allows, 0 unknown
+} http_pace_t;
+
+typedef struct _http_limit
+{
+	int max_conn;		//concurrent connections per ip, 0 no limit
+	int max_stream;		//concurrent streams per ip, 0 no limit
+	int rate;			//requests per second per ip, 0 no limit
+	int burst;
+} http_limit_t;
+
 typedef http_response_t * (*http_request_callback)(http_request_t *);
 
 typedef http_response_t * (*http_delay_callback)(http_client_t *, void *ptr, void *delay_ptr);
 
+typedef void (*http_release_callback)(http_client_t *, void *delay_ptr);
+
 void http_client_set_delay(http_client_t *client, void *ptr);
 
+void http_client_close(http_client_t *client);
+
+int http_client_get_queued(http_client_t *client);
+
+int http_client_get_memory(http_client_t *client);
+
+int http_client_get_pace(http_client_t *client, http_pace_t *pace);
+
+//us a delayed response took from its turn until it left userspace, averaged
+int http_client_get_latency(http_client_t *client);
+
+int http_client_respond(http_client_t *client, http_response_t *response);
+
+int http_client_set_stream(http_client_t *client);
+
+void http_client_keep_stream(http_client_t *client);
+
+void http_client_clear_stream(http_client_t *client);
+
 const char * http_client_getip(http_client_t *client);
 
 unsigned short http_client_getport(http_client_t *client);
 
+int http_client_getfd(http_client_t *client);
+
 http_response_t * http_response_new(int code, const char *format, ...);
 
+void http_response_free(http_response_t *response);
+
 int http_response_addheader(http_response_t *response, const char *format, ...);
 
 void http_response_append(http_response_t *response, const char *string, ...);
 
 void http_response_set_data(http_response_t *response, char *buf, int size);
 
+int http_response_add_data(http_response_t *response, const char *buf, int size);
+
+int http_response_set_file(http_response_t *response, int fd, long long offset, int size);
+
+void http_response_append_data(http_response_t *response, const char *format, ...);
+
 http_server_t * http_server_create(pevent_base_t *base,
 	const char *ip, unsigned short port,
 	http_request_callback request_callback);
 
+void http_server_set_release_callback(http_server_t *service,
+	http_release_callback release_callback);
+
+void http_server_set_limit(http_server_t *service, const http_limit_t *limit);
+
 int http_server_start(http_server_t *service);
 
+int http_server_start_fd(http_server_t *service, int fd);
+
+int http_server_get_fd(http_server_t *service);
+
+int http_server_client_count(http_server_t *service);
+
+http_client_t * http_server_adopt(http_server_t *service, int fd, void *delay_ptr);
+
 void http_server_stop(http_server_t *service);
 
+int http_server_drain(http_server_t *service);
+
+void http_server_metrics(http_server_t *service, http_response_t *response);
+
 void http_server_cleanup(http_server_t *service);
 
 int http_server_keeplive_delay_iter(http_server_t *service,
@@ -0,0 +1,1296 @@
+#include "jpeg.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+#define JPEG_READ_WORD(p) ((p)[0] << 8 | (p)[1])
+
+//true when one of the 8 bytes is 0xff
+#define JPEG_HAS_FF(w) (((~(w) - 0x0101010101010101ULL) & (w) & 0x8080808080808080ULL) != 0)
+
+#define JPEG_HUFFMAN_FAST_BITS	9
+#define JPEG_MARKER_RST0		0xd0
+#define JPEG_MARKER_RST7		0xd7
+
+
+typedef struct _jpeg_huffman
+{
+	//length << 8 | symbol for codes up to the fast bits, 0 for longer codes
+	unsigned short fast[1 << JPEG_HUFFMAN_FAST_BITS];
+	int maxcode[18];
+	int delta[17];
+	const unsigned char *values;
+} jpeg_huffman_t;
+
+typedef void (*jpeg_block_callback)(void *ptr, int component, int x, int y, const int *block);
+
+typedef struct _jpeg_bits
+{
+	const unsigned char *p;
+	const unsigned char *end;
+	uint32_t bits;		//msb first
+	int count;
+} jpeg_bits_t;
+
+
+//tables of annex K.3, uvc cameras send frames without DHT and rely on them
+static const unsigned char JPEG_STD_DC_LUMA[16 + 12] = {
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const unsigned char JPEG_STD_DC_CHROMA[16 + 12] = {
+	0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const unsigned char JPEG_STD_AC_LUMA[16 + 162] = {
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+static const unsigned char JPEG_STD_AC_CHROMA[16 + 162] = {
+	0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+static const int JPEG_ZIGZAG[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+//orthonormal dct bases scaled by 4096, [sample][frequency] for the
+//reduced inverse transforms and [frequency][sample] for the forward one
+static const int JPEG_IDCT_2[2][2] = {
+	{ 2896, 2896 },
+	{ 2896, -2896 },
+};
+
+static const int JPEG_IDCT_4[4][4] = {
+	{ 2048, 2676, 2048, 1108 },
+	{ 2048, 1108, -2048, -2676 },
+	{ 2048, -1108, -2048, 2676 },
+	{ 2048, -2676, 2048, -1108 },
+};
+
+static const int JPEG_FDCT[8][8] = {
+	{ 1448, 1448, 1448, 1448, 1448, 1448, 1448, 1448 },
+	{ 2009, 1703, 1138, 400, -400, -1138, -1703, -2009 },
+	{ 1892, 784, -784, -1892, -1892, -784, 784, 1892 },
+	{ 1703, -400, -2009, -1138, 1138, 2009, 400, -1703 },
+	{ 1448, -1448, -1448, 1448, 1448, -1448, -1448, 1448 },
+	{ 1138, -2009, 400, 1703, -1703, -400, 2009, -1138 },
+	{ 784, -1892, 1892, -784, -784, 1892, -1892, 784 },
+	{ 400, -1138, 1703, -2009, 2009, -1703, 1138, -400 },
+};
+
+static const unsigned char *JPEG_STD_HTABLES[2][2] = {
+	{ JPEG_STD_DC_LUMA, JPEG_STD_DC_CHROMA },
+	{ JPEG_STD_AC_LUMA, JPEG_STD_AC_CHROMA },
+};
+
+
+static int jpeg_parse_dqt(const unsigned char *p, int len, jpeg_frame_t *frame)
+{
+	int id, precision;
+
+	while (len > 0)
+	{
+		precision = p[0] >> 4;
+		id = p[0] & 0x0f;
+
+		if (id >= JPEG_MAX_QTABLE)
+			return -1;
+
+		++p;
+		--len;
+
+		if (precision == 0)
+		{
+			if (len < JPEG_QTABLE_SIZE)
+				return -1;
+
+			frame->qtables[id] = p;
+			p += JPEG_QTABLE_SIZE;
+			len -= JPEG_QTABLE_SIZE;
+		}
+		else
+		{
+			//16 bit tables are never produced by uvc cameras
+			frame->qtables[id] = NULL;
+			p += JPEG_QTABLE_SIZE * 2;
+			len -= JPEG_QTABLE_SIZE * 2;
+		}
+	}
+
+	return 0;
+}
+
+static int jpeg_parse_dht(const unsigned char *p, int len, jpeg_frame_t *frame)
+{
+	int type, id, i, count;
+
+	while (len >= 17)
+	{
+		type = p[0] >> 4;
+		id = p[0] & 0x0f;
+
+		if (type > JPEG_HTABLE_AC || id >= JPEG_MAX_HTABLE)
+			return -1;
+
+		count = 0;
+		for (i = 1; i <= 16; ++i)
+			count += p[i];
+
+		if (count > 256 || len < 17 + count)
+			return -1;
+
+		frame->htables[type][id] = p + 1;
+
+		p += 17 + count;
+		len -= 17 + count;
+	}
+
+	frame->has_dht = 1;
+
+	return 0;
+}
+
+static int jpeg_parse_sos(const unsigned char *p, int len, jpeg_frame_t *frame)
+{
+	int i, j, count;
+
+	count = len > 0 ? p[0] : 0;
+	if (len < 1 + count * 2)
+		return -1;
+
+	for (i = 0; i < count; ++i)
+	{
+		for (j = 0; j < frame->component_count; ++j)
+		{
+			if (frame->components[j].id == p[1 + i * 2])
+			{
+				frame->components[j].dc_table = (p[2 + i * 2] >> 4) & (JPEG_MAX_HTABLE - 1);
+				frame->components[j].ac_table = p[2 + i * 2] & (JPEG_MAX_HTABLE - 1);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int jpeg_parse_sof(const unsigned char *p, int len, jpeg_frame_t *frame)
+{
+	int i;
+	jpeg_component_t *component;
+
+	if (len < 6)
+		return -1;
+
+	frame->height = JPEG_READ_WORD(p + 1);
+	frame->width = JPEG_READ_WORD(p + 3);
+	frame->component_count = p[5];
+
+	if (frame->component_count > JPEG_MAX_COMPONENT
+		|| len < 6 + frame->component_count * 3)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < frame->component_count; ++i)
+	{
+		component = &frame->components[i];
+		component->id = p[6 + i * 3];
+		component->h = p[7 + i * 3] >> 4;
+		component->v = p[7 + i * 3] & 0x0f;
+		component->qtable = p[8 + i * 3] & 0x03;
+	}
+
+	frame->sampling = JPEG_SAMPLING_OTHER;
+
+	if (frame->component_count == 3
+		&& frame->components[1].h == 1 && frame->components[1].v == 1
+		&& frame->components[2].h == 1 && frame->components[2].v == 1
+		&& frame->components[0].h == 2)
+	{
+		if (frame->components[0].v == 1)
+			frame->sampling = JPEG_SAMPLING_422;
+		else if (frame->components[0].v == 2)
+			frame->sampling = JPEG_SAMPLING_420;
+	}
+
+	return 0;
+}
+
+int jpeg_parse(const char *buf, int size, jpeg_frame_t *frame)
+{
+	const unsigned char *p, *end;
+	int marker, len;
+
+	p = (const unsigned char *)buf;
+	end = p + size;
+
+	memset(frame, 0, sizeof(jpeg_frame_t));
+	frame->sampling = JPEG_SAMPLING_OTHER;
+
+	if (size < 4 || p[0] != 0xff || p[1] != JPEG_MARKER_SOI)
+		return -1;
+
+	p += 2;
+
+	while (p + 4 <= end)
+	{
+		if (p[0] != 0xff)
+			return -1;
+
+		marker = p[1];
+		if (marker == 0xff)
+		{
+			++p; //fill byte
+			continue;
+		}
+
+		len = JPEG_READ_WORD(p + 2);
+		if (len < 2 || p + 2 + len > end)
+			return -1;
+
+		p += 4;
+		len -= 2;
+
+		switch (marker)
+		{
+		case JPEG_MARKER_DQT:
+			if (jpeg_parse_dqt(p, len, frame) == -1)
+				return -1;
+			break;
+		case JPEG_MARKER_SOF0:
+		case JPEG_MARKER_SOF1:
+			if (jpeg_parse_sof(p, len, frame) == -1)
+				return -1;
+			break;
+		case JPEG_MARKER_DHT:
+			if (jpeg_parse_dht(p, len, frame) == -1)
+				return -1;
+			break;
+		case JPEG_MARKER_DRI:
+			if (len < 2)
+				return -1;
+			frame->restart_interval = JPEG_READ_WORD(p);
+			break;
+		case JPEG_MARKER_SOS:
+			if (frame->component_count == 0
+				|| jpeg_parse_sos(p, len, frame) == -1)
+			{
+				return -1;
+			}
+
+			frame->scan = p + len;
+
+			//cameras pad the buffer after EOI
+			for (p = end - 2; p >= frame->scan; --p)
+			{
+				if (p[0] == 0xff && p[1] == JPEG_MARKER_EOI)
+					break;
+			}
+
+			frame->scan_size = p >= frame->scan ? p - frame->scan : end - frame->scan;
+
+			return 0;
+		}
+
+		p += len;
+	}
+
+	return -1;
+}
+
+static int jpeg_huffman_build(jpeg_huffman_t *huffman, const unsigned char *table)
+{
+	int length, i, code, k, fill;
+
+	memset(huffman->fast, 0, sizeof(huffman->fast));
+	huffman->values = table + 16;
+
+	code = 0;
+	k = 0;
+
+	for (length = 1; length <= 16; ++length)
+	{
+		huffman->delta[length] = k - code;
+
+		//more codes than the length allows, checked ahead of the fast table
+		if (code + table[length - 1] > 1 << length)
+			return -1;
+
+		for (i = 0; i < table[length - 1]; ++i, ++k, ++code)
+		{
+			if (length <= JPEG_HUFFMAN_FAST_BITS)
+			{
+				for (fill = 0; fill < 1 << (JPEG_HUFFMAN_FAST_BITS - length); ++fill)
+				{
+					huffman->fast[code << (JPEG_HUFFMAN_FAST_BITS - length) | fill]
+						= length << 8 | huffman->values[k];
+				}
+			}
+		}
+
+		huffman->maxcode[length] = table[length - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
+
+	huffman->maxcode[17] = INT32_MAX;
+
+	return 0;
+}
+
+//a marker stops the data, zero bits follow until the caller skips it
+static void jpeg_bits_fill(jpeg_bits_t *bits)
+{
+	unsigned int byte;
+
+	while (bits->count <= 24)
+	{
+		byte = 0;
+
+		if (bits->p < bits->end)
+		{
+			byte = *bits->p;
+
+			if (byte != 0xff)
+				++bits->p;
+			else if (bits->p + 1 < bits->end && bits->p[1] == 0)
+				bits->p += 2;
+			else
+				byte = 0;
+		}
+
+		bits->bits |= byte << (24 - bits->count);
+		bits->count += 8;
+	}
+}
+
+static inline void jpeg_bits_skip(jpeg_bits_t *bits, int count)
+{
+	bits->bits <<= count;
+	bits->count -= count;
+}
+
+static int jpeg_bits_decode(jpeg_bits_t *bits, const jpeg_huffman_t *huffman)
+{
+	int length, code, value;
+
+	if (bits->count < 16)
+		jpeg_bits_fill(bits);
+
+	value = huffman->fast[bits->bits >> (32 - JPEG_HUFFMAN_FAST_BITS)];
+	if (value)
+	{
+		jpeg_bits_skip(bits, value >> 8);
+		return value & 0xff;
+	}
+
+	for (length = JPEG_HUFFMAN_FAST_BITS + 1; length <= 16; ++length)
+	{
+		code = bits->bits >> (32 - length);
+		if (code <= huffman->maxcode[length])
+		{
+			jpeg_bits_skip(bits, length);
+			return huffman->values[code + huffman->delta[length]];
+		}
+	}
+
+	return -1;
+}
+
+static int jpeg_bits_extend(jpeg_bits_t *bits, int size)
+{
+	int value;
+
+	if (size == 0)
+		return 0;
+
+	if (bits->count < size)
+		jpeg_bits_fill(bits);
+
+	value = bits->bits >> (32 - size);
+	jpeg_bits_skip(bits, size);
+
+	return value < 1 << (size - 1) ? value - (1 << size) + 1 : value;
+}
+
+//restart markers reset the predictions and start on a byte boundary
+static int jpeg_bits_restart(jpeg_bits_t *bits)
+{
+	bits->bits = 0;
+	bits->count = 0;
+
+	while (bits->p + 1 < bits->end)
+	{
+		if (bits->p[0] == 0xff
+			&& bits->p[1] >= JPEG_MARKER_RST0 && bits->p[1] <= JPEG_MARKER_RST7)
+		{
+			bits->p += 2;
+			return 0;
+		}
+
+		++bits->p;
+	}
+
+	return -1;
+}
+
+//offset of the SOS marker, walking the headers only
+static int jpeg_find_sos(const unsigned char *p, int size, int *has_dht)
+{
+	int pos, len;
+
+	*has_dht = 0;
+
+	if (size < 4 || p[0] != 0xff || p[1] != JPEG_MARKER_SOI)
+		return -1;
+
+	for (pos = 2; pos + 4 <= size; pos += 2 + len)
+	{
+		if (p[pos] != 0xff)
+			return -1;
+
+		//fill bytes ahead of a marker
+		if (p[pos + 1] == 0xff)
+		{
+			len = -1;
+			continue;
+		}
+
+		len = JPEG_READ_WORD(p + pos + 2);
+		if (len < 2)
+			return -1;
+
+		if (p[pos + 1] == JPEG_MARKER_DHT)
+			*has_dht = 1;
+		else if (p[pos + 1] == JPEG_MARKER_SOS)
+			return pos;
+	}
+
+	return -1;
+}
+
+//the frame size through its EOI, -1 when SOI, the headers or EOI are broken.
+//cameras pad frames behind EOI, the scan runs backwards a word at a time
+int jpeg_frame_size(const char *buf, int size)
+{
+	const unsigned char *p;
+	uint64_t word;
+	int start, end, i, has_dht;
+
+	p = (const unsigned char *)buf;
+
+	start = jpeg_find_sos(p, size, &has_dht);
+	if (start == -1)
+		return -1;
+
+	start += 2 + JPEG_READ_WORD(p + start + 2);
+	if (start > size)
+		return -1;
+
+	for (end = size; end - start >= 8; end -= 8)
+	{
+		memcpy(&word, p + end - 8, sizeof(word));
+
+		if (!JPEG_HAS_FF(word))
+			continue;
+
+		for (i = end - 1; i >= end - 8; --i)
+		{
+			if (p[i] == 0xff && i + 1 < size && p[i + 1] == JPEG_MARKER_EOI)
+				return i + 2;
+		}
+	}
+
+	for (i = end - 1; i >= start; --i)
+	{
+		if (p[i] == 0xff && i + 1 < size && p[i + 1] == JPEG_MARKER_EOI)
+			return i + 2;
+	}
+
+	return -1;
+}
+
+//where the standard tables go in, -1 when the frame has its own
+int jpeg_dht_offset(const char *buf, int size)
+{
+	int pos, has_dht;
+
+	pos = jpeg_find_sos((const unsigned char *)buf, size, &has_dht);
+
+	return has_dht ? -1 : pos;
+}
+
+int jpeg_dc_size(const jpeg_frame_t *frame, int *width, int *height)
+{
+	int h, v;
+
+	if (frame->sampling == JPEG_SAMPLING_OTHER)
+		return -1;
+
+	h = frame->components[0].h;
+	v = frame->components[0].v;
+
+	*width = (frame->width + h * 8 - 1) / (h * 8) * h;
+	*height = (frame->height + v * 8 - 1) / (v * 8) * v;
+
+	return 0;
+}
+
+//walk all blocks of the scan, coefficients past the zigzag index last are
+//decoded only to find the next block
+static int jpeg_scan(const jpeg_frame_t *frame, int last, jpeg_block_callback callback, void *ptr)
+{
+	jpeg_huffman_t huffman[JPEG_MAX_COMPONENT][2];
+	const jpeg_component_t *component;
+	const unsigned char *table, *qtable;
+	jpeg_bits_t bits;
+	int predict[JPEG_MAX_COMPONENT];
+	int block[64];
+	int mcu_width, mcu_height, mcu, mcus, restart;
+	int c, type, x, y, k, symbol, value;
+
+	if (jpeg_dc_size(frame, &mcu_width, &mcu_height) == -1)
+		return -1;
+
+	for (c = 0; c < frame->component_count; ++c)
+	{
+		component = &frame->components[c];
+
+		if (frame->qtables[component->qtable] == NULL)
+			return -1;
+
+		for (type = JPEG_HTABLE_DC; type <= JPEG_HTABLE_AC; ++type)
+		{
+			table = frame->htables[type][type == JPEG_HTABLE_DC ? component->dc_table : component->ac_table];
+			if (table == NULL)
+				table = JPEG_STD_HTABLES[type][c == 0 ? 0 : 1];
+
+			if (jpeg_huffman_build(&huffman[c][type], table) == -1)
+				return -1;
+		}
+
+		predict[c] = 0;
+	}
+
+	mcu_width /= frame->components[0].h;
+	mcu_height /= frame->components[0].v;
+	mcus = mcu_width * mcu_height;
+
+	bits.p = frame->scan;
+	bits.end = frame->scan + frame->scan_size;
+	bits.bits = 0;
+	bits.count = 0;
+
+	restart = frame->restart_interval;
+
+	for (mcu = 0; mcu < mcus; ++mcu)
+	{
+		if (frame->restart_interval && restart-- == 0)
+		{
+			if (jpeg_bits_restart(&bits) == -1)
+				return -1;
+
+			for (c = 0; c < frame->component_count; ++c)
+				predict[c] = 0;
+
+			restart = frame->restart_interval - 1;
+		}
+
+		for (c = 0; c < frame->component_count; ++c)
+		{
+			component = &frame->components[c];
+			qtable = frame->qtables[component->qtable];
+
+			for (y = 0; y < component->v; ++y)
+			{
+				for (x = 0; x < component->h; ++x)
+				{
+					for (k = 1; k <= last; ++k)
+						block[JPEG_ZIGZAG[k]] = 0;
+
+					symbol = jpeg_bits_decode(&bits, &huffman[c][JPEG_HTABLE_DC]);
+					if (symbol < 0 || symbol > 11)
+						return -1;
+
+					predict[c] += jpeg_bits_extend(&bits, symbol);
+					block[0] = predict[c] * qtable[0];
+
+					for (k = 1; k < 64; ++k)
+					{
+						symbol = jpeg_bits_decode(&bits, &huffman[c][JPEG_HTABLE_AC]);
+						if (symbol < 0)
+							return -1;
+
+						if ((symbol & 0x0f) == 0)
+						{
+							if (symbol != 0xf0)
+								break; //end of block
+
+							k += 15;
+							continue;
+						}
+
+						k += symbol >> 4;
+						if (k > 63)
+							return -1;
+
+						if (k > last)
+						{
+							if (bits.count < 16)
+								jpeg_bits_fill(&bits);
+							jpeg_bits_skip(&bits, symbol & 0x0f);
+						}
+						else
+						{
+							value = jpeg_bits_extend(&bits, symbol & 0x0f);
+							block[JPEG_ZIGZAG[k]] = value * qtable[k];
+						}
+					}
+
+					callback(ptr, c, mcu % mcu_width * component->h + x,
+						mcu / mcu_width * component->v + y, block);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+typedef struct _jpeg_dc_map
+{
+	short *map;
+	int width;
+} jpeg_dc_map_t;
+
+static void jpeg_on_dc_block(jpeg_dc_map_t *dc, int component, int x, int y, const int *block)
+{
+	//dequantized dc is eight times the block mean
+	if (component == 0)
+		dc->map[y * dc->width + x] = block[0] / 8;
+}
+
+int jpeg_decode_dc(const jpeg_frame_t *frame, short *map, int width, int height)
+{
+	jpeg_dc_map_t dc;
+	int map_width, map_height;
+
+	if (jpeg_dc_size(frame, &map_width, &map_height) == -1
+		|| map_width != width || map_height != height)
+	{
+		return -1;
+	}
+
+	dc.map = map;
+	dc.width = width;
+
+	return jpeg_scan(frame, 0, (jpeg_block_callback)jpeg_on_dc_block, &dc);
+}
+
+typedef struct _jpeg_plane
+{
+	unsigned char *pixels;
+	int width;
+	int height;
+} jpeg_plane_t;
+
+typedef struct _jpeg_scaler
+{
+	int size;		//pixels per block side, 8 >> shift
+	const int *idct;
+	jpeg_plane_t planes[JPEG_MAX_COMPONENT];
+} jpeg_scaler_t;
+
+typedef struct _jpeg_writer
+{
+	unsigned char *p;
+	unsigned char *end;
+	uint32_t bits;
+	int count;
+	int overflow;
+} jpeg_writer_t;
+
+typedef struct _jpeg_encoder
+{
+	unsigned short code[256];
+	unsigned char size[256];
+} jpeg_encoder_t;
+
+
+static inline unsigned char jpeg_clamp(int value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+//reduced inverse dct of the low frequencies, the block shrinks to size x size
+static void jpeg_on_scale_block(jpeg_scaler_t *scaler, int component, int x, int y, const int *block)
+{
+	jpeg_plane_t *plane;
+	unsigned char *out;
+	int tmp[4][4];
+	int i, j, u, v, size, sum;
+
+	plane = &scaler->planes[component];
+	size = scaler->size;
+	out = plane->pixels + y * size * plane->width + x * size;
+
+	if (size == 1)
+	{
+		out[0] = jpeg_clamp(((block[0] + 4) >> 3) + 128);
+		return;
+	}
+
+	for (v = 0; v < size; ++v)
+	{
+		for (i = 0; i < size; ++i)
+		{
+			sum = 0;
+			for (u = 0; u < size; ++u)
+				sum += scaler->idct[i * size + u] * block[v * 8 + u];
+
+			tmp[v][i] = sum >> 6;
+		}
+	}
+
+	//the low frequencies of 8 samples stand for 8 / size averaged ones
+	for (j = 0; j < size; ++j)
+	{
+		for (i = 0; i < size; ++i)
+		{
+			sum = 0;
+			for (v = 0; v < size; ++v)
+				sum += scaler->idct[j * size + v] * tmp[v][i];
+
+			sum = (sum >> 6) * size / 8;
+			out[j * plane->width + i] = jpeg_clamp(((sum + (1 << 11)) >> 12) + 128);
+		}
+	}
+}
+
+static void jpeg_write_byte(jpeg_writer_t *writer, int byte)
+{
+	if (writer->p < writer->end)
+		*writer->p++ = byte;
+	else
+		writer->overflow = 1;
+}
+
+static void jpeg_write_word(jpeg_writer_t *writer, int word)
+{
+	jpeg_write_byte(writer, word >> 8);
+	jpeg_write_byte(writer, word & 0xff);
+}
+
+static void jpeg_write_bits(jpeg_writer_t *writer, uint32_t value, int count)
+{
+	int byte;
+
+	writer->bits |= (value & ((1 << count) - 1)) << (32 - writer->count - count);
+	writer->count += count;
+
+	while (writer->count >= 8)
+	{
+		byte = writer->bits >> 24;
+		jpeg_write_byte(writer, byte);
+
+		if (byte == 0xff)
+			jpeg_write_byte(writer, 0);
+
+		writer->bits <<= 8;
+		writer->count -= 8;
+	}
+}
+
+static void jpeg_encoder_build(jpeg_encoder_t *encoder, const unsigned char *table)
+{
+	int length, i, k, code;
+
+	code = 0;
+	k = 0;
+
+	for (length = 1; length <= 16; ++length)
+	{
+		for (i = 0; i < table[length - 1]; ++i, ++k, ++code)
+		{
+			encoder->code[table[16 + k]] = code;
+			encoder->size[table[16 + k]] = length;
+		}
+
+		code <<= 1;
+	}
+}
+
+static int jpeg_bit_length(int value)
+{
+	int length;
+
+	if (value < 0)
+		value = -value;
+
+	for (length = 0; value; ++length)
+		value >>= 1;
+
+	return length;
+}
+
+static void jpeg_encode_value(jpeg_writer_t *writer, const jpeg_encoder_t *encoder, int symbol, int value, int length)
+{
+	jpeg_write_bits(writer, encoder->code[symbol], encoder->size[symbol]);
+
+	if (length)
+		jpeg_write_bits(writer, value < 0 ? value - 1 : value, length);
+}
+
+//quantized coefficients in zigzag order
+static void jpeg_encode_coefficients(jpeg_writer_t *writer, const int *coefficients,
+	const jpeg_encoder_t *encoder, int *predict)
+{
+	int k, run, length;
+
+	length = jpeg_bit_length(coefficients[0] - *predict);
+	jpeg_encode_value(writer, &encoder[0], length, coefficients[0] - *predict, length);
+	*predict = coefficients[0];
+
+	run = 0;
+
+	for (k = 1; k < 64; ++k)
+	{
+		if (coefficients[k] == 0)
+		{
+			++run;
+			continue;
+		}
+
+		for (; run > 15; run -= 16)
+			jpeg_write_bits(writer, encoder[1].code[0xf0], encoder[1].size[0xf0]);
+
+		length = jpeg_bit_length(coefficients[k]);
+		jpeg_encode_value(writer, &encoder[1], run << 4 | length, coefficients[k], length);
+		run = 0;
+	}
+
+	if (run > 0)
+		jpeg_write_bits(writer, encoder[1].code[0x00], encoder[1].size[0x00]);
+}
+
+static void jpeg_encode_block(jpeg_writer_t *writer, const jpeg_plane_t *plane,
+	int x, int y, const unsigned char *qtable, const jpeg_encoder_t *encoder, int *predict)
+{
+	int pixels[8][8], tmp[8][8], coefficients[64];
+	int i, j, u, v, k, sum, value, limit;
+
+	//blocks over the edge repeat the last row and column
+	for (j = 0; j < 8; ++j)
+	{
+		v = y + j < plane->height ? y + j : plane->height - 1;
+
+		for (i = 0; i < 8; ++i)
+		{
+			u = x + i < plane->width ? x + i : plane->width - 1;
+			pixels[j][i] = plane->pixels[v * plane->width + u] - 128;
+		}
+	}
+
+	for (j = 0; j < 8; ++j)
+	{
+		for (u = 0; u < 8; ++u)
+		{
+			sum = 0;
+			for (i = 0; i < 8; ++i)
+				sum += JPEG_FDCT[u][i] * pixels[j][i];
+
+			tmp[j][u] = sum >> 8;
+		}
+	}
+
+	for (k = 0; k < 64; ++k)
+	{
+		u = JPEG_ZIGZAG[k] % 8;
+		v = JPEG_ZIGZAG[k] / 8;
+
+		sum = 0;
+		for (j = 0; j < 8; ++j)
+			sum += JPEG_FDCT[v][j] * tmp[j][u];
+
+		//to the quantizer step with rounding, sum carries 16 fraction bits
+		value = (sum >= 0 ? sum + qtable[k] * 32768 : sum - qtable[k] * 32768) / (qtable[k] * 65536);
+
+		limit = k == 0 ? 2047 : 1023;
+		if (value > limit)
+			value = limit;
+		else if (value < -limit)
+			value = -limit;
+
+		coefficients[k] = value;
+	}
+
+	jpeg_encode_coefficients(writer, coefficients, encoder, predict);
+}
+
+//all four standard tables in one segment
+static void jpeg_write_dht(jpeg_writer_t *writer)
+{
+	int i, type, c, count, total;
+
+	total = 2;
+
+	for (type = JPEG_HTABLE_DC; type <= JPEG_HTABLE_AC; ++type)
+	{
+		for (i = 0; i < 2; ++i)
+		{
+			count = 0;
+			for (c = 0; c < 16; ++c)
+				count += JPEG_STD_HTABLES[type][i][c];
+
+			total += 1 + 16 + count;
+		}
+	}
+
+	jpeg_write_word(writer, 0xff00 | JPEG_MARKER_DHT);
+	jpeg_write_word(writer, total);
+
+	for (type = JPEG_HTABLE_DC; type <= JPEG_HTABLE_AC; ++type)
+	{
+		for (i = 0; i < 2; ++i)
+		{
+			count = 0;
+			for (c = 0; c < 16; ++c)
+				count += JPEG_STD_HTABLES[type][i][c];
+
+			jpeg_write_byte(writer, type << 4 | i);
+
+			for (c = 0; c < 16 + count; ++c)
+				jpeg_write_byte(writer, JPEG_STD_HTABLES[type][i][c]);
+		}
+	}
+}
+
+//the segment cameras leave out, built once
+const char * jpeg_std_dht(int *size)
+{
+	static unsigned char dht[JPEG_STD_DHT_SIZE];
+	jpeg_writer_t writer;
+
+	if (dht[0] == 0)
+	{
+		writer.p = dht;
+		writer.end = dht + sizeof(dht);
+		writer.overflow = 0;
+
+		jpeg_write_dht(&writer);
+	}
+
+	*size = sizeof(dht);
+
+	return (const char *)dht;
+}
+
+static void jpeg_write_headers(jpeg_writer_t *writer, const jpeg_frame_t *frame, int width, int height)
+{
+	const jpeg_component_t *component;
+	int c, i;
+
+	writer->bits = 0;
+	writer->count = 0;
+	writer->overflow = 0;
+
+	jpeg_write_word(writer, 0xff00 | JPEG_MARKER_SOI);
+
+	for (i = 0; i < JPEG_MAX_QTABLE; ++i)
+	{
+		if (frame->qtables[i] == NULL)
+			continue;
+
+		jpeg_write_word(writer, 0xff00 | JPEG_MARKER_DQT);
+		jpeg_write_word(writer, 3 + JPEG_QTABLE_SIZE);
+		jpeg_write_byte(writer, i);
+
+		for (c = 0; c < JPEG_QTABLE_SIZE; ++c)
+			jpeg_write_byte(writer, frame->qtables[i][c]);
+	}
+
+	jpeg_write_word(writer, 0xff00 | JPEG_MARKER_SOF0);
+	jpeg_write_word(writer, 8 + frame->component_count * 3);
+	jpeg_write_byte(writer, 8);
+	jpeg_write_word(writer, height);
+	jpeg_write_word(writer, width);
+	jpeg_write_byte(writer, frame->component_count);
+
+	for (c = 0; c < frame->component_count; ++c)
+	{
+		component = &frame->components[c];
+		jpeg_write_byte(writer, component->id);
+		jpeg_write_byte(writer, component->h << 4 | component->v);
+		jpeg_write_byte(writer, component->qtable);
+	}
+
+	//browsers need the tables, cameras rely on them being implied
+	jpeg_write_dht(writer);
+
+	jpeg_write_word(writer, 0xff00 | JPEG_MARKER_SOS);
+	jpeg_write_word(writer, 6 + frame->component_count * 2);
+	jpeg_write_byte(writer, frame->component_count);
+
+	for (c = 0; c < frame->component_count; ++c)
+	{
+		jpeg_write_byte(writer, frame->components[c].id);
+		jpeg_write_byte(writer, c == 0 ? 0x00 : 0x11);
+	}
+
+	jpeg_write_byte(writer, 0);
+	jpeg_write_byte(writer, 63);
+	jpeg_write_byte(writer, 0);
+}
+
+//the jpeg size, -1 when it did not fit
+static int jpeg_write_end(jpeg_writer_t *writer, char *buf)
+{
+	//pad the last byte with ones
+	if (writer->count > 0)
+		jpeg_write_bits(writer, 0x7f, 8 - writer->count);
+
+	jpeg_write_word(writer, 0xff00 | JPEG_MARKER_EOI);
+
+	return writer->overflow ? -1 : (char *)writer->p - buf;
+}
+
+static void jpeg_encoders_build(jpeg_encoder_t encoder[2][2])
+{
+	int i;
+
+	for (i = 0; i < 2; ++i)
+	{
+		jpeg_encoder_build(&encoder[i][0], JPEG_STD_HTABLES[JPEG_HTABLE_DC][i]);
+		jpeg_encoder_build(&encoder[i][1], JPEG_STD_HTABLES[JPEG_HTABLE_AC][i]);
+	}
+}
+
+//decode the low frequency coefficients to a reduced image, encode it again
+int jpeg_scale(const jpeg_frame_t *frame, int shift, char *buf, int size)
+{
+	static const int last[4] = { 63, 24, 4, 0 };
+
+	jpeg_scaler_t scaler;
+	jpeg_writer_t writer;
+	jpeg_encoder_t encoder[2][2];
+	const jpeg_component_t *component;
+	jpeg_plane_t *plane;
+	int predict[JPEG_MAX_COMPONENT];
+	int width, height, blocks_width, blocks_height, mcus_width, mcus_height;
+	int c, x, y, mx, my, ret;
+
+	if (shift < 1 || shift > 3
+		|| jpeg_dc_size(frame, &blocks_width, &blocks_height) == -1)
+	{
+		return -1;
+	}
+
+	memset(&scaler, 0, sizeof(scaler));
+	scaler.size = 8 >> shift;
+	scaler.idct = shift == 1 ? &JPEG_IDCT_4[0][0] : &JPEG_IDCT_2[0][0];
+
+	for (c = 0; c < frame->component_count; ++c)
+	{
+		component = &frame->components[c];
+		plane = &scaler.planes[c];
+
+		plane->width = blocks_width / frame->components[0].h * component->h * scaler.size;
+		plane->height = blocks_height / frame->components[0].v * component->v * scaler.size;
+		plane->pixels = fmalloc(plane->width * plane->height);
+	}
+
+	ret = jpeg_scan(frame, last[shift], (jpeg_block_callback)jpeg_on_scale_block, &scaler);
+	if (ret == 0)
+	{
+		width = (frame->width + (1 << shift) - 1) >> shift;
+		height = (frame->height + (1 << shift) - 1) >> shift;
+
+		writer.p = (unsigned char *)buf;
+		writer.end = writer.p + size;
+
+		jpeg_write_headers(&writer, frame, width, height);
+		jpeg_encoders_build(encoder);
+
+		for (c = 0; c < frame->component_count; ++c)
+			predict[c] = 0;
+
+		mcus_width = (width + frame->components[0].h * 8 - 1) / (frame->components[0].h * 8);
+		mcus_height = (height + frame->components[0].v * 8 - 1) / (frame->components[0].v * 8);
+
+		for (my = 0; my < mcus_height && !writer.overflow; ++my)
+		{
+			for (mx = 0; mx < mcus_width; ++mx)
+			{
+				for (c = 0; c < frame->component_count; ++c)
+				{
+					component = &frame->components[c];
+
+					for (y = 0; y < component->v; ++y)
+					{
+						for (x = 0; x < component->h; ++x)
+						{
+							jpeg_encode_block(&writer, &scaler.planes[c],
+								(mx * component->h + x) * 8, (my * component->v + y) * 8,
+								frame->qtables[component->qtable], encoder[c == 0 ? 0 : 1], &predict[c]);
+						}
+					}
+				}
+			}
+		}
+
+		ret = jpeg_write_end(&writer, buf);
+	}
+
+	for (c = 0; c < frame->component_count; ++c)
+		free(scaler.planes[c].pixels);
+
+	return ret;
+}
+
+typedef struct _jpeg_cropper
+{
+	const jpeg_frame_t *frame;
+	jpeg_writer_t writer;
+	jpeg_encoder_t encoder[2][2];
+	int predict[JPEG_MAX_COMPONENT];
+	int left;		//mcus
+	int top;
+	int right;
+	int bottom;
+} jpeg_cropper_t;
+
+static void jpeg_on_crop_block(jpeg_cropper_t *cropper, int component, int x, int y, const int *block)
+{
+	const jpeg_component_t *config;
+	const unsigned char *qtable;
+	int coefficients[64];
+	int k;
+
+	config = &cropper->frame->components[component];
+
+	x /= config->h;
+	y /= config->v;
+
+	if (x < cropper->left || x >= cropper->right
+		|| y < cropper->top || y >= cropper->bottom)
+	{
+		return;
+	}
+
+	//the scan hands out multiples of the step, this is exact
+	qtable = cropper->frame->qtables[config->qtable];
+	for (k = 0; k < 64; ++k)
+		coefficients[k] = block[JPEG_ZIGZAG[k]] / qtable[k];
+
+	jpeg_encode_coefficients(&cropper->writer, coefficients,
+		cropper->encoder[component == 0 ? 0 : 1], &cropper->predict[component]);
+}
+
+int jpeg_crop_align(const jpeg_frame_t *frame, int *rect)
+{
+	int mcu_width, mcu_height, mcus_width, mcus_height;
+	int left, top, right, bottom;
+
+	//each field bounded by the frame first, the sums below cannot wrap
+	if (frame->sampling == JPEG_SAMPLING_OTHER
+		|| rect[0] < 0 || rect[1] < 0 || rect[2] <= 0 || rect[3] <= 0
+		|| rect[0] >= frame->width || rect[1] >= frame->height
+		|| rect[2] > frame->width || rect[3] > frame->height)
+	{
+		return -1;
+	}
+
+	mcu_width = frame->components[0].h * 8;
+	mcu_height = frame->components[0].v * 8;
+	mcus_width = (frame->width + mcu_width - 1) / mcu_width;
+	mcus_height = (frame->height + mcu_height - 1) / mcu_height;
+
+	left = rect[0] / mcu_width;
+	top = rect[1] / mcu_height;
+	right = (rect[0] + rect[2] + mcu_width - 1) / mcu_width;
+	bottom = (rect[1] + rect[3] + mcu_height - 1) / mcu_height;
+
+	if (left >= mcus_width || top >= mcus_height)
+		return -1;
+
+	if (right > mcus_width)
+		right = mcus_width;
+
+	if (bottom > mcus_height)
+		bottom = mcus_height;
+
+	//only the right and bottom edge of the frame keep a partial mcu
+	rect[0] = left * mcu_width;
+	rect[1] = top * mcu_height;
+	rect[2] = (right == mcus_width ? frame->width : right * mcu_width) - rect[0];
+	rect[3] = (bottom == mcus_height ? frame->height : bottom * mcu_height) - rect[1];
+
+	return 0;
+}
+
+//the mcus covering the rectangle, entropy coded again without any loss
+int jpeg_crop(const jpeg_frame_t *frame, int x, int y, int width, int height, char *buf, int size)
+{
+	jpeg_cropper_t cropper;
+	int mcu_width, mcu_height, c;
+	int rect[4];
+
+	rect[0] = x;
+	rect[1] = y;
+	rect[2] = width;
+	rect[3] = height;
+
+	if (jpeg_crop_align(frame, rect) == -1)
+		return -1;
+
+	mcu_width = frame->components[0].h * 8;
+	mcu_height = frame->components[0].v * 8;
+
+	cropper.frame = frame;
+	cropper.left = rect[0] / mcu_width;
+	cropper.top = rect[1] / mcu_height;
+	cropper.right = (rect[0] + rect[2] + mcu_width - 1) / mcu_width;
+	cropper.bottom = (rect[1] + rect[3] + mcu_height - 1) / mcu_height;
+
+	cropper.writer.p = (unsigned char *)buf;
+	cropper.writer.end = cropper.writer.p + size;
+
+	jpeg_write_headers(&cropper.writer, frame, rect[2], rect[3]);
+	jpeg_encoders_build(cropper.encoder);
+
+	for (c = 0; c < frame->component_count; ++c)
+		cropper.predict[c] = 0;
+
+	if (jpeg_scan(frame, 63, (jpeg_block_callback)jpeg_on_crop_block, &cropper) == -1)
+		return -1;
+
+	return jpeg_write_end(&cropper.writer, buf);
+}
@@ -0,0 +1,87 @@
+#ifndef JPEG_H_
+#define JPEG_H_
+
+
+#define JPEG_MARKER_SOI		0xd8
+#define JPEG_MARKER_EOI		0xd9
+#define JPEG_MARKER_SOF0	0xc0
+#define JPEG_MARKER_SOF1	0xc1
+#define JPEG_MARKER_DHT		0xc4
+#define JPEG_MARKER_SOS		0xda
+#define JPEG_MARKER_DQT		0xdb
+#define JPEG_MARKER_DRI		0xdd
+
+#define JPEG_MAX_COMPONENT	3
+#define JPEG_MAX_QTABLE		4
+#define JPEG_QTABLE_SIZE	64
+#define JPEG_MAX_HTABLE		4
+
+#define JPEG_STD_DHT_SIZE	(4 + 4 * 17 + 12 + 12 + 162 + 162)
+
+#define JPEG_HTABLE_DC		0
+#define JPEG_HTABLE_AC		1
+
+//sampling of the luma component, chroma is always 1x1
+#define JPEG_SAMPLING_422	0	//2x1
+#define JPEG_SAMPLING_420	1	//2x2
+#define JPEG_SAMPLING_OTHER	-1
+
+
+typedef struct _jpeg_component
+{
+	int id;
+	int h;
+	int v;
+	int qtable;
+	int dc_table;
+	int ac_table;
+} jpeg_component_t;
+
+typedef struct _jpeg_frame
+{
+	int width;
+	int height;
+	int sampling;
+	int restart_interval;
+	int has_dht;
+
+	int component_count;
+	jpeg_component_t components[JPEG_MAX_COMPONENT];
+
+	//8 bit tables in zigzag order, NULL when not present
+	const unsigned char *qtables[JPEG_MAX_QTABLE];
+
+	//16 code counts followed by the symbols, NULL when the camera left
+	//the table out and the standard one applies
+	const unsigned char *htables[2][JPEG_MAX_HTABLE];
+
+	//entropy coded data between SOS and EOI
+	const unsigned char *scan;
+	int scan_size;
+} jpeg_frame_t;
+
+
+int jpeg_parse(const char *buf, int size, jpeg_frame_t *frame);
+
+int jpeg_frame_size(const char *buf, int size);
+
+int jpeg_dht_offset(const char *buf, int size);
+
+const char * jpeg_std_dht(int *size);
+
+int jpeg_dc_size(const jpeg_frame_t *frame, int *width, int *height);
+
+//luma at 1/8 scale, one value per 8x8 block: the block mean minus 128
+int jpeg_decode_dc(const jpeg_frame_t *frame, short *map, int width, int height);
+
+//the frame at 1 / (1 << shift) size, shift 1 to 3. returns the jpeg size
+int jpeg_scale(const jpeg_frame_t *frame, int shift, char *buf, int size);
+
+//grows x, y, width, height in place to the mcus covering it, clipped to
+//the frame. -1 when the rectangle starts outside or the sampling is odd
+int jpeg_crop_align(const jpeg_frame_t *frame, int *rect);
+
+//the rectangle in pixels grown to mcu boundaries. returns the jpeg size
+int jpeg_crop(const jpeg_frame_t *frame, int x, int y, int width, int height, char *buf, int size);
+
+#endif
@@ -0,0 +1,299 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "util.h"
+
+#define LOG_RING_MASK		(LOG_RING_SIZE - 1)
+#define LOG_FLUSH_SIZE		4096
+
+
+typedef struct _log_record
+{
+	volatile unsigned int seq;
+	const log_site_t *site;
+	unsigned int suppressed;
+	char msg[LOG_MSG_SIZE];
+} log_record_t;
+
+typedef struct _log_ring
+{
+	log_record_t records[LOG_RING_SIZE];
+
+	volatile unsigned int head;
+	unsigned int tail;
+
+	volatile unsigned int dropped;
+	volatile unsigned int suppressed;
+	unsigned int dropped_report;
+
+	volatile int running;
+	pthread_t thread;
+	sem_t sem;
+} log_ring_t;
+
+volatile int g_log_level = LOG_LEVEL_INFO;
+
+static log_ring_t g_log;
+
+
+static int log_format(const log_record_t *record, char *buf, int size)
+{
+	int len;
+
+	len = 0;
+
+	if (record->suppressed)
+	{
+		len += snprintf(buf, size, "(%u similar messages suppressed)\n",
+			record->suppressed);
+	}
+
+	if (record->site->level == LOG_LEVEL_ERROR)
+	{
+		len += snprintf(buf + len, size - len, "error (%s, %s(), %d): ",
+			record->site->file,
+			record->site->function,
+			record->site->line);
+	}
+
+	len += snprintf(buf + len, size - len, "%s", record->msg);
+
+	return len < size ? len : size - 1;
+}
+
+static void log_output(const char *buf, int size)
+{
+	int ret;
+
+	while (size > 0)
+	{
+		ret = write(STDERR_FILENO, buf, size);
+		if (ret <= 0)
+			return;
+
+		buf += ret;
+		size -= ret;
+	}
+}
+
+//single consumer, only called from the flush thread or after it is joined
+static int log_flush()
+{
+	char buf[LOG_FLUSH_SIZE];
+	int len, count;
+	unsigned int seq, dropped;
+	log_record_t *record;
+
+	len = 0;
+	count = 0;
+
+	while (1)
+	{
+		record = &g_log.records[g_log.tail & LOG_RING_MASK];
+		seq = record->seq;
+		__sync_synchronize();
+
+		if ((int)(seq - (g_log.tail + 1)) < 0)
+			break; //empty
+
+		if (len + LOG_MSG_SIZE * 2 > LOG_FLUSH_SIZE)
+		{
+			log_output(buf, len);
+			len = 0;
+		}
+
+		len += log_format(record, buf + len, LOG_FLUSH_SIZE - len);
+
+		__sync_synchronize();
+		record->seq = g_log.tail + LOG_RING_SIZE;
+		++g_log.tail;
+		++count;
+	}
+
+	dropped = g_log.dropped;
+	if (dropped != g_log.dropped_report)
+	{
+		len += snprintf(buf + len, LOG_FLUSH_SIZE - len, "log ring full, %u records dropped\n",
+			dropped - g_log.dropped_report);
+		g_log.dropped_report = dropped;
+	}
+
+	if (len > 0)
+		log_output(buf, len);
+
+	return count;
+}
+
+static void * log_thread(void *arg)
+{
+	while (g_log.running)
+	{
+		sem_wait(&g_log.sem);
+		log_flush();
+	}
+
+	return NULL;
+}
+
+static void log_write_direct(log_site_t *site, const char *format, va_list ap)
+{
+	if (site->level == LOG_LEVEL_ERROR)
+	{
+		fprintf(stderr, "error (%s, %s(), %d): ",
+			site->file, site->function, site->line);
+	}
+
+	vfprintf(stderr, format, ap);
+}
+
+void log_write(log_site_t *site, const char *format, ...)
+{
+	va_list ap;
+	unsigned long tick;
+	unsigned int pos, seq, suppressed;
+	int diff;
+	log_record_t *record;
+
+	if (!g_log.running)
+	{
+		va_start(ap, format);
+		log_write_direct(site, format, ap);
+		va_end(ap);
+		return;
+	}
+
+	tick = gettickcount();
+	suppressed = 0;
+
+	if (tick - site->window >= 1000)
+	{
+		suppressed = site->suppressed;
+		site->window = tick;
+		site->count = 0;
+		site->suppressed = 0;
+	}
+
+	if (++site->count > LOG_SITE_RATE)
+	{
+		++site->suppressed;
+		__sync_fetch_and_add(&g_log.suppressed, 1);
+		return;
+	}
+
+	//bounded multi-producer queue, producers never block
+	pos = g_log.head;
+	while (1)
+	{
+		record = &g_log.records[pos & LOG_RING_MASK];
+		seq = record->seq;
+		__sync_synchronize();
+
+		diff = (int)(seq - pos);
+		if (diff == 0)
+		{
+			if (__sync_bool_compare_and_swap(&g_log.head, pos, pos + 1))
+				break;
+		}
+		else if (diff < 0)
+		{
+			__sync_fetch_and_add(&g_log.dropped, 1);
+			return;
+		}
+
+		pos = g_log.head;
+	}
+
+	record->site = site;
+	record->suppressed = suppressed;
+
+	va_start(ap, format);
+	vsnprintf(record->msg, LOG_MSG_SIZE, format, ap);
+	va_end(ap);
+
+	__sync_synchronize();
+	record->seq = pos + 1;
+
+	sem_post(&g_log.sem);
+}
+
+int log_init()
+{
+	unsigned int i;
+	int ret;
+	sigset_t mask, old_mask;
+
+	if (g_log.running)
+		return 0;
+
+	for (i = 0; i < LOG_RING_SIZE; ++i)
+		g_log.records[i].seq = i;
+
+	g_log.head = 0;
+	g_log.tail = 0;
+
+	if (sem_init(&g_log.sem, 0, 0) == -1)
+		return -1;
+
+	g_log.running = 1;
+
+	//signals are consumed by the event loop thread only
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&g_log.thread, NULL, log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0)
+	{
+		g_log.running = 0;
+		sem_destroy(&g_log.sem);
+		return -1;
+	}
+
+	atexit(log_cleanup);
+
+	return 0;
+}
+
+void log_cleanup()
+{
+	if (!g_log.running)
+		return;
+
+	g_log.running = 0;
+	sem_post(&g_log.sem);
+	pthread_join(g_log.thread, NULL);
+
+	log_flush();
+	sem_destroy(&g_log.sem);
+}
+
+void log_set_level(int level)
+{
+	if (level < LOG_LEVEL_ERROR)
+		level = LOG_LEVEL_ERROR;
+	else if (level > LOG_LEVEL_DEBUG)
+		level = LOG_LEVEL_DEBUG;
+
+	g_log_level = level;
+}
+
+int log_get_level()
+{
+	return g_log_level;
+}
+
+unsigned int log_get_dropped()
+{
+	return g_log.dropped;
+}
+
+unsigned int log_get_suppressed()
+{
+	return g_log.suppressed;
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+
+#define LOG_LEVEL_ERROR		0
+#define LOG_LEVEL_WARN		1
+#define LOG_LEVEL_INFO		2
+#define LOG_LEVEL_DEBUG		3
+
+#define LOG_RING_SIZE		128		//must be power of 2
+#define LOG_MSG_SIZE		256
+#define LOG_SITE_RATE		20		//records per call site per second
+
+
+typedef struct _log_site
+{
+	const char *file;
+	const char *function;
+	int line;
+	int level;
+
+	unsigned long window;
+	unsigned int count;
+	unsigned int suppressed;
+} log_site_t;
+
+extern volatile int g_log_level;
+
+//every call site owns a static log_site_t, used for rate limiting
+#define LOG_WRITE(lv, ...) do { \
+		static log_site_t __log_site = { __FILE__, __FUNCTION__, __LINE__, lv, 0, 0, 0 }; \
+		if ((lv) <= g_log_level) \
+			log_write(&__log_site, __VA_ARGS__); \
+	} while (0)
+
+
+void log_write(log_site_t *site, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+int log_init();
+
+void log_cleanup();
+
+void log_set_level(int level);
+
+int log_get_level();
+
+unsigned int log_get_dropped();
+
+unsigned int log_get_suppressed();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,572 @@
+#include "motion.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include "util.h"
+#include "video_manager.h"
+#include "v4l2port.h"
+#include "jpeg.h"
+
+#define MOTION_FOREGROUND_SHIFT		3	//changed blocks learn 8 times slower
+
+
+typedef struct _motion_device
+{
+	//event loop only
+	int enabled;
+	unsigned long last_tick;
+
+	//handed to the worker under the lock
+	char *pending;
+	int pending_size;
+	int pending_max;
+	time_t pending_time;
+
+	//worker only
+	char *work;
+	int work_max;
+	short *map;
+	int *background;	//luma << MOTION_LEARN_SHIFT
+	int width;
+	int height;
+	int learned;
+	unsigned int learned_session;
+
+	//under the lock
+	motion_zone_t zones[MOTION_MAX_ZONE];
+	int level[MOTION_MAX_ZONE];
+	int active[MOTION_MAX_ZONE];
+	unsigned long last_motion[MOTION_MAX_ZONE];
+	unsigned int event_id[MOTION_MAX_ZONE];
+	unsigned int session;	//bumped on disable, older frames are dropped
+
+	unsigned int frames;
+	unsigned int skipped;
+	unsigned int errors;
+	unsigned int events;
+} motion_device_t;
+
+typedef struct _motion_manage
+{
+	motion_device_t devices[MAX_VIDEO_COUNT];
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+	int next;
+
+	motion_event_t events[MOTION_MAX_EVENT];
+	unsigned int event_id;
+} motion_manage_t;
+
+
+static motion_manage_t g_motion = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+static motion_event_t * motion_find_event(unsigned int id)
+{
+	motion_event_t *event;
+
+	event = &g_motion.events[id % MOTION_MAX_EVENT];
+
+	return event->id == id ? event : NULL;
+}
+
+//called with the lock held
+static void motion_update_zone(motion_device_t *device, int index, int zone,
+	int level, time_t now, unsigned long tick)
+{
+	motion_event_t *event;
+
+	device->level[zone] = level;
+
+	if (level >= device->zones[zone].area)
+	{
+		device->last_motion[zone] = tick;
+
+		if (!device->active[zone])
+		{
+			device->active[zone] = 1;
+			++device->events;
+
+			event = &g_motion.events[++g_motion.event_id % MOTION_MAX_EVENT];
+			event->id = g_motion.event_id;
+			event->index = index;
+			event->zone = zone;
+			event->start = now;
+			event->end = 0;
+			event->peak = level;
+
+			device->event_id[zone] = event->id;
+
+			LOGINFO("motion start(device:%d zone:%d level:%d%%)\n", index, zone, level);
+		}
+
+		event = motion_find_event(device->event_id[zone]);
+		if (event && level > event->peak)
+			event->peak = level;
+	}
+	else if (device->active[zone] && tick - device->last_motion[zone] >= MOTION_HOLD)
+	{
+		device->active[zone] = 0;
+
+		event = motion_find_event(device->event_id[zone]);
+		if (event)
+			event->end = now;
+
+		LOGINFO("motion end(device:%d zone:%d)\n", index, zone);
+	}
+}
+
+static void motion_resize(motion_device_t *device, int width, int height)
+{
+	if (device->width == width && device->height == height)
+		return;
+
+	free(device->map);
+	free(device->background);
+
+	device->map = fmalloc(width * height * sizeof(short));
+	device->background = fmalloc(width * height * sizeof(int));
+	device->width = width;
+	device->height = height;
+	device->learned = 0;
+}
+
+static void motion_analyse(motion_device_t *device, int index, int size, time_t now, unsigned int session)
+{
+	jpeg_frame_t frame;
+	motion_zone_t zones[MOTION_MAX_ZONE];
+	int changed[MOTION_MAX_ZONE], blocks[MOTION_MAX_ZONE];
+	int width, height, x, y, i, z, shift, diff, level, foreground;
+	int x0[MOTION_MAX_ZONE], x1[MOTION_MAX_ZONE], y0[MOTION_MAX_ZONE], y1[MOTION_MAX_ZONE];
+	long long total;
+
+	if (jpeg_parse(device->work, size, &frame) == -1
+		|| jpeg_dc_size(&frame, &width, &height) == -1)
+	{
+		goto __error;
+	}
+
+	motion_resize(device, width, height);
+
+	if (jpeg_decode_dc(&frame, device->map, width, height) == -1)
+		goto __error;
+
+	//a background from before a disable is stale
+	if (!device->learned || device->learned_session != session)
+	{
+		for (i = 0; i < width * height; ++i)
+			device->background[i] = device->map[i] << MOTION_LEARN_SHIFT;
+
+		device->learned = 1;
+		device->learned_session = session;
+		return;
+	}
+
+	pthread_mutex_lock(&g_motion.mutex);
+	memcpy(zones, device->zones, sizeof(zones));
+	pthread_mutex_unlock(&g_motion.mutex);
+
+	foreground = INT32_MAX;
+
+	for (z = 0; z < MOTION_MAX_ZONE; ++z)
+	{
+		if (zones[z].enabled && zones[z].threshold < foreground)
+			foreground = zones[z].threshold;
+
+		x0[z] = zones[z].x * width / 100;
+		y0[z] = zones[z].y * height / 100;
+		x1[z] = (zones[z].x + zones[z].width) * width / 100;
+		y1[z] = (zones[z].y + zones[z].height) * height / 100;
+
+		if (x1[z] <= x0[z])
+			x1[z] = x0[z] + 1;
+		if (y1[z] <= y0[z])
+			y1[z] = y0[z] + 1;
+
+		changed[z] = 0;
+		blocks[z] = (x1[z] - x0[z]) * (y1[z] - y0[z]);
+	}
+
+	//a light switched on moves every block, only the change beyond it counts
+	total = 0;
+	for (i = 0; i < width * height; ++i)
+		total += (device->map[i] << MOTION_LEARN_SHIFT) - device->background[i];
+
+	shift = total / (width * height);
+
+	for (y = 0; y < height; ++y)
+	{
+		for (x = 0; x < width; ++x)
+		{
+			i = y * width + x;
+
+			diff = (device->map[i] << MOTION_LEARN_SHIFT) - device->background[i];
+			level = abs(diff - shift) >> MOTION_LEARN_SHIFT;
+
+			//something moving is learned slowly, it would leave a ghost behind
+			device->background[i] += diff >> (level > foreground
+				? MOTION_LEARN_SHIFT + MOTION_FOREGROUND_SHIFT : MOTION_LEARN_SHIFT);
+
+			diff = level;
+
+			for (z = 0; z < MOTION_MAX_ZONE; ++z)
+			{
+				if (zones[z].enabled && diff > zones[z].threshold
+					&& x >= x0[z] && x < x1[z] && y >= y0[z] && y < y1[z])
+				{
+					++changed[z];
+				}
+			}
+		}
+	}
+
+	pthread_mutex_lock(&g_motion.mutex);
+
+	for (z = 0; z < MOTION_MAX_ZONE && device->session == session; ++z)
+	{
+		if (!zones[z].enabled)
+			continue;
+
+		level = changed[z] * 100 / blocks[z];
+		motion_update_zone(device, index, z, level, now, gettickcount());
+	}
+
+	pthread_mutex_unlock(&g_motion.mutex);
+	return;
+
+__error:
+	pthread_mutex_lock(&g_motion.mutex);
+	++device->errors;
+	pthread_mutex_unlock(&g_motion.mutex);
+}
+
+static void * motion_thread(void *arg)
+{
+	motion_device_t *device;
+	char *buf;
+	int i, index, size, max;
+	unsigned int session;
+	time_t now;
+
+	pthread_mutex_lock(&g_motion.mutex);
+
+	while (g_motion.running)
+	{
+		//devices take turns, one busy camera cannot starve the others
+		index = -1;
+		for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+		{
+			if (g_motion.devices[(g_motion.next + i) % MAX_VIDEO_COUNT].pending_size > 0)
+			{
+				index = (g_motion.next + i) % MAX_VIDEO_COUNT;
+				break;
+			}
+		}
+
+		if (index == -1)
+		{
+			pthread_cond_wait(&g_motion.cond, &g_motion.mutex);
+			continue;
+		}
+
+		g_motion.next = index + 1;
+		device = &g_motion.devices[index];
+
+		//swap buffers, the capture side fills the other one meanwhile
+		buf = device->work;
+		max = device->work_max;
+		device->work = device->pending;
+		device->work_max = device->pending_max;
+		device->pending = buf;
+		device->pending_max = max;
+
+		size = device->pending_size;
+		now = device->pending_time;
+		session = device->session;
+		device->pending_size = 0;
+		++device->frames;
+
+		pthread_mutex_unlock(&g_motion.mutex);
+
+		motion_analyse(device, index, size, now, session);
+
+		pthread_mutex_lock(&g_motion.mutex);
+	}
+
+	pthread_mutex_unlock(&g_motion.mutex);
+
+	return NULL;
+}
+
+static int motion_start_thread()
+{
+	sigset_t mask, old_mask;
+	int ret;
+
+	if (g_motion.running)
+		return 0;
+
+	g_motion.running = 1;
+
+	//signals are consumed by the event loop thread only
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&g_motion.thread, NULL, motion_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0)
+	{
+		g_motion.running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void motion_on_video_read(const char *buf, int size, struct timeval *timestamp, v4l2port_t *video)
+{
+	motion_device_t *device;
+	unsigned long tick;
+	int index;
+
+	index = video->profile.value;
+	if (index < 0 || index >= MAX_VIDEO_COUNT)
+		return;
+
+	device = &g_motion.devices[index];
+	if (!device->enabled)
+		return;
+
+	video_manager_set_check_time(video);
+
+	tick = gettickcount();
+	if (tick - device->last_tick < MOTION_INTERVAL)
+		return;
+
+	device->last_tick = tick;
+
+	pthread_mutex_lock(&g_motion.mutex);
+
+	//the worker is behind, the newer frame replaces the waiting one
+	if (device->pending_size > 0)
+		++device->skipped;
+
+	if (device->pending_max < size)
+	{
+		device->pending_max = (size / 4096 + 1) * 4096;
+		device->pending = frealloc(device->pending, device->pending_max);
+	}
+
+	memcpy(device->pending, buf, size);
+	device->pending_size = size;
+	device->pending_time = time(NULL);
+
+	pthread_cond_signal(&g_motion.cond);
+	pthread_mutex_unlock(&g_motion.mutex);
+}
+
+int motion_enable(int index, int enable)
+{
+	int i;
+	motion_device_t *device;
+
+	if (index < 0 || index >= MAX_VIDEO_COUNT || video_manager_get(index) == NULL)
+		return -1;
+
+	device = &g_motion.devices[index];
+
+	if (!enable)
+	{
+		if (device->enabled)
+			LOGINFO("motion disable(device:%d)\n", index);
+
+		device->enabled = 0;
+
+		//open events end now, the next enable learns the scene again
+		pthread_mutex_lock(&g_motion.mutex);
+
+		++device->session;
+		device->pending_size = 0;
+
+		for (i = 0; i < MOTION_MAX_ZONE; ++i)
+		{
+			if (device->active[i])
+			{
+				device->active[i] = 0;
+				if (motion_find_event(device->event_id[i]))
+					motion_find_event(device->event_id[i])->end = time(NULL);
+			}
+
+			device->level[i] = 0;
+		}
+
+		pthread_mutex_unlock(&g_motion.mutex);
+
+		return 0;
+	}
+
+	if (motion_start_thread() == -1 || video_manager_stream_start(index) == -1)
+		return -1;
+
+	pthread_mutex_lock(&g_motion.mutex);
+
+	//the whole frame until zones are configured
+	if (!device->zones[0].enabled && !device->zones[1].enabled
+		&& !device->zones[2].enabled && !device->zones[3].enabled)
+	{
+		device->zones[0].enabled = 1;
+		device->zones[0].width = 100;
+		device->zones[0].height = 100;
+		device->zones[0].threshold = MOTION_DEFAULT_THRESHOLD;
+		device->zones[0].area = MOTION_DEFAULT_AREA;
+	}
+
+	pthread_mutex_unlock(&g_motion.mutex);
+
+	if (!device->enabled)
+		LOGINFO("motion enable(device:%d)\n", index);
+
+	device->enabled = 1;
+
+	return 0;
+}
+
+int motion_set_zone(int index, int zone, const motion_zone_t *config)
+{
+	motion_device_t *device;
+
+	if (index < 0 || index >= MAX_VIDEO_COUNT || zone < 0 || zone >= MOTION_MAX_ZONE
+		|| config->x < 0 || config->y < 0 || config->width <= 0 || config->height <= 0
+		|| config->x + config->width > 100 || config->y + config->height > 100
+		|| config->threshold <= 0 || config->area <= 0 || config->area > 100)
+	{
+		return -1;
+	}
+
+	device = &g_motion.devices[index];
+
+	pthread_mutex_lock(&g_motion.mutex);
+
+	memcpy(&device->zones[zone], config, sizeof(motion_zone_t));
+
+	if (!config->enabled && device->active[zone])
+	{
+		device->active[zone] = 0;
+		if (motion_find_event(device->event_id[zone]))
+			motion_find_event(device->event_id[zone])->end = time(NULL);
+	}
+
+	device->level[zone] = 0;
+
+	pthread_mutex_unlock(&g_motion.mutex);
+
+	return 0;
+}
+
+int motion_get_zone(int index, int zone, motion_zone_t *config)
+{
+	if (index < 0 || index >= MAX_VIDEO_COUNT || zone < 0 || zone >= MOTION_MAX_ZONE)
+		return -1;
+
+	pthread_mutex_lock(&g_motion.mutex);
+	memcpy(config, &g_motion.devices[index].zones[zone], sizeof(motion_zone_t));
+	pthread_mutex_unlock(&g_motion.mutex);
+
+	return 0;
+}
+
+int motion_get_stat(int index, motion_stat_t *stat)
+{
+	motion_device_t *device;
+
+	if (index < 0 || index >= MAX_VIDEO_COUNT)
+		return -1;
+
+	device = &g_motion.devices[index];
+
+	pthread_mutex_lock(&g_motion.mutex);
+
+	stat->enabled = device->enabled;
+	stat->width = device->width;
+	stat->height = device->height;
+	stat->frames = device->frames;
+	stat->skipped = device->skipped;
+	stat->errors = device->errors;
+	stat->events = device->events;
+	memcpy(stat->level, device->level, sizeof(stat->level));
+	memcpy(stat->active, device->active, sizeof(stat->active));
+
+	pthread_mutex_unlock(&g_motion.mutex);
+
+	return 0;
+}
+
+//events newer than after, oldest first
+int motion_get_events(unsigned int after, motion_event_t *events, int max)
+{
+	unsigned int id, first;
+	int count;
+
+	count = 0;
+
+	pthread_mutex_lock(&g_motion.mutex);
+
+	first = g_motion.event_id > MOTION_MAX_EVENT ? g_motion.event_id - MOTION_MAX_EVENT + 1 : 1;
+	if (after + 1 > first)
+		first = after + 1;
+
+	for (id = first; id <= g_motion.event_id && count < max; ++id)
+		memcpy(&events[count++], &g_motion.events[id % MOTION_MAX_EVENT], sizeof(motion_event_t));
+
+	pthread_mutex_unlock(&g_motion.mutex);
+
+	return count;
+}
+
+void motion_resume()
+{
+	int i;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		if (g_motion.devices[i].enabled)
+			video_manager_stream_start(i);
+	}
+}
+
+void motion_cleanup()
+{
+	motion_device_t *device;
+	int i;
+
+	if (!g_motion.running)
+		return;
+
+	pthread_mutex_lock(&g_motion.mutex);
+	g_motion.running = 0;
+	pthread_cond_signal(&g_motion.cond);
+	pthread_mutex_unlock(&g_motion.mutex);
+
+	pthread_join(g_motion.thread, NULL);
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		device = &g_motion.devices[i];
+
+		free(device->pending);
+		free(device->work);
+		free(device->map);
+		free(device->background);
+
+		memset(device, 0, sizeof(motion_device_t));
+	}
+}
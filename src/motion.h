@@ -0,0 +1,73 @@
+#ifndef MOTION_H_
+#define MOTION_H_
+
+
+#include <time.h>
+#include <sys/time.h>
+
+
+#define MOTION_MAX_ZONE				4
+#define MOTION_MAX_EVENT			32
+#define MOTION_INTERVAL				200		//ms between analysed frames
+#define MOTION_HOLD					2000	//ms without motion before an event ends
+#define MOTION_LEARN_SHIFT			4		//background follows each frame by 1/16
+#define MOTION_DEFAULT_THRESHOLD	12		//luma change of a block
+#define MOTION_DEFAULT_AREA			2		//percent of the zone blocks
+
+
+typedef struct _motion_zone
+{
+	int enabled;
+	int x;			//percent of the frame
+	int y;
+	int width;
+	int height;
+	int threshold;
+	int area;
+} motion_zone_t;
+
+typedef struct _motion_event
+{
+	unsigned int id;
+	int index;
+	int zone;
+	time_t start;
+	time_t end;		//0 while the motion goes on
+	int peak;		//most of the zone changed, percent
+} motion_event_t;
+
+typedef struct _motion_stat
+{
+	int enabled;
+	int width;		//block map
+	int height;
+	unsigned int frames;
+	unsigned int skipped;
+	unsigned int errors;
+	unsigned int events;
+	int level[MOTION_MAX_ZONE];
+	int active[MOTION_MAX_ZONE];
+} motion_stat_t;
+
+
+typedef struct _v4l2port v4l2port_t;
+
+
+void motion_on_video_read(const char *buf,
+	int size, struct timeval *timestamp, v4l2port_t *video);
+
+int motion_enable(int index, int enable);
+
+int motion_set_zone(int index, int zone, const motion_zone_t *config);
+
+int motion_get_zone(int index, int zone, motion_zone_t *config);
+
+int motion_get_stat(int index, motion_stat_t *stat);
+
+int motion_get_events(unsigned int after, motion_event_t *events, int max);
+
+void motion_resume();
+
+void motion_cleanup();
+
+#endif
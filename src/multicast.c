@@ -0,0 +1,202 @@
+#include "multicast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "video_manager.h"
+#include "v4l2port.h"
+#include "jpeg.h"
+#include "rtpjpeg.h"
+
+
+typedef struct _multicast_output
+{
+	int fd;
+	struct sockaddr_in addr;
+	rtpjpeg_t rtp;
+	multicast_stat_t stat;
+	unsigned int unsupported;
+} multicast_output_t;
+
+
+static multicast_output_t *g_outputs[MAX_VIDEO_COUNT];
+
+
+static void multicast_output_free(multicast_output_t *output)
+{
+	close(output->fd);
+	rtpjpeg_uninit(&output->rtp);
+	free(output);
+}
+
+void multicast_on_video_read(const char *buf, int size, struct timeval *timestamp, v4l2port_t *video)
+{
+	multicast_output_t *output;
+	jpeg_frame_t frame;
+	int index, sent;
+
+	index = video->profile.value;
+	if (index < 0 || index >= MAX_VIDEO_COUNT || g_outputs[index] == NULL)
+		return;
+
+	output = g_outputs[index];
+
+	video_manager_set_check_time(video);
+
+	if (jpeg_parse(buf, size, &frame) == -1
+		|| rtpjpeg_packetize(&output->rtp, &frame, rtpjpeg_timestamp(timestamp)) == -1)
+	{
+		if (output->unsupported++ == 0)
+			LOGWARN("multicast cannot packetize frame(device:%d)\n", index);
+		return;
+	}
+
+	//one copy per frame whatever the number of receivers
+	sent = rtpjpeg_send(output->fd, &output->addr, &output->rtp);
+	if (sent < 0)
+		sent = 0;
+
+	output->stat.packets += sent;
+
+	if (sent < output->rtp.count)
+		++output->stat.dropped;
+	else
+		++output->stat.frames;
+}
+
+int multicast_start(int index, const char *group, unsigned short port, int ttl)
+{
+	multicast_output_t *output;
+	struct in_addr addr;
+	unsigned char value;
+	int size;
+
+	if (video_manager_get(index) == NULL)
+		return -1;
+
+	if (inet_aton(group, &addr) == 0 || !IN_MULTICAST(ntohl(addr.s_addr)))
+	{
+		LOGWARN("not a multicast group:%s\n", group);
+		return -1;
+	}
+
+	if (port == 0 || ttl < 0 || ttl > 255)
+		return -1;
+
+	output = fcalloc(1, sizeof(multicast_output_t));
+
+	output->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (output->fd == -1)
+	{
+		LOGERROR("create multicast socket error\n");
+		free(output);
+		return -1;
+	}
+
+	value = ttl;
+	setsockopt(output->fd, IPPROTO_IP, IP_MULTICAST_TTL, &value, sizeof(value));
+
+	//a whole frame goes out in one burst
+	size = MULTICAST_SEND_BUFFER;
+	setsockopt(output->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	output->addr.sin_family = AF_INET;
+	output->addr.sin_addr = addr;
+	output->addr.sin_port = htons(port);
+
+	rtpjpeg_init(&output->rtp, (unsigned int)rand());
+
+	strncpy(output->stat.group, inet_ntoa(addr), sizeof(output->stat.group) - 1);
+	output->stat.port = port;
+	output->stat.ttl = ttl;
+
+	if (video_manager_stream_start(index) == -1)
+	{
+		multicast_output_free(output);
+		return -1;
+	}
+
+	multicast_stop(index);
+	g_outputs[index] = output;
+
+	LOGINFO("multicast start(device:%d %s:%u ttl:%d)\n",
+		index, output->stat.group, port, ttl);
+
+	return 0;
+}
+
+int multicast_stop(int index)
+{
+	if (index < 0 || index >= MAX_VIDEO_COUNT || g_outputs[index] == NULL)
+		return -1;
+
+	LOGINFO("multicast stop(device:%d %s:%u)\n",
+		index, g_outputs[index]->stat.group, g_outputs[index]->stat.port);
+
+	multicast_output_free(g_outputs[index]);
+	g_outputs[index] = NULL;
+
+	return 0;
+}
+
+int multicast_get_stat(int index, multicast_stat_t *stat)
+{
+	if (index < 0 || index >= MAX_VIDEO_COUNT || g_outputs[index] == NULL)
+		return -1;
+
+	memcpy(stat, &g_outputs[index]->stat, sizeof(multicast_stat_t));
+
+	return 0;
+}
+
+//session description a player opens to join the group
+int multicast_describe(int index, char *buf, int size)
+{
+	multicast_output_t *output;
+	v4l2port_t *video;
+
+	video = video_manager_get(index);
+	if (video == NULL || g_outputs[index] == NULL)
+		return -1;
+
+	output = g_outputs[index];
+
+	return snprintf(buf, size,
+		"v=0\r\n"
+		"o=- %u 1 IN IP4 %s\r\n"
+		"s=camlite device %d\r\n"
+		"c=IN IP4 %s/%d\r\n"
+		"t=0 0\r\n"
+		"m=video %u RTP/AVP %d\r\n"
+		"a=rtpmap:%d JPEG/%d\r\n"
+		"a=framerate:%d\r\n",
+		output->rtp.ssrc, output->stat.group,
+		index,
+		output->stat.group, output->stat.ttl,
+		output->stat.port, RTPJPEG_PAYLOAD_TYPE,
+		RTPJPEG_PAYLOAD_TYPE, RTPJPEG_CLOCK_RATE,
+		video->profile.fps);
+}
+
+void multicast_resume()
+{
+	int i;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		if (g_outputs[i] && video_manager_stream_start(i) == -1)
+			multicast_stop(i);
+	}
+}
+
+void multicast_cleanup()
+{
+	int i;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+		multicast_stop(i);
+}
@@ -0,0 +1,42 @@
+#ifndef MULTICAST_H_
+#define MULTICAST_H_
+
+
+#include <sys/time.h>
+
+
+#define MULTICAST_DEFAULT_PORT	5004
+#define MULTICAST_DEFAULT_TTL	1
+#define MULTICAST_SEND_BUFFER	(2 * 1024 * 1024)
+
+
+typedef struct _v4l2port v4l2port_t;
+
+typedef struct _multicast_stat
+{
+	char group[16];
+	unsigned short port;
+	int ttl;
+
+	unsigned int frames;
+	unsigned int packets;
+	unsigned int dropped;
+} multicast_stat_t;
+
+
+void multicast_on_video_read(const char *buf,
+	int size, struct timeval *timestamp, v4l2port_t *video);
+
+int multicast_start(int index, const char *group, unsigned short port, int ttl);
+
+int multicast_stop(int index);
+
+int multicast_get_stat(int index, multicast_stat_t *stat);
+
+int multicast_describe(int index, char *buf, int size);
+
+void multicast_resume();
+
+void multicast_cleanup();
+
+#endif
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "util.h"
 
 #define TEST_MAX_READ_WRITE_ONCE		size
@@ -27,6 +28,16 @@ pevent_t * pevent_t_alloc(pevent_base_t *base, int fd)
 
 void pevent_t_free(pevent_t *pevent)
 {
+	//later events of the current epoll batch may still point here
+	if (pevent->base->dispatching)
+	{
+		pevent->event_callback = NULL;
+		pevent->ptr = NULL;
+		pevent->next_garbage = pevent->base->garbage;
+		pevent->base->garbage = pevent;
+		return;
+	}
+
 	free(pevent);
 }
 
@@ -45,80 +56,70 @@ pevent_t * pevent_new(pevent_base_t *base,
 }
 
 
+//state is a mask of PEVENT_READ and PEVENT_WRITE, nothing is done while
+//it does not change
 int pevent_set(pevent_t *pevent, int state)
 {
 	if (pevent->state == state)
 	{
-		return -1;
+		return 0;
 	}
 
 	return pevent_signal(pevent, state);
 }
 
+//always goes to epoll, re-arming an unchanged edge triggered event has it
+//reported again while it is ready
 int pevent_signal(pevent_t *pevent, int state)
 {
 	int mode;
+	int epoll_fd;
 	struct epoll_event event;
 
-	mode = pevent->state == 0
-		? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	epoll_fd = pevent_base_get_epoll(pevent->base, pevent->priority);
+	if (epoll_fd == -1)
+		return -1;
 
-	if (state == PEVENT_WRITE)
-	{
-		event.data.ptr = pevent;
-		event.events = EPOLLOUT | EPOLLET;
+	event.data.ptr = pevent;
 
-		if (epoll_ctl(pevent->base->epoll_fd, mode, pevent->fd, &event) == -1)
-		{
-			LOGERROR("epoll_ctl(epoll_fd:%d fd:%d)\n",
-				pevent->base->epoll_fd, pevent->fd);
-			return -1;
-		}
-
-		pevent->state = PEVENT_WRITE;
-	}
-	else if (state == PEVENT_READ)
+	if (state == 0)
 	{
-		event.data.ptr = pevent;
-		event.events = EPOLLIN | EPOLLET;
-
-		if (epoll_ctl(pevent->base->epoll_fd, mode, pevent->fd, &event) == -1)
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pevent->fd, &event) == -1)
 		{
 			LOGERROR("epoll_ctl (epoll_fd:%d fd:%d)\n",
-				pevent->base->epoll_fd, pevent->fd);
-			return -1;
+				epoll_fd, pevent->fd);
 		}
 
-		pevent->state = PEVENT_READ;
+		pevent->state = 0;
+		return 0;
 	}
-	else if (state == 0)
-	{
-		event.data.ptr = pevent;
-		if (epoll_ctl(pevent->base->epoll_fd, EPOLL_CTL_DEL, pevent->fd, &event) == -1)
-		{
-			LOGERROR("epoll_ctl (epoll_fd:%d fd:%d)\n",
-				pevent->base->epoll_fd, pevent->fd);
-		}
 
-		pevent->state = 0;
+	mode = pevent->state == 0
+		? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+	//a peer closing is seen while only writing to it
+	event.events = EPOLLET | EPOLLRDHUP;
+	if (state & PEVENT_READ)
+		event.events |= EPOLLIN;
+	if (state & PEVENT_WRITE)
+		event.events |= EPOLLOUT;
+
+	if (epoll_ctl(epoll_fd, mode, pevent->fd, &event) == -1)
+	{
+		LOGERROR("epoll_ctl(epoll_fd:%d fd:%d)\n",
+			epoll_fd, pevent->fd);
+		return -1;
 	}
-	
+
+	pevent->state = state;
+
 	return 0;
 }
 
 void pevent_free(pevent_t *pevent)
 {
-	struct epoll_event event;
-
 	if (pevent->state != 0)
-	{
-		event.data.ptr = pevent;
-		if (epoll_ctl(pevent->base->epoll_fd, EPOLL_CTL_DEL, pevent->fd, &event) == -1)
-		{
-			LOGERROR("epoll_ctl (epoll_fd:%d fd:%d)\n",
-				pevent->base->epoll_fd, pevent->fd);
-		}
-	}
+		pevent_signal(pevent, 0);
 
 	close(pevent->fd);
 	pevent_t_free(pevent);
@@ -126,17 +127,8 @@ void pevent_free(pevent_t *pevent)
 
 void pevent_free_no_close(pevent_t *pevent)
 {
-	struct epoll_event event;
-
 	if (pevent->state != 0)
-	{
-		event.data.ptr = pevent;
-		if (epoll_ctl(pevent->base->epoll_fd, EPOLL_CTL_DEL, pevent->fd, &event) == -1)
-		{
-			LOGERROR("epoll_ctl (epoll_fd:%d fd:%d)\n",
-				pevent->base->epoll_fd, pevent->fd);
-		}
-	}
+		pevent_signal(pevent, 0);
 
 	pevent_t_free(pevent);
 }
@@ -189,6 +181,30 @@ int pevent_write(pevent_t *pevent, const char *buf, int size)
 	}
 }
 
+int pevent_writev(pevent_t *pevent, const struct iovec *iov, int count)
+{
+	int ret;
+		
+	
+	ret = writev(pevent->fd, iov, count);
+
+	if (ret < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		return -1;
+	}
+	else if (ret == 0)
+	{
+		return -1;
+	}
+	else
+	{
+		return ret;
+	}
+}
+
 int pevent_get_flag(pevent_t *pevent)
 {
 	return pevent->state;
@@ -202,4 +218,26 @@ int pevent_get_fd(pevent_t *pevent)
 pevent_base_t * pevent_get_base(pevent_t *pevent)
 {
 	return pevent->base;
+}
+
+void pevent_set_ptr(pevent_t *pevent, void *ptr)
+{
+	pevent->ptr = ptr;
+}
+
+//a registered event moves over to the set of its new priority
+int pevent_set_priority(pevent_t *pevent, int priority)
+{
+	int state;
+
+	if (pevent->priority == priority)
+		return 0;
+
+	state = pevent->state;
+	if (state != 0)
+		pevent_signal(pevent, 0);
+
+	pevent->priority = priority;
+
+	return state != 0 ? pevent_signal(pevent, state) : 0;
 }
\ No newline at end of file
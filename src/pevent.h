@@ -4,10 +4,14 @@
 typedef struct _pevent pevent_t;
 typedef struct _pevent_base pevent_base_t;
 
+struct iovec;
+
 #define PEVENT_READ		1
 #define PEVENT_WRITE	2
-#define PEVENT_ERROR	3
+#define PEVENT_ERROR	4	//only ever passed to the callback
 
+#define PEVENT_PRIORITY_NORMAL	0
+#define PEVENT_PRIORITY_HIGH	1	//capture and timers, dispatched ahead of the sockets
 
 
 
@@ -29,6 +33,8 @@ int pevent_read(pevent_t *pevent, char *buf, int size);
 
 int pevent_write(pevent_t *pevent, const char *buf, int size);
 
+int pevent_writev(pevent_t *pevent, const struct iovec *iov, int count);
+
 
 int pevent_get_flag(pevent_t *pevent);
 
@@ -38,6 +44,8 @@ int pevent_get_fd(pevent_t *pevent);
 
 void pevent_set_ptr(pevent_t *pevent, void *ptr);
 
+int pevent_set_priority(pevent_t *pevent, int priority);
+
 
 
 #endif
\ No newline at end of file
@@ -23,45 +23,110 @@ pevent_base_t * pevent_base_create()
 		return NULL;
 	}
 
+	base->high_fd = -1;
+
 	return base;
 }
 
-int pevent_base_loop(pevent_base_t *base, int timeout)
+//the set a pevent of the priority is registered in
+int pevent_base_get_epoll(pevent_base_t *base, int priority)
+{
+	int fd;
+	struct epoll_event event;
+
+	if (priority == PEVENT_PRIORITY_NORMAL)
+		return base->epoll_fd;
+
+	if (base->high_fd >= 0)
+		return base->high_fd;
+
+	fd = epoll_create1(0);
+	if (fd == -1)
+	{
+		LOGERROR("epoll_create error:%s\n", strerror(errno));
+		return -1;
+	}
+
+	//wakes the loop, the events themselves are read from the nested set
+	event.data.ptr = NULL;
+	event.events = EPOLLIN;
+
+	if (epoll_ctl(base->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+	{
+		LOGERROR("epoll_ctl(epoll_fd:%d fd:%d)\n", base->epoll_fd, fd);
+		close(fd);
+		return -1;
+	}
+
+	base->high_fd = fd;
+
+	return fd;
+}
+
+static void pevent_base_dispatch(struct epoll_event *events, int nfds)
 {
 	int i;
+	pevent_t *pevent;
+
+	for (i = 0; i < nfds; i++)
+	{
+		pevent = (pevent_t *)events[i].data.ptr;
+
+		if (pevent == NULL || pevent->event_callback == NULL)
+			continue;
+
+		if (events[i].events & EPOLLERR || events[i].events & EPOLLHUP)
+		{
+			pevent->event_callback(pevent, PEVENT_ERROR, pevent->ptr);
+			continue;
+		}
+
+		//a close is read first, a freed event has no callback for the write
+		if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+			pevent->event_callback(pevent, PEVENT_READ, pevent->ptr);
+
+		if (events[i].events & EPOLLOUT && pevent->event_callback)
+			pevent->event_callback(pevent, PEVENT_WRITE, pevent->ptr);
+	}
+}
+
+int pevent_base_loop(pevent_base_t *base, int timeout)
+{
 	int nfds;
+	int nhigh;
 	pevent_t *pevent;
 	
 	nfds = epoll_wait(base->epoll_fd, base->events, MAX_EPOLL_EVENTS, timeout);
-	
-    for(i = 0; i < nfds && nfds > 0; i++)
+
+	base->dispatching = 1;
+
+	//whatever woke the loop, capture and timers ready now go before the
+	//sockets, even when the batch of epoll_fd did not have room for them
+	if (nfds > 0 && base->high_fd >= 0)
 	{
-		pevent = (pevent_t *)base->events[i].data.ptr;
+		nhigh = epoll_wait(base->high_fd, base->high_events, MAX_EPOLL_EVENTS, 0);
+		pevent_base_dispatch(base->high_events, nhigh);
+	}
 
-		if (pevent && pevent->event_callback)
-		{
-			if (base->events[i].events & EPOLLERR || base->events[i].events & EPOLLHUP)
-			{
-				pevent->event_callback(pevent, PEVENT_ERROR, pevent->ptr);
-			}
-			else if (base->events[i].events & EPOLLIN)
-			{
-				pevent->event_callback(pevent, PEVENT_READ, pevent->ptr);
-					
-			}
-			else if (base->events[i].events & EPOLLOUT)
-			{
-				pevent->event_callback(pevent, PEVENT_WRITE, pevent->ptr);
-			}
-		}
+	pevent_base_dispatch(base->events, nfds);
 
-    }
+	base->dispatching = 0;
+
+	while (base->garbage)
+	{
+		pevent = base->garbage;
+		base->garbage = pevent->next_garbage;
+		free(pevent);
+	}
 
 	return nfds;
 }
 
 void pevent_base_cleanup(pevent_base_t *base)
 {
+	if (base->high_fd >= 0)
+		close(base->high_fd);
+
 	close(base->epoll_fd);
 	free(base);
 }
@@ -9,6 +9,15 @@ struct _pevent_base
 {
 	int epoll_fd;
 	struct epoll_event events[MAX_EPOLL_EVENTS];
+
+	//high priority events live in their own set, nested in epoll_fd,
+	//and are collected first on every wakeup. -1 until one is set
+	int high_fd;
+	struct epoll_event high_events[MAX_EPOLL_EVENTS];
+
+	//events freed by a callback, released once the batch is dispatched
+	int dispatching;
+	struct _pevent *garbage;
 };
 
 struct _pevent
@@ -16,12 +25,16 @@ struct _pevent
 	int fd;
 	int state;
 	int pending;
+	int priority;
 	struct _pevent_base *base;
 	void *ptr;
 	pevent_callback event_callback;
+
+	struct _pevent *next_garbage;
 };
 
 
+int pevent_base_get_epoll(pevent_base_t *base, int priority);
 
 
 #endif
\ No newline at end of file
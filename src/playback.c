@@ -0,0 +1,187 @@
+#include "playback.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "recorder.h"
+
+#define PLAYBACK_MAX_PATH		320
+
+
+static void playback_unmap(playback_cursor_t *cursor)
+{
+	if (cursor->records)
+		munmap((void *)cursor->records, cursor->map_size);
+
+	cursor->records = NULL;
+	cursor->count = 0;
+	cursor->map_size = 0;
+}
+
+//segments only ever grow while they are written, a recycled segment gets a
+//new index file so an old mapping stays readable
+static int playback_map(playback_cursor_t *cursor)
+{
+	struct stat st;
+	void *map;
+	int count;
+
+	if (fstat(cursor->index_fd, &st) == -1)
+		return -1;
+
+	count = st.st_size / sizeof(recorder_index_t);
+	if (count <= cursor->count)
+		return -1;
+
+	map = mmap(NULL, count * sizeof(recorder_index_t), PROT_READ, MAP_SHARED, cursor->index_fd, 0);
+	if (map == MAP_FAILED)
+	{
+		LOGERROR("mmap index error:%s\n", strerror(errno));
+		return -1;
+	}
+
+	playback_unmap(cursor);
+
+	cursor->records = map;
+	cursor->count = count;
+	cursor->map_size = count * sizeof(recorder_index_t);
+	cursor->ino = st.st_ino;
+
+	return 0;
+}
+
+static int playback_open(playback_cursor_t *cursor, int slot)
+{
+	char path[PLAYBACK_MAX_PATH];
+	int index;
+
+	index = cursor->index;
+	playback_close(cursor);
+	cursor->index = index;
+	cursor->slot = slot;
+
+	snprintf(path, sizeof(path), RECORDER_INDEX_FORMAT, recorder_get_dir(), index, slot);
+	cursor->index_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (cursor->index_fd == -1)
+		return -1;
+
+	snprintf(path, sizeof(path), RECORDER_DATA_FORMAT, recorder_get_dir(), index, slot);
+	cursor->data_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (cursor->data_fd == -1 || playback_map(cursor) == -1)
+	{
+		playback_close(cursor);
+		return -1;
+	}
+
+	return 0;
+}
+
+//the frame showing at timestamp_us, or the next one recorded after a gap
+int playback_seek(playback_cursor_t *cursor, int index, uint64_t timestamp_us)
+{
+	int slot;
+	int low, high, mid;
+
+	memset(cursor, 0, sizeof(playback_cursor_t));
+	cursor->index = index;
+	cursor->index_fd = -1;
+	cursor->data_fd = -1;
+
+	if (recorder_get_dir() == NULL)
+		return -1;
+
+	//the recorder keeps the segments sorted, only the one found is opened
+	slot = recorder_find_segment(index, timestamp_us);
+	if (slot == -1 || playback_open(cursor, slot) == -1)
+		return -1;
+
+	if (cursor->records[0].timestamp_us > timestamp_us)
+		return 0;
+
+	low = 0;
+	high = cursor->count - 1;
+	while (low < high)
+	{
+		mid = (low + high + 1) / 2;
+
+		if (cursor->records[mid].timestamp_us <= timestamp_us)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	cursor->pos = low;
+
+	if (timestamp_us - cursor->records[low].timestamp_us > PLAYBACK_MAX_GAP * 1000000ULL)
+		return playback_next(cursor);
+
+	return 0;
+}
+
+const recorder_index_t * playback_frame(playback_cursor_t *cursor)
+{
+	if (cursor->records == NULL || cursor->pos >= cursor->count)
+		return NULL;
+
+	return &cursor->records[cursor->pos];
+}
+
+int playback_next(playback_cursor_t *cursor)
+{
+	uint64_t last, first;
+	int slot;
+
+	if (cursor->records == NULL)
+		return -1;
+
+	if (cursor->pos + 1 < cursor->count
+		|| playback_map(cursor) == 0)
+	{
+		++cursor->pos;
+		return 0;
+	}
+
+	//the recorder always continues in the following slot
+	last = cursor->records[cursor->pos].timestamp_us;
+	slot = (cursor->slot + 1) % RECORDER_SEGMENT_COUNT;
+
+	first = recorder_get_segment(cursor->index, slot);
+	if (first <= last)
+		return -1;
+
+	return playback_open(cursor, slot);
+}
+
+//false once the recorder reused the slot, the data is overwritten then
+int playback_valid(playback_cursor_t *cursor)
+{
+	char path[PLAYBACK_MAX_PATH];
+	struct stat st;
+
+	if (cursor->records == NULL)
+		return 0;
+
+	snprintf(path, sizeof(path), RECORDER_INDEX_FORMAT, recorder_get_dir(), cursor->index, cursor->slot);
+
+	return stat(path, &st) == 0 && st.st_ino == cursor->ino;
+}
+
+void playback_close(playback_cursor_t *cursor)
+{
+	playback_unmap(cursor);
+
+	if (cursor->index_fd >= 0)
+		close(cursor->index_fd);
+
+	if (cursor->data_fd >= 0)
+		close(cursor->data_fd);
+
+	cursor->index_fd = -1;
+	cursor->data_fd = -1;
+	cursor->pos = 0;
+}
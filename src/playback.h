@@ -0,0 +1,42 @@
+#ifndef PLAYBACK_H_
+#define PLAYBACK_H_
+
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "recorder.h"
+
+
+#define PLAYBACK_MAX_GAP		5			//seconds a frame stands for when seeking
+#define PLAYBACK_MAX_SPEED		64
+
+
+//position in the recording of one device, the index of the current
+//segment is mapped, the frames are read from data_fd
+typedef struct _playback_cursor
+{
+	int index;
+	int slot;
+	int index_fd;
+	int data_fd;
+	ino_t ino;
+
+	const recorder_index_t *records;
+	int count;
+	size_t map_size;
+
+	int pos;
+} playback_cursor_t;
+
+
+int playback_seek(playback_cursor_t *cursor, int index, uint64_t timestamp_us);
+
+const recorder_index_t * playback_frame(playback_cursor_t *cursor);
+
+int playback_next(playback_cursor_t *cursor);
+
+int playback_valid(playback_cursor_t *cursor);
+
+void playback_close(playback_cursor_t *cursor);
+
+#endif
@@ -0,0 +1,653 @@
+#include "recorder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "util.h"
+#include "video_manager.h"
+#include "v4l2port.h"
+
+#define RECORDER_MAX_DIR		256
+#define RECORDER_MAX_PATH		(RECORDER_MAX_DIR + 64)
+
+
+typedef struct _recorder_frame
+{
+	struct _recorder_frame *next;
+	int index;		//device
+	int size;		//0 closes the segment of the device
+	uint64_t timestamp_us;
+	char data[];
+} recorder_frame_t;
+
+//only touched by the writer thread
+typedef struct _recorder_segment
+{
+	int slot;
+	int data_fd;
+	int index_fd;
+	uint64_t offset;
+	uint64_t start_us;
+	off_t index_size;	//whole records on disk
+
+	int pending;
+	struct iovec iovs[RECORDER_BATCH];
+	recorder_index_t records[RECORDER_BATCH];
+} recorder_segment_t;
+
+//segments on disk sorted by their first frame, kept by the writer thread
+//under the mutex so a seek needs no file access
+typedef struct _recorder_directory
+{
+	uint64_t first_us[RECORDER_SEGMENT_COUNT];	//per slot, 0 holds no frames
+	int order[RECORDER_SEGMENT_COUNT];			//slots, oldest first
+	int count;
+} recorder_directory_t;
+
+typedef struct _recorder_device
+{
+	volatile int recording;
+	volatile int slot;
+	volatile unsigned int frames;
+	volatile unsigned int dropped;
+	volatile unsigned int segments;
+	volatile unsigned long long bytes;
+
+	recorder_segment_t segment;
+	recorder_directory_t directory;
+} recorder_device_t;
+
+typedef struct _recorder_manage
+{
+	char dir[RECORDER_MAX_DIR];
+
+	recorder_device_t devices[MAX_VIDEO_COUNT];
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+
+	recorder_frame_t *head;
+	recorder_frame_t *tail;
+	int queued;
+} recorder_manage_t;
+
+
+static recorder_manage_t g_recorder;
+
+
+static void recorder_directory_remove(recorder_directory_t *directory, int slot)
+{
+	int i;
+
+	if (directory->first_us[slot] == 0)
+		return;
+
+	for (i = 0; directory->order[i] != slot; ++i);
+
+	memmove(&directory->order[i], &directory->order[i + 1],
+		(directory->count - i - 1) * sizeof(int));
+
+	--directory->count;
+	directory->first_us[slot] = 0;
+}
+
+//a new segment is the newest, the scan from the end stops at once
+static void recorder_directory_add(recorder_directory_t *directory, int slot, uint64_t first_us)
+{
+	int i;
+
+	recorder_directory_remove(directory, slot);
+
+	for (i = directory->count; i > 0
+		&& directory->first_us[directory->order[i - 1]] > first_us; --i)
+	{
+		directory->order[i] = directory->order[i - 1];
+	}
+
+	directory->order[i] = slot;
+	directory->first_us[slot] = first_us;
+	++directory->count;
+}
+
+//read once at start, from then on the writer keeps it current
+static void recorder_directory_load(int index)
+{
+	char path[RECORDER_MAX_PATH];
+	recorder_index_t record;
+	recorder_directory_t *directory;
+	int slot, fd;
+
+	directory = &g_recorder.devices[index].directory;
+	memset(directory, 0, sizeof(recorder_directory_t));
+
+	for (slot = 0; slot < RECORDER_SEGMENT_COUNT; ++slot)
+	{
+		snprintf(path, sizeof(path), RECORDER_INDEX_FORMAT, g_recorder.dir, index, slot);
+
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+
+		if (read(fd, &record, sizeof(record)) == sizeof(record)
+			&& record.timestamp_us > 0)
+		{
+			recorder_directory_add(directory, slot, record.timestamp_us);
+		}
+
+		close(fd);
+	}
+}
+
+//the slot after the newest segment on disk, so a restart keeps the history
+static int recorder_first_slot(int index)
+{
+	recorder_directory_t *directory;
+	int first;
+
+	directory = &g_recorder.devices[index].directory;
+
+	pthread_mutex_lock(&g_recorder.mutex);
+	first = directory->count > 0
+		? (directory->order[directory->count - 1] + 1) % RECORDER_SEGMENT_COUNT
+		: 0;
+	pthread_mutex_unlock(&g_recorder.mutex);
+
+	return first;
+}
+
+static void recorder_segment_flush(recorder_device_t *device)
+{
+	recorder_segment_t *segment;
+	int i, ret, size, written, partial;
+
+	segment = &device->segment;
+	if (segment->pending == 0)
+		return;
+
+	size = 0;
+	for (i = 0; i < segment->pending; ++i)
+		size += segment->iovs[i].iov_len;
+
+	//frames first, an index record never points at unwritten data
+	written = 0;
+	partial = 0;
+	ret = pwritev(segment->data_fd, segment->iovs, segment->pending, segment->records[0].offset);
+	if (ret == size)
+	{
+		ret = write(segment->index_fd, segment->records, segment->pending * sizeof(recorder_index_t));
+		if (ret > 0)
+		{
+			written = ret / sizeof(recorder_index_t);
+			partial = ret % sizeof(recorder_index_t);
+		}
+	}
+
+	if (written > 0)
+	{
+		for (i = 0, size = 0; i < written; ++i)
+			size += segment->iovs[i].iov_len;
+
+		device->frames += written;
+		device->bytes += size;
+
+		//readers find the segment once its first record is on disk
+		if (segment->records[0].offset == 0)
+		{
+			pthread_mutex_lock(&g_recorder.mutex);
+			recorder_directory_add(&device->directory, segment->slot, segment->records[0].timestamp_us);
+			pthread_mutex_unlock(&g_recorder.mutex);
+		}
+	}
+
+	segment->index_size += written * sizeof(recorder_index_t);
+
+	if (written < segment->pending)
+	{
+		LOGERROR("record write error:%s\n", ret == -1 ? strerror(errno) : "short write");
+		device->dropped += segment->pending - written;
+		segment->offset = segment->records[written].offset;
+
+		//a piece of a record would shift every later one, cut it off. a
+		//reader maps whole records only, none of them goes away
+		if (partial && ftruncate(segment->index_fd, segment->index_size) == -1)
+		{
+			LOGERROR("record index truncate error:%s\n", strerror(errno));
+
+			//the next frame starts a new segment
+			close(segment->data_fd);
+			close(segment->index_fd);
+			segment->data_fd = -1;
+			segment->index_fd = -1;
+		}
+	}
+
+	segment->pending = 0;
+}
+
+static void recorder_segment_close(recorder_device_t *device)
+{
+	recorder_segment_t *segment;
+
+	segment = &device->segment;
+	if (segment->data_fd < 0)
+		return;
+
+	recorder_segment_flush(device);
+
+	close(segment->data_fd);
+	close(segment->index_fd);
+
+	segment->data_fd = -1;
+	segment->index_fd = -1;
+}
+
+static int recorder_segment_open(int index, uint64_t timestamp_us)
+{
+	char path[RECORDER_MAX_PATH];
+	recorder_device_t *device;
+	recorder_segment_t *segment;
+
+	device = &g_recorder.devices[index];
+	segment = &device->segment;
+
+	recorder_segment_close(device);
+
+	segment->slot = segment->slot < 0
+		? recorder_first_slot(index)
+		: (segment->slot + 1) % RECORDER_SEGMENT_COUNT;
+
+	pthread_mutex_lock(&g_recorder.mutex);
+	recorder_directory_remove(&device->directory, segment->slot);
+	pthread_mutex_unlock(&g_recorder.mutex);
+
+	//the index goes first, a reader never trusts stale frames. a new file
+	//rather than a truncated one keeps the mappings of readers valid
+	snprintf(path, sizeof(path), RECORDER_INDEX_FORMAT, g_recorder.dir, index, segment->slot);
+	unlink(path);
+	segment->index_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (segment->index_fd == -1)
+	{
+		LOGERROR("open %s error:%s\n", path, strerror(errno));
+		return -1;
+	}
+
+	//the frames get a new file too, a reader still sending from the old
+	//one keeps its bytes
+	snprintf(path, sizeof(path), RECORDER_DATA_FORMAT, g_recorder.dir, index, segment->slot);
+	unlink(path);
+	segment->data_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (segment->data_fd == -1)
+	{
+		LOGERROR("open %s error:%s\n", path, strerror(errno));
+		close(segment->index_fd);
+		segment->index_fd = -1;
+		return -1;
+	}
+
+	//reserve the blocks up front, the segment is written in one piece
+	if (fallocate(segment->data_fd, FALLOC_FL_KEEP_SIZE, 0, RECORDER_SEGMENT_SIZE) == -1
+		&& errno != EOPNOTSUPP)
+	{
+		LOGWARN("fallocate %s error:%s\n", path, strerror(errno));
+	}
+
+	segment->offset = 0;
+	segment->start_us = timestamp_us;
+	segment->index_size = 0;
+
+	device->slot = segment->slot;
+	++device->segments;
+
+	LOGDEBUG("record segment(device:%d slot:%d)\n", index, segment->slot);
+
+	return 0;
+}
+
+static void recorder_write_frame(recorder_frame_t *frame)
+{
+	recorder_device_t *device;
+	recorder_segment_t *segment;
+	recorder_index_t *record;
+
+	device = &g_recorder.devices[frame->index];
+	segment = &device->segment;
+
+	if (frame->size == 0)
+	{
+		recorder_segment_close(device);
+		return;
+	}
+
+	if (segment->data_fd < 0
+		|| frame->timestamp_us - segment->start_us >= (uint64_t)RECORDER_SEGMENT_TIME * 1000000
+		|| segment->offset + frame->size > RECORDER_SEGMENT_SIZE)
+	{
+		if (recorder_segment_open(frame->index, frame->timestamp_us) == -1)
+		{
+			++device->dropped;
+			return;
+		}
+	}
+
+	record = &segment->records[segment->pending];
+	record->timestamp_us = frame->timestamp_us;
+	record->offset = segment->offset;
+	record->size = frame->size;
+	record->reserved = 0;
+
+	segment->iovs[segment->pending].iov_base = frame->data;
+	segment->iovs[segment->pending].iov_len = frame->size;
+	segment->offset += frame->size;
+
+	if (++segment->pending == RECORDER_BATCH)
+		recorder_segment_flush(device);
+}
+
+static void * recorder_thread(void *arg)
+{
+	recorder_frame_t *list, *frame;
+	int i, running;
+
+	while (1)
+	{
+		pthread_mutex_lock(&g_recorder.mutex);
+
+		while (g_recorder.running && g_recorder.head == NULL)
+			pthread_cond_wait(&g_recorder.cond, &g_recorder.mutex);
+
+		list = g_recorder.head;
+		g_recorder.head = NULL;
+		g_recorder.tail = NULL;
+		g_recorder.queued = 0;
+		running = g_recorder.running;
+
+		pthread_mutex_unlock(&g_recorder.mutex);
+
+		for (frame = list; frame; frame = frame->next)
+			recorder_write_frame(frame);
+
+		//pending batches point into the frames, write them before freeing
+		for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+			recorder_segment_flush(&g_recorder.devices[i]);
+
+		while (list)
+		{
+			frame = list->next;
+			free(list);
+			list = frame;
+		}
+
+		if (!running)
+			break;
+	}
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+		recorder_segment_close(&g_recorder.devices[i]);
+
+	return NULL;
+}
+
+static void recorder_queue(recorder_frame_t *frame)
+{
+	pthread_mutex_lock(&g_recorder.mutex);
+
+	if (g_recorder.tail)
+		g_recorder.tail->next = frame;
+	else
+		g_recorder.head = frame;
+
+	g_recorder.tail = frame;
+	g_recorder.queued += frame->size;
+
+	pthread_cond_signal(&g_recorder.cond);
+	pthread_mutex_unlock(&g_recorder.mutex);
+}
+
+void recorder_on_video_read(const char *buf, int size, struct timeval *timestamp, v4l2port_t *video)
+{
+	recorder_device_t *device;
+	recorder_frame_t *frame;
+	struct timeval now;
+	int index, queued;
+
+	index = video->profile.value;
+	if (!g_recorder.running || index < 0 || index >= MAX_VIDEO_COUNT)
+		return;
+
+	device = &g_recorder.devices[index];
+	if (!device->recording)
+		return;
+
+	video_manager_set_check_time(video);
+
+	//never wait for the disk, drop the frame when the writer is behind
+	pthread_mutex_lock(&g_recorder.mutex);
+	queued = g_recorder.queued;
+	pthread_mutex_unlock(&g_recorder.mutex);
+
+	if (queued + size > RECORDER_QUEUE_SIZE)
+	{
+		++device->dropped;
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+
+	frame = fmalloc(sizeof(recorder_frame_t) + size);
+	frame->next = NULL;
+	frame->index = index;
+	frame->size = size;
+	frame->timestamp_us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+	memcpy(frame->data, buf, size);
+
+	recorder_queue(frame);
+}
+
+int recorder_init(const char *dir)
+{
+	sigset_t mask, old_mask;
+	int i, ret;
+
+	if (g_recorder.running)
+		return 0;
+
+	if (strlen(dir) >= RECORDER_MAX_DIR)
+		return -1;
+
+	strcpy(g_recorder.dir, dir);
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+	{
+		LOGERROR("mkdir %s error:%s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		g_recorder.devices[i].slot = -1;
+		g_recorder.devices[i].segment.slot = -1;
+		g_recorder.devices[i].segment.data_fd = -1;
+		g_recorder.devices[i].segment.index_fd = -1;
+
+		recorder_directory_load(i);
+	}
+
+	pthread_mutex_init(&g_recorder.mutex, NULL);
+	pthread_cond_init(&g_recorder.cond, NULL);
+
+	g_recorder.running = 1;
+
+	//signals are consumed by the event loop thread only
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&g_recorder.thread, NULL, recorder_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0)
+	{
+		g_recorder.running = 0;
+		return -1;
+	}
+
+	LOGINFO("recorder start(%s)\n", dir);
+
+	return 0;
+}
+
+const char * recorder_get_dir()
+{
+	return g_recorder.dir[0] ? g_recorder.dir : NULL;
+}
+
+int recorder_start(int index)
+{
+	char path[RECORDER_MAX_PATH];
+
+	if (!g_recorder.running || video_manager_get(index) == NULL)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/cam%d", g_recorder.dir, index);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+	{
+		LOGERROR("mkdir %s error:%s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (video_manager_stream_start(index) == -1)
+		return -1;
+
+	if (!g_recorder.devices[index].recording)
+		LOGINFO("record start(device:%d)\n", index);
+
+	g_recorder.devices[index].recording = 1;
+
+	return 0;
+}
+
+int recorder_stop(int index)
+{
+	recorder_frame_t *frame;
+
+	if (!g_recorder.running || index < 0 || index >= MAX_VIDEO_COUNT
+		|| !g_recorder.devices[index].recording)
+	{
+		return -1;
+	}
+
+	g_recorder.devices[index].recording = 0;
+
+	frame = fcalloc(1, sizeof(recorder_frame_t));
+	frame->index = index;
+	recorder_queue(frame);
+
+	LOGINFO("record stop(device:%d)\n", index);
+
+	return 0;
+}
+
+//slot of the newest segment starting at or before timestamp_us, the
+//oldest one when all start later, -1 when nothing is recorded
+int recorder_find_segment(int index, uint64_t timestamp_us)
+{
+	recorder_directory_t *directory;
+	int low, high, mid, slot;
+
+	if (!g_recorder.running || index < 0 || index >= MAX_VIDEO_COUNT)
+		return -1;
+
+	directory = &g_recorder.devices[index].directory;
+
+	pthread_mutex_lock(&g_recorder.mutex);
+
+	low = 0;
+	high = directory->count - 1;
+	while (low < high)
+	{
+		mid = (low + high + 1) / 2;
+
+		if (directory->first_us[directory->order[mid]] <= timestamp_us)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	slot = directory->count > 0 ? directory->order[low] : -1;
+
+	pthread_mutex_unlock(&g_recorder.mutex);
+
+	return slot;
+}
+
+//time of the first frame in the slot, 0 while it holds none
+uint64_t recorder_get_segment(int index, int slot)
+{
+	uint64_t first_us;
+
+	if (!g_recorder.running || index < 0 || index >= MAX_VIDEO_COUNT
+		|| slot < 0 || slot >= RECORDER_SEGMENT_COUNT)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&g_recorder.mutex);
+	first_us = g_recorder.devices[index].directory.first_us[slot];
+	pthread_mutex_unlock(&g_recorder.mutex);
+
+	return first_us;
+}
+
+int recorder_get_stat(int index, recorder_stat_t *stat)
+{
+	recorder_device_t *device;
+
+	if (!g_recorder.running || index < 0 || index >= MAX_VIDEO_COUNT)
+		return -1;
+
+	device = &g_recorder.devices[index];
+
+	stat->recording = device->recording;
+	stat->slot = device->slot;
+	stat->frames = device->frames;
+	stat->dropped = device->dropped;
+	stat->segments = device->segments;
+	stat->bytes = device->bytes;
+
+	return 0;
+}
+
+void recorder_resume()
+{
+	int i;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		if (g_recorder.devices[i].recording)
+			video_manager_stream_start(i);
+	}
+}
+
+void recorder_cleanup()
+{
+	if (!g_recorder.running)
+		return;
+
+	pthread_mutex_lock(&g_recorder.mutex);
+	g_recorder.running = 0;
+	pthread_cond_signal(&g_recorder.cond);
+	pthread_mutex_unlock(&g_recorder.mutex);
+
+	pthread_join(g_recorder.thread, NULL);
+
+	pthread_mutex_destroy(&g_recorder.mutex);
+	pthread_cond_destroy(&g_recorder.cond);
+
+	LOGINFO("recorder stop\n");
+}
@@ -0,0 +1,66 @@
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+
+#include <stdint.h>
+#include <sys/time.h>
+
+
+#define RECORDER_ENV				"CAMLITE_RECORD_DIR"
+#define RECORDER_SEGMENT_TIME		60					//seconds per segment
+#define RECORDER_SEGMENT_SIZE		(64 * 1024 * 1024)	//preallocated per segment
+#define RECORDER_SEGMENT_COUNT		60					//segments kept per device
+#define RECORDER_QUEUE_SIZE			(8 * 1024 * 1024)	//frames waiting for the writer
+#define RECORDER_BATCH				64					//frames per write call
+
+//segment slot n of device i is <dir>/cam<i>/seg<n>.mjpg, the frames back to
+//back, and seg<n>.idx, one record per frame in write order. the index is
+//the only authority, data past the last record is stale.
+#define RECORDER_DATA_FORMAT		"%s/cam%d/seg%03d.mjpg"
+#define RECORDER_INDEX_FORMAT		"%s/cam%d/seg%03d.idx"
+
+
+typedef struct _recorder_index
+{
+	uint64_t timestamp_us;	//wall clock
+	uint64_t offset;
+	uint32_t size;
+	uint32_t reserved;
+} recorder_index_t;
+
+typedef struct _recorder_stat
+{
+	int recording;
+	int slot;
+	unsigned int frames;
+	unsigned int dropped;
+	unsigned int segments;
+	unsigned long long bytes;
+} recorder_stat_t;
+
+
+typedef struct _v4l2port v4l2port_t;
+
+
+void recorder_on_video_read(const char *buf,
+	int size, struct timeval *timestamp, v4l2port_t *video);
+
+int recorder_init(const char *dir);
+
+const char * recorder_get_dir();
+
+int recorder_start(int index);
+
+int recorder_stop(int index);
+
+int recorder_find_segment(int index, uint64_t timestamp_us);
+
+uint64_t recorder_get_segment(int index, int slot);
+
+int recorder_get_stat(int index, recorder_stat_t *stat);
+
+void recorder_resume();
+
+void recorder_cleanup();
+
+#endif
@@ -0,0 +1,192 @@
+#include "rtpjpeg.h"
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "util.h"
+
+#define RTPJPEG_WRITE_WORD(p, v) do { (p)[0] = (v) >> 8; (p)[1] = (v); } while (0)
+
+#define RTPJPEG_WRITE_DWORD(p, v) do { \
+		(p)[0] = (v) >> 24; (p)[1] = (v) >> 16; (p)[2] = (v) >> 8; (p)[3] = (v); \
+	} while (0)
+
+
+void rtpjpeg_init(rtpjpeg_t *rtp, unsigned int ssrc)
+{
+	memset(rtp, 0, sizeof(rtpjpeg_t));
+
+	rtp->ssrc = ssrc;
+	rtp->seq = ssrc >> 16;
+}
+
+void rtpjpeg_uninit(rtpjpeg_t *rtp)
+{
+	free(rtp->packets);
+
+	rtp->packets = NULL;
+	rtp->count = 0;
+	rtp->max = 0;
+}
+
+unsigned int rtpjpeg_timestamp(const struct timeval *tv)
+{
+	unsigned long long ts;
+
+	ts = (unsigned long long)tv->tv_sec * RTPJPEG_CLOCK_RATE
+		+ (unsigned long long)tv->tv_usec * (RTPJPEG_CLOCK_RATE / 1000) / 1000;
+
+	return (unsigned int)ts;
+}
+
+static int rtpjpeg_write_head(rtpjpeg_t *rtp, rtpjpeg_packet_t *packet,
+	const jpeg_frame_t *frame, int offset, int last)
+{
+	unsigned char *p;
+	int type;
+
+	p = packet->head;
+
+	//rtp header, version 2, marker on the last fragment
+	p[0] = 0x80;
+	p[1] = RTPJPEG_PAYLOAD_TYPE | (last ? 0x80 : 0);
+	RTPJPEG_WRITE_WORD(p + 2, rtp->seq);
+	RTPJPEG_WRITE_DWORD(p + 4, rtp->timestamp);
+	RTPJPEG_WRITE_DWORD(p + 8, rtp->ssrc);
+	p += 12;
+
+	type = frame->sampling;
+	if (frame->restart_interval)
+		type += 64;
+
+	//jpeg header, q 255 carries the tables in band
+	p[0] = 0;
+	p[1] = offset >> 16;
+	p[2] = offset >> 8;
+	p[3] = offset;
+	p[4] = type;
+	p[5] = 255;
+	p[6] = frame->width / 8;
+	p[7] = frame->height / 8;
+	p += 8;
+
+	if (frame->restart_interval)
+	{
+		RTPJPEG_WRITE_WORD(p, frame->restart_interval);
+		p[2] = 0xff; //first and last bits set, count 0x3fff
+		p[3] = 0xff;
+		p += 4;
+	}
+
+	if (offset == 0)
+	{
+		p[0] = 0;
+		p[1] = 0; //8 bit precision
+		RTPJPEG_WRITE_WORD(p + 2, JPEG_QTABLE_SIZE * 2);
+		memcpy(p + 4, frame->qtables[frame->components[0].qtable], JPEG_QTABLE_SIZE);
+		memcpy(p + 4 + JPEG_QTABLE_SIZE,
+			frame->qtables[frame->components[1].qtable], JPEG_QTABLE_SIZE);
+		p += 4 + JPEG_QTABLE_SIZE * 2;
+	}
+
+	packet->head_size = p - packet->head;
+	++rtp->seq;
+
+	return 0;
+}
+
+int rtpjpeg_packetize(rtpjpeg_t *rtp, const jpeg_frame_t *frame, unsigned int timestamp)
+{
+	int count, offset, size, max_payload;
+	rtpjpeg_packet_t *packet;
+
+	rtp->count = 0;
+
+	if (frame->sampling == JPEG_SAMPLING_OTHER
+		|| frame->width > 2040 || frame->height > 2040
+		|| (frame->width & 7) || (frame->height & 7)
+		|| frame->qtables[frame->components[0].qtable] == NULL
+		|| frame->qtables[frame->components[1].qtable] == NULL
+		|| frame->scan_size <= 0)
+	{
+		return -1;
+	}
+
+	max_payload = RTPJPEG_MAX_PAYLOAD - RTPJPEG_HEAD_SIZE;
+	count = (frame->scan_size + max_payload - 1) / max_payload;
+
+	if (count > rtp->max)
+	{
+		rtp->packets = frealloc(rtp->packets, count * sizeof(rtpjpeg_packet_t));
+		rtp->max = count;
+	}
+
+	rtp->timestamp = timestamp;
+
+	for (offset = 0; offset < frame->scan_size; offset += size)
+	{
+		size = frame->scan_size - offset;
+		if (size > max_payload)
+			size = max_payload;
+
+		packet = &rtp->packets[rtp->count++];
+
+		rtpjpeg_write_head(rtp, packet, frame, offset,
+			offset + size == frame->scan_size);
+
+		packet->payload = frame->scan + offset;
+		packet->payload_size = size;
+	}
+
+	return rtp->count;
+}
+
+int rtpjpeg_send(int fd, const struct sockaddr_in *addr, const rtpjpeg_t *rtp)
+{
+	struct mmsghdr msgs[RTPJPEG_SEND_BATCH];
+	struct iovec iovs[RTPJPEG_SEND_BATCH][2];
+	rtpjpeg_packet_t *packet;
+	int i, n, sent, ret;
+
+	sent = 0;
+
+	while (sent < rtp->count)
+	{
+		n = rtp->count - sent;
+		if (n > RTPJPEG_SEND_BATCH)
+			n = RTPJPEG_SEND_BATCH;
+
+		memset(msgs, 0, n * sizeof(struct mmsghdr));
+
+		for (i = 0; i < n; ++i)
+		{
+			packet = &rtp->packets[sent + i];
+
+			iovs[i][0].iov_base = packet->head;
+			iovs[i][0].iov_len = packet->head_size;
+			iovs[i][1].iov_base = (void *)packet->payload;
+			iovs[i][1].iov_len = packet->payload_size;
+
+			msgs[i].msg_hdr.msg_name = (void *)addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			msgs[i].msg_hdr.msg_iov = iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 2;
+		}
+
+		ret = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+		if (ret <= 0)
+		{
+			//the rest of the frame is lost, the receiver resyncs on the next one
+			if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+
+			break;
+		}
+
+		sent += ret;
+	}
+
+	return sent;
+}
@@ -0,0 +1,51 @@
+#ifndef RTPJPEG_H_
+#define RTPJPEG_H_
+
+#include "jpeg.h"
+
+struct timeval;
+struct sockaddr_in;
+
+
+#define RTPJPEG_PAYLOAD_TYPE	26
+#define RTPJPEG_CLOCK_RATE		90000
+#define RTPJPEG_MAX_PAYLOAD		1400
+#define RTPJPEG_SEND_BATCH		64
+
+//rtp + jpeg + restart marker + quantization table headers, rfc 2435
+#define RTPJPEG_HEAD_SIZE		(12 + 8 + 4 + 4 + JPEG_QTABLE_SIZE * 2)
+
+
+typedef struct _rtpjpeg_packet
+{
+	unsigned char head[RTPJPEG_HEAD_SIZE];
+	int head_size;
+
+	//points into the frame, valid until the next packetize
+	const unsigned char *payload;
+	int payload_size;
+} rtpjpeg_packet_t;
+
+typedef struct _rtpjpeg
+{
+	unsigned int ssrc;
+	unsigned short seq;
+	unsigned int timestamp;
+
+	rtpjpeg_packet_t *packets;
+	int count;
+	int max;
+} rtpjpeg_t;
+
+
+void rtpjpeg_init(rtpjpeg_t *rtp, unsigned int ssrc);
+
+void rtpjpeg_uninit(rtpjpeg_t *rtp);
+
+unsigned int rtpjpeg_timestamp(const struct timeval *tv);
+
+int rtpjpeg_packetize(rtpjpeg_t *rtp, const jpeg_frame_t *frame, unsigned int timestamp);
+
+int rtpjpeg_send(int fd, const struct sockaddr_in *addr, const rtpjpeg_t *rtp);
+
+#endif
@@ -0,0 +1,1109 @@
+#include "rtsp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "pevent.h"
+#include "video_manager.h"
+#include "v4l2port.h"
+#include "digest.h"
+#include "jpeg.h"
+#include "rtpjpeg.h"
+
+#define RTSP_MAX_REQUEST_SIZE	4096
+#define RTSP_MAX_RESPONSE_SIZE	2048
+#define RTSP_MAX_URI_SIZE		512
+#define RTSP_MAX_DIGEST_SIZE	(RTSP_MAX_URI_SIZE + 256)
+
+#define RTSP_STATE_INIT			0
+#define RTSP_STATE_READY		1
+#define RTSP_STATE_PLAYING		2
+
+#define RTSP_INTERLEAVED_SIZE	4
+#define RTSP_MAX_IOV			(IOV_MAX / 3 * 3)
+
+
+typedef struct _rtsp_request
+{
+	char method[16];
+	char uri[RTSP_MAX_URI_SIZE];
+	int cseq;
+	int content_length;
+	char transport[256];
+	char session[64];
+	char digest[RTSP_MAX_DIGEST_SIZE];
+} rtsp_request_t;
+
+typedef struct _rtsp_session
+{
+	int fd;
+	pevent_t *pevent;
+
+	char ip[32];
+	unsigned short port;
+	unsigned int addr;
+
+	char request_buf[RTSP_MAX_REQUEST_SIZE + 1];
+	int request_size;
+
+	//control replies and the tail of a frame the socket did not take
+	char *send_buf;
+	int send_size;
+	int send_cur;
+	int send_max;
+	int writing;
+	int closing;
+
+	unsigned int id;
+	int state;
+	int index;
+
+	int interleaved;
+	int channel;
+	struct sockaddr_in rtp_addr;
+	unsigned short client_port[2];
+
+	unsigned long active_time;
+	unsigned int frames;
+	unsigned int dropped;
+
+	struct _rtsp_session *prev;
+	struct _rtsp_session *next;
+} rtsp_session_t;
+
+typedef struct _rtsp_device
+{
+	rtpjpeg_t rtp;
+	unsigned int unsupported;
+} rtsp_device_t;
+
+typedef struct _rtsp_manage
+{
+	pevent_base_t *base;
+	pevent_t *pevent;
+	unsigned short port;
+
+	//one pair of udp sockets shared by every session
+	pevent_t *rtp_pevent;
+	pevent_t *rtcp_pevent;
+	unsigned short server_port[2];
+
+	rtsp_session_t *sessions;
+	int session_count;
+
+	rtsp_device_t devices[MAX_VIDEO_COUNT];
+
+	//interleaved headers of the frame being sent
+	unsigned char (*interleaved)[RTSP_INTERLEAVED_SIZE];
+	int interleaved_max;
+} rtsp_manage_t;
+
+
+static rtsp_manage_t g_rtsp;
+
+
+static const char * rtsp_code_string(int code)
+{
+	switch (code)
+	{
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 454: return "Session Not Found";
+	case 455: return "Method Not Valid in This State";
+	case 461: return "Unsupported Transport";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 503: return "Service Unavailable";
+	default: return "Unknown";
+	}
+}
+
+static void rtsp_session_free(rtsp_session_t *session)
+{
+	LOGDEBUG("rtsp disconnect(%s:%u) fd:%d\n",
+		session->ip, session->port, session->fd);
+
+	if (session->prev)
+		session->prev->next = session->next;
+	else
+		g_rtsp.sessions = session->next;
+
+	if (session->next)
+		session->next->prev = session->prev;
+
+	--g_rtsp.session_count;
+
+	pevent_free(session->pevent);
+	free(session->send_buf);
+	free(session);
+}
+
+static void rtsp_session_append(rtsp_session_t *session, const char *buf, int size)
+{
+	if (session->send_size + size > session->send_max)
+	{
+		session->send_max = session->send_size + size;
+		session->send_buf = frealloc(session->send_buf, session->send_max);
+	}
+
+	memcpy(session->send_buf + session->send_size, buf, size);
+	session->send_size += size;
+}
+
+static int rtsp_session_set_writing(rtsp_session_t *session, int writing)
+{
+	if (session->writing == writing)
+		return 0;
+
+	session->writing = writing;
+
+	return pevent_set(session->pevent, writing ? PEVENT_WRITE : PEVENT_READ);
+}
+
+//returns -1 when the session was closed
+static int rtsp_session_flush(rtsp_session_t *session)
+{
+	int ret;
+
+	while (session->send_cur < session->send_size)
+	{
+		ret = pevent_write(session->pevent, session->send_buf + session->send_cur,
+			session->send_size - session->send_cur);
+
+		if (ret == -1)
+		{
+			rtsp_session_free(session);
+			return -1;
+		}
+		else if (ret == 0)
+		{
+			if (rtsp_session_set_writing(session, 1) == -1)
+			{
+				rtsp_session_free(session);
+				return -1;
+			}
+
+			return 0; //EAGAIN
+		}
+
+		session->send_cur += ret;
+	}
+
+	session->send_cur = 0;
+	session->send_size = 0;
+
+	if (session->closing)
+	{
+		rtsp_session_free(session);
+		return -1;
+	}
+
+	if (rtsp_session_set_writing(session, 0) == -1)
+	{
+		rtsp_session_free(session);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int rtsp_session_send(rtsp_session_t *session, const char *buf, int size)
+{
+	rtsp_session_append(session, buf, size);
+
+	if (session->writing)
+		return 0;
+
+	return rtsp_session_flush(session);
+}
+
+//a frame is written whole or not at all, a slow client skips frames instead of queueing them
+static int rtsp_session_send_frame(rtsp_session_t *session, const rtpjpeg_t *rtp)
+{
+	struct iovec iovs[RTSP_MAX_IOV];
+	rtpjpeg_packet_t *packet;
+	int i, n, start, size, total, ret;
+	unsigned char *prefix;
+
+	if (session->send_cur < session->send_size)
+	{
+		++session->dropped;
+		return 0;
+	}
+
+	if (rtp->count > g_rtsp.interleaved_max)
+	{
+		g_rtsp.interleaved = frealloc(g_rtsp.interleaved,
+			rtp->count * RTSP_INTERLEAVED_SIZE);
+		g_rtsp.interleaved_max = rtp->count;
+	}
+
+	for (start = 0; start < rtp->count; start += n)
+	{
+		n = rtp->count - start;
+		if (n > RTSP_MAX_IOV / 3)
+			n = RTSP_MAX_IOV / 3;
+
+		total = 0;
+
+		for (i = 0; i < n; ++i)
+		{
+			packet = &rtp->packets[start + i];
+			prefix = g_rtsp.interleaved[start + i];
+			size = packet->head_size + packet->payload_size;
+
+			prefix[0] = '$';
+			prefix[1] = session->channel;
+			prefix[2] = size >> 8;
+			prefix[3] = size;
+
+			iovs[i * 3].iov_base = prefix;
+			iovs[i * 3].iov_len = RTSP_INTERLEAVED_SIZE;
+			iovs[i * 3 + 1].iov_base = (void *)packet->head;
+			iovs[i * 3 + 1].iov_len = packet->head_size;
+			iovs[i * 3 + 2].iov_base = (void *)packet->payload;
+			iovs[i * 3 + 2].iov_len = packet->payload_size;
+
+			total += RTSP_INTERLEAVED_SIZE + size;
+		}
+
+		ret = writev(session->fd, iovs, n * 3);
+		if (ret == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				rtsp_session_free(session);
+				return -1;
+			}
+
+			if (start == 0)
+			{
+				++session->dropped;
+				return 0;
+			}
+
+			ret = 0;
+		}
+
+		if (ret < total)
+		{
+			//keep the rest of the frame so the interleaved stream stays framed
+			for (i = 0; i < n * 3; ++i)
+			{
+				if (ret >= (int)iovs[i].iov_len)
+				{
+					ret -= iovs[i].iov_len;
+					continue;
+				}
+
+				rtsp_session_append(session,
+					(char *)iovs[i].iov_base + ret, iovs[i].iov_len - ret);
+				ret = 0;
+			}
+
+			for (i = start + n; i < rtp->count; ++i)
+			{
+				packet = &rtp->packets[i];
+				size = packet->head_size + packet->payload_size;
+
+				prefix = g_rtsp.interleaved[i];
+				prefix[0] = '$';
+				prefix[1] = session->channel;
+				prefix[2] = size >> 8;
+				prefix[3] = size;
+
+				rtsp_session_append(session, (char *)prefix, RTSP_INTERLEAVED_SIZE);
+				rtsp_session_append(session, (char *)packet->head, packet->head_size);
+				rtsp_session_append(session, (char *)packet->payload, packet->payload_size);
+			}
+
+			if (rtsp_session_set_writing(session, 1) == -1)
+			{
+				rtsp_session_free(session);
+				return -1;
+			}
+
+			break;
+		}
+	}
+
+	++session->frames;
+
+	return 0;
+}
+
+static int rtsp_reply(rtsp_session_t *session, rtsp_request_t *request,
+	int code, const char *headers, const char *body)
+{
+	char buf[RTSP_MAX_RESPONSE_SIZE];
+	int len;
+
+	len = snprintf(buf, sizeof(buf),
+		"RTSP/1.0 %d %s\r\n"
+		"CSeq: %d\r\n"
+		"Server: camlite\r\n"
+		"%s",
+		code, rtsp_code_string(code),
+		request->cseq,
+		headers ? headers : "");
+
+	if (body)
+	{
+		len += snprintf(buf + len, sizeof(buf) - len,
+			"Content-Length: %d\r\n\r\n%s", (int)strlen(body), body);
+	}
+	else
+	{
+		len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+	}
+
+	if (len >= (int)sizeof(buf))
+	{
+		LOGWARN("rtsp response overflow(%s:%u)\n", session->ip, session->port);
+		len = sizeof(buf) - 1;
+	}
+
+	return rtsp_session_send(session, buf, len);
+}
+
+//rtsp://host:port/0/track0, a path without a device number means device 0
+static int rtsp_get_index(const char *uri)
+{
+	const char *p;
+
+	p = strstr(uri, "://");
+	p = p ? strchr(p + 3, '/') : uri;
+
+	if (p == NULL)
+		return 0;
+
+	while (*p == '/')
+		++p;
+
+	return isdigit((unsigned char)*p) ? atoi(p) : 0;
+}
+
+static int rtsp_request_parse_line(rtsp_request_t *request, char *line)
+{
+	if (request->method[0] == '\0')
+	{
+		if (sscanf(line, "%15s %511s RTSP/", request->method, request->uri) != 2)
+			return -1;
+	}
+	else if (strncasecmp(line, "CSeq:", 5) == 0)
+	{
+		request->cseq = atoi(line + 5);
+	}
+	else if (strncasecmp(line, "Content-Length:", 15) == 0)
+	{
+		request->content_length = atoi(line + 15);
+	}
+	else if (strncasecmp(line, "Transport:", 10) == 0)
+	{
+		sscanf(line + 10, " %255s", request->transport);
+	}
+	else if (strncasecmp(line, "Session:", 8) == 0)
+	{
+		sscanf(line + 8, " %63[^; \t]", request->session);
+	}
+	else if (strncasecmp(line, "Authorization: Digest", 21) == 0)
+	{
+		strncpy(request->digest, line + 21, RTSP_MAX_DIGEST_SIZE - 1);
+	}
+
+	return 0;
+}
+
+//0 when authorized, 1 after a challenge was sent, -1 when the session is gone
+static int rtsp_check_digest(rtsp_session_t *session, rtsp_request_t *request)
+{
+	int ret;
+	char headers[256];
+	char challenge[192];
+
+	ret = digest_verify(request->method, request->uri, request->digest, session->addr);
+	if (ret == DIGEST_OK)
+		return 0;
+
+	digest_challenge(challenge, sizeof(challenge), session->addr, ret == DIGEST_STALE);
+	snprintf(headers, sizeof(headers), "WWW-Authenticate: %s\r\n", challenge);
+
+	return rtsp_reply(session, request, 401, headers, NULL) == -1 ? -1 : 1;
+}
+
+static int rtsp_on_describe(rtsp_session_t *session, rtsp_request_t *request)
+{
+	char sdp[512];
+	char headers[RTSP_MAX_URI_SIZE + 64];
+	struct sockaddr_in addr;
+	socklen_t len;
+	v4l2port_t *video;
+	int index;
+
+	index = rtsp_get_index(request->uri);
+
+	video = video_manager_get(index);
+	if (video == NULL)
+		return rtsp_reply(session, request, 404, NULL, NULL);
+
+	len = sizeof(addr);
+	if (getsockname(session->fd, (struct sockaddr *)&addr, &len) == -1)
+		addr.sin_addr.s_addr = INADDR_ANY;
+
+	snprintf(sdp, sizeof(sdp),
+		"v=0\r\n"
+		"o=- %u 1 IN IP4 %s\r\n"
+		"s=camlite\r\n"
+		"c=IN IP4 0.0.0.0\r\n"
+		"t=0 0\r\n"
+		"a=control:*\r\n"
+		"m=video 0 RTP/AVP %d\r\n"
+		"a=rtpmap:%d JPEG/%d\r\n"
+		"a=framerate:%d\r\n"
+		"a=control:track0\r\n",
+		(unsigned int)time(NULL), inet_ntoa(addr.sin_addr),
+		RTPJPEG_PAYLOAD_TYPE,
+		RTPJPEG_PAYLOAD_TYPE, RTPJPEG_CLOCK_RATE,
+		video->profile.fps);
+
+	snprintf(headers, sizeof(headers),
+		"Content-Type: application/sdp\r\n"
+		"Content-Base: %s%s\r\n",
+		request->uri,
+		request->uri[strlen(request->uri) - 1] == '/' ? "" : "/");
+
+	return rtsp_reply(session, request, 200, headers, sdp);
+}
+
+static int rtsp_on_setup(rtsp_session_t *session, rtsp_request_t *request)
+{
+	char headers[384];
+	const char *p;
+	int index, rtp_port, rtcp_port, channel;
+
+	index = rtsp_get_index(request->uri);
+	if (video_manager_get(index) == NULL)
+		return rtsp_reply(session, request, 404, NULL, NULL);
+
+	if (session->state == RTSP_STATE_PLAYING && index != session->index)
+		return rtsp_reply(session, request, 455, NULL, NULL);
+
+	if (strstr(request->transport, "RTP/AVP/TCP") != NULL)
+	{
+		channel = 0;
+
+		p = strstr(request->transport, "interleaved=");
+		if (p != NULL)
+			channel = atoi(p + STATIC_STRLEN("interleaved="));
+
+		session->interleaved = 1;
+		session->channel = channel;
+
+		snprintf(headers, sizeof(headers),
+			"Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\n",
+			channel, channel + 1, g_rtsp.devices[index].rtp.ssrc);
+	}
+	else
+	{
+		p = strstr(request->transport, "client_port=");
+		if (p == NULL || strstr(request->transport, "multicast") != NULL
+			|| g_rtsp.rtp_pevent == NULL)
+		{
+			return rtsp_reply(session, request, 461, NULL, NULL);
+		}
+
+		rtp_port = atoi(p + STATIC_STRLEN("client_port="));
+		p = strchr(p, '-');
+		rtcp_port = p ? atoi(p + 1) : rtp_port + 1;
+
+		if (rtp_port <= 0 || rtp_port > 0xffff)
+			return rtsp_reply(session, request, 461, NULL, NULL);
+
+		session->interleaved = 0;
+		session->client_port[0] = rtp_port;
+		session->client_port[1] = rtcp_port;
+
+		memset(&session->rtp_addr, 0, sizeof(session->rtp_addr));
+		session->rtp_addr.sin_family = AF_INET;
+		session->rtp_addr.sin_addr.s_addr = session->addr;
+		session->rtp_addr.sin_port = htons(rtp_port);
+
+		snprintf(headers, sizeof(headers),
+			"Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%u-%u;ssrc=%08X\r\n",
+			rtp_port, rtcp_port,
+			g_rtsp.server_port[0], g_rtsp.server_port[1],
+			g_rtsp.devices[index].rtp.ssrc);
+	}
+
+	if (session->id == 0)
+		session->id = (unsigned int)rand() | 1;
+
+	session->index = index;
+	if (session->state == RTSP_STATE_INIT)
+		session->state = RTSP_STATE_READY;
+
+	snprintf(headers + strlen(headers), sizeof(headers) - strlen(headers),
+		"Session: %08X;timeout=%d\r\n", session->id, RTSP_SESSION_TIMEOUT);
+
+	return rtsp_reply(session, request, 200, headers, NULL);
+}
+
+static int rtsp_on_play(rtsp_session_t *session, rtsp_request_t *request)
+{
+	char headers[RTSP_MAX_URI_SIZE + 128];
+	struct timespec ts;
+	struct timeval now;
+
+	if (session->state == RTSP_STATE_INIT)
+		return rtsp_reply(session, request, 455, NULL, NULL);
+
+	if (video_manager_stream_start(session->index) == -1)
+		return rtsp_reply(session, request, 503, NULL, NULL);
+
+	session->state = RTSP_STATE_PLAYING;
+
+	//capture timestamps are monotonic, the next frame lands close to now
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now.tv_sec = ts.tv_sec;
+	now.tv_usec = ts.tv_nsec / 1000;
+
+	LOGINFO("rtsp play(%s:%u device:%d %s)\n",
+		session->ip, session->port, session->index,
+		session->interleaved ? "tcp" : "udp");
+
+	snprintf(headers, sizeof(headers),
+		"Session: %08X\r\n"
+		"Range: npt=0.000-\r\n"
+		"RTP-Info: url=%s;seq=%u;rtptime=%u\r\n",
+		session->id,
+		request->uri,
+		g_rtsp.devices[session->index].rtp.seq,
+		rtpjpeg_timestamp(&now));
+
+	return rtsp_reply(session, request, 200, headers, NULL);
+}
+
+static int rtsp_on_request(rtsp_session_t *session, rtsp_request_t *request)
+{
+	char headers[64];
+	int ret;
+
+	LOGDEBUG("rtsp request:%s %s(%s:%u)\n",
+		request->method, request->uri, session->ip, session->port);
+
+	session->active_time = gettickcount();
+
+	if (strcmp(request->method, "OPTIONS") == 0)
+	{
+		return rtsp_reply(session, request, 200,
+			"Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER\r\n",
+			NULL);
+	}
+
+	ret = rtsp_check_digest(session, request);
+	if (ret != 0)
+		return ret == -1 ? -1 : 0;
+
+	if (request->session[0] != '\0'
+		&& (session->id == 0 || strtoul(request->session, NULL, 16) != session->id))
+	{
+		return rtsp_reply(session, request, 454, NULL, NULL);
+	}
+
+	if (strcmp(request->method, "DESCRIBE") == 0)
+	{
+		return rtsp_on_describe(session, request);
+	}
+	else if (strcmp(request->method, "SETUP") == 0)
+	{
+		return rtsp_on_setup(session, request);
+	}
+	else if (strcmp(request->method, "PLAY") == 0)
+	{
+		return rtsp_on_play(session, request);
+	}
+
+	snprintf(headers, sizeof(headers), "Session: %08X\r\n", session->id);
+
+	if (strcmp(request->method, "PAUSE") == 0)
+	{
+		if (session->state == RTSP_STATE_PLAYING)
+			session->state = RTSP_STATE_READY;
+
+		return rtsp_reply(session, request, 200, headers, NULL);
+	}
+	else if (strcmp(request->method, "TEARDOWN") == 0)
+	{
+		session->state = RTSP_STATE_INIT;
+		session->closing = 1;
+
+		return rtsp_reply(session, request, 200, headers, NULL);
+	}
+	else if (strcmp(request->method, "GET_PARAMETER") == 0
+		|| strcmp(request->method, "SET_PARAMETER") == 0)
+	{
+		return rtsp_reply(session, request, 200, headers, NULL);
+	}
+
+	return rtsp_reply(session, request, 501, NULL, NULL);
+}
+
+//returns the bytes consumed, 0 while the message is incomplete
+static int rtsp_parse(rtsp_session_t *session, char *buf, int size)
+{
+	rtsp_request_t request;
+	char header[RTSP_MAX_REQUEST_SIZE + 1];
+	char *end, *line, *next;
+	int len;
+
+	//rtcp from an interleaved client
+	if (buf[0] == '$')
+	{
+		if (size < RTSP_INTERLEAVED_SIZE)
+			return 0;
+
+		len = RTSP_INTERLEAVED_SIZE + ((unsigned char)buf[2] << 8 | (unsigned char)buf[3]);
+		if (size < len)
+			return 0;
+
+		session->active_time = gettickcount();
+		return len;
+	}
+
+	buf[size] = '\0';
+	end = strstr(buf, "\r\n\r\n");
+	if (end == NULL)
+		return 0;
+
+	len = end + 4 - buf;
+
+	//parse a copy, the message stays intact until its body is here too
+	memcpy(header, buf, end - buf);
+	header[end - buf] = '\0';
+
+	memset(&request, 0, sizeof(request));
+
+	for (line = header; line != NULL; line = next)
+	{
+		next = strstr(line, "\r\n");
+		if (next != NULL)
+		{
+			*next = '\0';
+			next += 2;
+		}
+
+		if (rtsp_request_parse_line(&request, line) == -1)
+			return -1;
+	}
+
+	if (request.content_length < 0
+		|| len + request.content_length > RTSP_MAX_REQUEST_SIZE)
+	{
+		return -1;
+	}
+
+	if (len + request.content_length > size)
+		return 0;
+
+	if (rtsp_on_request(session, &request) == -1)
+		return -2; //session closed
+
+	return len + request.content_length;
+}
+
+static void rtsp_on_read(rtsp_session_t *session)
+{
+	int ret, pos;
+
+	while (1)
+	{
+		if (session->request_size >= RTSP_MAX_REQUEST_SIZE)
+		{
+			LOGWARN("rtsp request buffer overflow(%s:%u)\n", session->ip, session->port);
+			rtsp_session_free(session);
+			return;
+		}
+
+		ret = pevent_read(session->pevent,
+			session->request_buf + session->request_size,
+			RTSP_MAX_REQUEST_SIZE - session->request_size);
+
+		if (ret < 0)
+		{
+			rtsp_session_free(session);
+			return;
+		}
+
+		if (ret == 0)
+			break;
+
+		session->request_size += ret;
+	}
+
+	pos = 0;
+
+	while (pos < session->request_size && !session->closing)
+	{
+		ret = rtsp_parse(session, session->request_buf + pos, session->request_size - pos);
+		if (ret == -2)
+			return;
+
+		if (ret == -1)
+		{
+			LOGWARN("rtsp request parse error(%s:%u)\n", session->ip, session->port);
+			rtsp_session_free(session);
+			return;
+		}
+
+		if (ret == 0)
+			break;
+
+		pos += ret;
+	}
+
+	session->request_size -= pos;
+	if (session->request_size > 0)
+		memmove(session->request_buf, session->request_buf + pos, session->request_size);
+}
+
+static void rtsp_on_event(pevent_t *pevent, int event, rtsp_session_t *session)
+{
+	switch (event)
+	{
+	case PEVENT_ERROR:
+		rtsp_session_free(session);
+		break;
+	case PEVENT_READ:
+		rtsp_on_read(session);
+		break;
+	case PEVENT_WRITE:
+		rtsp_session_flush(session);
+		break;
+	}
+}
+
+static void rtsp_on_accept(pevent_t *pevent, int event, void *ptr)
+{
+	struct sockaddr_in in_addr;
+	socklen_t in_len;
+	rtsp_session_t *session;
+	int fd;
+
+	if (event != PEVENT_READ)
+	{
+		LOGERROR("rtsp listen event error fd:%d\n", pevent_get_fd(pevent));
+		return;
+	}
+
+	while (1)
+	{
+		in_len = sizeof(in_addr);
+		fd = accept4(pevent_get_fd(pevent), (struct sockaddr *)&in_addr, &in_len,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				LOGERROR("rtsp accept error fd:%d\n", pevent_get_fd(pevent));
+			break;
+		}
+
+		if (g_rtsp.session_count >= RTSP_MAX_SESSION)
+		{
+			close(fd);
+			continue;
+		}
+
+		session = fcalloc(1, sizeof(rtsp_session_t));
+		session->fd = fd;
+		session->addr = in_addr.sin_addr.s_addr;
+		session->port = ntohs(in_addr.sin_port);
+		strncpy(session->ip, inet_ntoa(in_addr.sin_addr), sizeof(session->ip) - 1);
+		session->active_time = gettickcount();
+
+		session->pevent = pevent_new(g_rtsp.base, fd,
+			(pevent_callback)rtsp_on_event, session);
+
+		if (pevent_set(session->pevent, PEVENT_READ) == -1)
+		{
+			pevent_free(session->pevent);
+			free(session);
+			continue;
+		}
+
+		session->next = g_rtsp.sessions;
+		if (g_rtsp.sessions)
+			g_rtsp.sessions->prev = session;
+		g_rtsp.sessions = session;
+		++g_rtsp.session_count;
+
+		LOGDEBUG("rtsp connect(%s:%u) fd:%d\n", session->ip, session->port, fd);
+	}
+}
+
+//receiver reports keep udp sessions alive
+static void rtsp_on_udp_event(pevent_t *pevent, int event, void *ptr)
+{
+	char buf[1500];
+	struct sockaddr_in addr;
+	socklen_t len;
+	rtsp_session_t *session;
+	unsigned long now;
+
+	if (event != PEVENT_READ)
+		return;
+
+	now = gettickcount();
+
+	while (1)
+	{
+		len = sizeof(addr);
+		if (recvfrom(pevent_get_fd(pevent), buf, sizeof(buf), 0,
+			(struct sockaddr *)&addr, &len) < 0)
+		{
+			break;
+		}
+
+		for (session = g_rtsp.sessions; session; session = session->next)
+		{
+			if (!session->interleaved
+				&& session->addr == addr.sin_addr.s_addr
+				&& (session->client_port[0] == ntohs(addr.sin_port)
+				|| session->client_port[1] == ntohs(addr.sin_port)))
+			{
+				session->active_time = now;
+			}
+		}
+	}
+}
+
+static pevent_t * rtsp_udp_open(unsigned short *port)
+{
+	struct sockaddr_in addr;
+	socklen_t len;
+	pevent_t *pevent;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(*port);
+
+	len = sizeof(addr);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| getsockname(fd, (struct sockaddr *)&addr, &len) == -1)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	*port = ntohs(addr.sin_port);
+
+	pevent = pevent_new(g_rtsp.base, fd, rtsp_on_udp_event, NULL);
+	if (pevent_set(pevent, PEVENT_READ) == -1)
+	{
+		pevent_free(pevent);
+		return NULL;
+	}
+
+	return pevent;
+}
+
+static void rtsp_udp_start()
+{
+	int i;
+
+	//rtp on an even port and rtcp on the next one
+	for (i = 0; i < 16; ++i)
+	{
+		g_rtsp.server_port[0] = 0;
+		g_rtsp.rtp_pevent = rtsp_udp_open(&g_rtsp.server_port[0]);
+		if (g_rtsp.rtp_pevent == NULL)
+			break;
+
+		if ((g_rtsp.server_port[0] & 1) == 0)
+		{
+			g_rtsp.server_port[1] = g_rtsp.server_port[0] + 1;
+			g_rtsp.rtcp_pevent = rtsp_udp_open(&g_rtsp.server_port[1]);
+			if (g_rtsp.rtcp_pevent != NULL)
+				return;
+		}
+
+		pevent_free(g_rtsp.rtp_pevent);
+		g_rtsp.rtp_pevent = NULL;
+	}
+
+	LOGWARN("rtsp udp transport unavailable, tcp interleaved only\n");
+}
+
+void rtsp_on_video_read(const char *buf, int size, struct timeval *timestamp, v4l2port_t *video)
+{
+	rtsp_session_t *session, *next;
+	rtsp_device_t *device;
+	jpeg_frame_t frame;
+	unsigned long now;
+	int index, count;
+
+	index = video->profile.value;
+	if (index < 0 || index >= MAX_VIDEO_COUNT)
+		return;
+
+	device = &g_rtsp.devices[index];
+	device->rtp.count = 0;
+
+	now = gettickcount();
+	count = 0;
+
+	for (session = g_rtsp.sessions; session; session = next)
+	{
+		next = session->next;
+
+		if (session->state != RTSP_STATE_PLAYING || session->index != index)
+			continue;
+
+		if (!session->interleaved
+			&& now - session->active_time > RTSP_SESSION_TIMEOUT * 1000)
+		{
+			LOGINFO("rtsp session timeout(%s:%u)\n", session->ip, session->port);
+			rtsp_session_free(session);
+			continue;
+		}
+
+		//packetize once per frame, shared by every session of the device
+		if (count++ == 0)
+		{
+			if (jpeg_parse(buf, size, &frame) == -1
+				|| rtpjpeg_packetize(&device->rtp, &frame, rtpjpeg_timestamp(timestamp)) == -1)
+			{
+				if (device->unsupported++ == 0)
+					LOGWARN("rtsp cannot packetize frame(device:%d)\n", index);
+				break;
+			}
+		}
+
+		if (session->interleaved)
+		{
+			rtsp_session_send_frame(session, &device->rtp);
+		}
+		else if (rtpjpeg_send(pevent_get_fd(g_rtsp.rtp_pevent),
+			&session->rtp_addr, &device->rtp) < device->rtp.count)
+		{
+			++session->dropped;
+		}
+		else
+		{
+			++session->frames;
+		}
+	}
+
+	if (count > 0)
+		video_manager_set_check_time(video);
+}
+
+int rtsp_start(pevent_base_t *base, unsigned short port)
+{
+	struct sockaddr_in addr;
+	int fd, opt, i;
+
+	g_rtsp.base = base;
+	g_rtsp.port = port;
+
+	srand(time(NULL) ^ getpid());
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+		rtpjpeg_init(&g_rtsp.devices[i].rtp, (unsigned int)rand());
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		LOGERROR("create rtsp socket error\n");
+		return -1;
+	}
+
+	//an upgraded process binds next to the old one
+	opt = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(fd, 32) == -1)
+	{
+		LOGWARN("bind rtsp socket(0.0.0.0:%u) error\n", port);
+		close(fd);
+		return -1;
+	}
+
+	g_rtsp.pevent = pevent_new(base, fd, rtsp_on_accept, NULL);
+	if (pevent_set(g_rtsp.pevent, PEVENT_READ) == -1)
+	{
+		pevent_free(g_rtsp.pevent);
+		g_rtsp.pevent = NULL;
+		return -1;
+	}
+
+	rtsp_udp_start();
+
+	LOGINFO("rtsp server start(0.0.0.0:%u)\n", port);
+
+	return 0;
+}
+
+int rtsp_session_count()
+{
+	return g_rtsp.session_count;
+}
+
+void rtsp_stop()
+{
+	int i;
+
+	if (g_rtsp.pevent)
+	{
+		pevent_free(g_rtsp.pevent);
+		g_rtsp.pevent = NULL;
+	}
+
+	while (g_rtsp.sessions)
+		rtsp_session_free(g_rtsp.sessions);
+
+	if (g_rtsp.rtp_pevent)
+	{
+		pevent_free(g_rtsp.rtp_pevent);
+		g_rtsp.rtp_pevent = NULL;
+	}
+
+	if (g_rtsp.rtcp_pevent)
+	{
+		pevent_free(g_rtsp.rtcp_pevent);
+		g_rtsp.rtcp_pevent = NULL;
+	}
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+		rtpjpeg_uninit(&g_rtsp.devices[i].rtp);
+
+	free(g_rtsp.interleaved);
+	g_rtsp.interleaved = NULL;
+	g_rtsp.interleaved_max = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef RTSP_H_
+#define RTSP_H_
+
+
+#include <sys/time.h>
+
+
+#define RTSP_MAX_SESSION		64
+#define RTSP_SESSION_TIMEOUT	60
+
+
+typedef struct _pevent_base pevent_base_t;
+typedef struct _v4l2port v4l2port_t;
+
+
+void rtsp_on_video_read(const char *buf,
+	int size, struct timeval *timestamp, v4l2port_t *video);
+
+int rtsp_start(pevent_base_t *base, unsigned short port);
+
+int rtsp_session_count();
+
+void rtsp_stop();
+
+#endif
@@ -0,0 +1,415 @@
+#include "shmring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <linux/futex.h>
+#include "util.h"
+#include "pevent.h"
+#include "video_manager.h"
+#include "v4l2port.h"
+
+#define SHMRING_PAGE_SIZE		4096
+#define SHMRING_ALIGN(x, a)		(((x) + (a) - 1) / (a) * (a))
+
+
+typedef struct _shmring_device
+{
+	int fd;
+	int readonly_fd;
+	char *map;
+	unsigned int map_size;
+	int clients;
+} shmring_device_t;
+
+typedef struct _shmring_client
+{
+	pevent_t *pevent;
+	int index;		//-1 until the request arrived
+
+	struct _shmring_client *prev;
+	struct _shmring_client *next;
+} shmring_client_t;
+
+typedef struct _shmring_manage
+{
+	pevent_base_t *base;
+	pevent_t *pevent;
+	char path[108];
+	ino_t path_ino;
+
+	shmring_device_t devices[MAX_VIDEO_COUNT];
+
+	shmring_client_t *clients;
+	int client_count;
+} shmring_manage_t;
+
+
+static shmring_manage_t g_shmring;
+
+
+static void shmring_device_free(shmring_device_t *device)
+{
+	if (device->map)
+		munmap(device->map, device->map_size);
+
+	if (device->readonly_fd >= 0 && device->readonly_fd != device->fd)
+		close(device->readonly_fd);
+
+	if (device->fd >= 0)
+		close(device->fd);
+
+	device->map = NULL;
+	device->fd = -1;
+	device->readonly_fd = -1;
+}
+
+static int shmring_device_create(int index)
+{
+	shmring_device_t *device;
+	shmring_header_t *header;
+	v4l2port_t *video;
+	unsigned int slot_size, slot_stride, slot_offset;
+	char name[32];
+	int i;
+
+	device = &g_shmring.devices[index];
+	if (device->map)
+		return 0;
+
+	video = video_manager_get(index);
+	if (video == NULL)
+		return -1;
+
+	//a compressed frame never exceeds the packed 4:2:2 size
+	slot_size = SHMRING_ALIGN(video->profile.width * video->profile.height * 2, SHMRING_PAGE_SIZE);
+	slot_offset = SHMRING_PAGE_SIZE;
+	slot_stride = SHMRING_ALIGN(sizeof(shmring_slot_t) + slot_size, SHMRING_PAGE_SIZE);
+
+	device->map_size = slot_offset + slot_stride * SHMRING_SLOT_COUNT;
+
+	snprintf(name, sizeof(name), "camlite-%d", index);
+	device->fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (device->fd == -1)
+	{
+		LOGERROR("memfd_create error:%s\n", strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(device->fd, device->map_size) == -1)
+	{
+		LOGERROR("ftruncate shared ring error:%s\n", strerror(errno));
+		shmring_device_free(device);
+		return -1;
+	}
+
+	device->map = mmap(NULL, device->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, device->fd, 0);
+	if (device->map == MAP_FAILED)
+	{
+		LOGERROR("mmap shared ring error:%s\n", strerror(errno));
+		device->map = NULL;
+		shmring_device_free(device);
+		return -1;
+	}
+
+	//readers cannot resize the ring or map it writable
+	fcntl(device->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#ifdef F_SEAL_FUTURE_WRITE
+	fcntl(device->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+
+	snprintf(name, sizeof(name), "/proc/self/fd/%d", device->fd);
+	device->readonly_fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (device->readonly_fd == -1)
+		device->readonly_fd = device->fd;
+
+	header = (shmring_header_t *)device->map;
+	header->magic = SHMRING_MAGIC;
+	header->version = SHMRING_VERSION;
+	header->slot_count = SHMRING_SLOT_COUNT;
+	header->slot_size = slot_size;
+	header->slot_offset = slot_offset;
+	header->slot_stride = slot_stride;
+	header->width = video->profile.width;
+	header->height = video->profile.height;
+
+	for (i = 0; i < SHMRING_SLOT_COUNT; ++i)
+		((shmring_slot_t *)(device->map + slot_offset + slot_stride * i))->lock = 0;
+
+	LOGINFO("shared ring created(device:%d size:%u)\n", index, device->map_size);
+
+	return 0;
+}
+
+void shmring_on_video_read(const char *buf, int size, struct timeval *timestamp, v4l2port_t *video)
+{
+	shmring_device_t *device;
+	shmring_header_t *header;
+	shmring_slot_t *slot;
+	unsigned int seq;
+	int index;
+
+	index = video->profile.value;
+	if (index < 0 || index >= MAX_VIDEO_COUNT)
+		return;
+
+	device = &g_shmring.devices[index];
+	if (device->clients == 0 || device->map == NULL)
+		return;
+
+	video_manager_set_check_time(video);
+
+	header = (shmring_header_t *)device->map;
+
+	if (size > (int)header->slot_size)
+	{
+		++header->dropped;
+		return;
+	}
+
+	seq = header->seq + 1;
+	slot = (shmring_slot_t *)(device->map + header->slot_offset
+		+ header->slot_stride * (seq % header->slot_count));
+
+	//seqlock, readers recheck lock after using the frame
+	++slot->lock;
+	__sync_synchronize();
+
+	memcpy((char *)(slot + 1), buf, size);
+	slot->seq = seq;
+	slot->size = size;
+	slot->timestamp_us = (uint64_t)timestamp->tv_sec * 1000000 + timestamp->tv_usec;
+
+	__sync_synchronize();
+	++slot->lock;
+
+	header->seq = seq;
+	syscall(SYS_futex, &header->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void shmring_client_free(shmring_client_t *client)
+{
+	if (client->prev)
+		client->prev->next = client->next;
+	else
+		g_shmring.clients = client->next;
+
+	if (client->next)
+		client->next->prev = client->prev;
+
+	if (client->index >= 0)
+		--g_shmring.devices[client->index].clients;
+
+	--g_shmring.client_count;
+
+	pevent_free(client->pevent);
+	free(client);
+}
+
+static int shmring_subscribe(shmring_client_t *client, int index)
+{
+	shmring_reply_t reply;
+	shmring_device_t *device;
+	int fd;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.result = -1;
+	fd = -1;
+
+	if (index >= 0 && index < MAX_VIDEO_COUNT
+		&& shmring_device_create(index) == 0
+		&& video_manager_stream_start(index) == 0)
+	{
+		device = &g_shmring.devices[index];
+
+		reply.result = 0;
+		reply.map_size = device->map_size;
+		fd = device->readonly_fd;
+
+		client->index = index;
+		++device->clients;
+	}
+
+	if (unix_send_fd(pevent_get_fd(client->pevent), fd, &reply, sizeof(reply)) == -1
+		|| reply.result == -1)
+	{
+		return -1;
+	}
+
+	LOGINFO("shared ring reader(device:%d clients:%d)\n",
+		index, g_shmring.devices[index].clients);
+
+	return 0;
+}
+
+static void shmring_on_client_event(pevent_t *pevent, int event, shmring_client_t *client)
+{
+	int32_t index;
+	int ret;
+
+	if (event != PEVENT_READ)
+	{
+		shmring_client_free(client);
+		return;
+	}
+
+	while (1)
+	{
+		ret = recv(pevent_get_fd(pevent), &index, sizeof(index), MSG_DONTWAIT);
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		//the connection closing is the unsubscribe
+		if (ret != sizeof(index) || client->index >= 0
+			|| shmring_subscribe(client, index) == -1)
+		{
+			shmring_client_free(client);
+			return;
+		}
+	}
+}
+
+static void shmring_on_accept(pevent_t *pevent, int event, void *ptr)
+{
+	shmring_client_t *client;
+	int fd;
+
+	if (event != PEVENT_READ)
+	{
+		LOGERROR("shared ring listen event error\n");
+		return;
+	}
+
+	while (1)
+	{
+		fd = accept4(pevent_get_fd(pevent), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1)
+			break;
+
+		if (g_shmring.client_count >= SHMRING_MAX_CLIENT)
+		{
+			close(fd);
+			continue;
+		}
+
+		client = fcalloc(1, sizeof(shmring_client_t));
+		client->index = -1;
+		client->pevent = pevent_new(g_shmring.base, fd,
+			(pevent_callback)shmring_on_client_event, client);
+
+		if (pevent_set(client->pevent, PEVENT_READ) == -1)
+		{
+			pevent_free(client->pevent);
+			free(client);
+			continue;
+		}
+
+		client->next = g_shmring.clients;
+		if (g_shmring.clients)
+			g_shmring.clients->prev = client;
+		g_shmring.clients = client;
+		++g_shmring.client_count;
+	}
+}
+
+int shmring_start(pevent_base_t *base, const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd, i;
+
+	g_shmring.base = base;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		g_shmring.devices[i].fd = -1;
+		g_shmring.devices[i].readonly_fd = -1;
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(fd, 8) == -1)
+	{
+		LOGWARN("bind shared ring socket(%s) error:%s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	g_shmring.pevent = pevent_new(base, fd, shmring_on_accept, NULL);
+	if (pevent_set(g_shmring.pevent, PEVENT_READ) == -1)
+	{
+		pevent_free(g_shmring.pevent);
+		g_shmring.pevent = NULL;
+		unlink(path);
+		return -1;
+	}
+
+	strcpy(g_shmring.path, path);
+	if (stat(path, &st) == 0)
+		g_shmring.path_ino = st.st_ino;
+
+	LOGINFO("shared ring start(%s)\n", path);
+
+	return 0;
+}
+
+int shmring_client_count()
+{
+	return g_shmring.client_count;
+}
+
+void shmring_resume()
+{
+	int i;
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+	{
+		if (g_shmring.devices[i].clients > 0)
+			video_manager_stream_start(i);
+	}
+}
+
+void shmring_stop()
+{
+	struct stat st;
+	int i;
+
+	if (g_shmring.base == NULL)
+		return;
+
+	if (g_shmring.pevent)
+	{
+		pevent_free(g_shmring.pevent);
+		g_shmring.pevent = NULL;
+
+		//after an upgrade the path belongs to the new process
+		if (stat(g_shmring.path, &st) == 0 && st.st_ino == g_shmring.path_ino)
+			unlink(g_shmring.path);
+	}
+
+	while (g_shmring.clients)
+		shmring_client_free(g_shmring.clients);
+
+	for (i = 0; i < MAX_VIDEO_COUNT; ++i)
+		shmring_device_free(&g_shmring.devices[i]);
+}
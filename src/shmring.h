@@ -0,0 +1,71 @@
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+
+#include <stdint.h>
+#include <sys/time.h>
+
+
+#define SHMRING_ENV				"CAMLITE_SHM_SOCKET"
+#define SHMRING_MAGIC			0x31524d43	//"CMR1"
+#define SHMRING_VERSION			1
+#define SHMRING_SLOT_COUNT		8
+#define SHMRING_MAX_CLIENT		32
+
+//a reader connects to the unix socket (SOCK_SEQPACKET), sends the device
+//index as an int32_t and gets a shmring_reply_t with a read only memfd.
+//the device keeps streaming while the connection is open.
+//
+//reading frame seq: slot = seq % slot_count, remember slot->lock (even),
+//use the data in place, then check slot->lock again. a changed lock means
+//the writer lapped the reader and the frame must be dropped. wait for the
+//next frame with FUTEX_WAIT on header->seq.
+
+typedef struct _shmring_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t slot_size;		//frame bytes a slot can hold
+	uint32_t slot_offset;	//first slot from the start of the mapping
+	uint32_t slot_stride;
+	uint32_t width;
+	uint32_t height;
+
+	volatile uint32_t seq;	//last published frame, futex word
+	volatile uint32_t dropped;
+} shmring_header_t;
+
+typedef struct _shmring_slot
+{
+	volatile uint32_t lock;	//odd while the writer fills the slot
+	uint32_t seq;
+	uint32_t size;
+	uint32_t reserved;
+	uint64_t timestamp_us;
+	//frame data follows
+} shmring_slot_t;
+
+typedef struct _shmring_reply
+{
+	int32_t result;			//0, or -1 without fd
+	uint32_t map_size;
+} shmring_reply_t;
+
+
+typedef struct _pevent_base pevent_base_t;
+typedef struct _v4l2port v4l2port_t;
+
+
+void shmring_on_video_read(const char *buf,
+	int size, struct timeval *timestamp, v4l2port_t *video);
+
+int shmring_start(pevent_base_t *base, const char *path);
+
+int shmring_client_count();
+
+void shmring_resume();
+
+void shmring_stop();
+
+#endif
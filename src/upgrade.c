@@ -0,0 +1,218 @@
+#include "upgrade.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "util.h"
+
+
+extern char **environ;
+
+static volatile sig_atomic_t g_upgrade_request;
+
+
+void upgrade_request()
+{
+	g_upgrade_request = 1;
+}
+
+int upgrade_pending()
+{
+	if (!g_upgrade_request)
+		return 0;
+
+	g_upgrade_request = 0;
+	return 1;
+}
+
+//execvp searches PATH with malloc, the child of a threaded process must
+//not, so the binary is looked up before fork
+static int upgrade_path(const char *name, char *path, int size)
+{
+	const char *dirs, *p, *end;
+
+	if (strchr(name, '/') != NULL)
+	{
+		snprintf(path, size, "%s", name);
+		return 0;
+	}
+
+	dirs = getenv("PATH");
+	if (dirs == NULL)
+		dirs = "/bin:/usr/bin";
+
+	for (p = dirs; ; p = end + 1)
+	{
+		end = strchrnul(p, ':');
+
+		snprintf(path, size, "%.*s/%s", end > p ? (int)(end - p) : 1, end > p ? p : ".", name);
+		if (access(path, X_OK) == 0)
+			return 0;
+
+		if (*end == '\0')
+			break;
+	}
+
+	return -1;
+}
+
+//environ without an old UPGRADE_ENV, the socket entry in front
+static char ** upgrade_env(const char *entry)
+{
+	char **envp;
+	int i, n;
+
+	for (n = 0; environ[n] != NULL; ++n);
+
+	envp = fcalloc(n + 2, sizeof(char *));
+	envp[0] = (char *)entry;
+
+	for (i = 0, n = 1; environ[i] != NULL; ++i)
+	{
+		if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0)
+			envp[n++] = environ[i];
+	}
+
+	return envp;
+}
+
+//only async signal safe calls between fork and exec
+static void upgrade_exec(int sock, int max_fd, const char *path, char *argv[], char *envp[])
+{
+	int fd;
+	sigset_t mask;
+
+	//signals are blocked for signalfd, the mask survives exec
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	//the new process must not inherit the camera or client fds
+	for (fd = 3; fd < max_fd; ++fd)
+	{
+		if (fd != sock)
+			close(fd);
+	}
+
+	execve(path, argv, envp);
+	_exit(127);
+}
+
+//the new process acks on the returned socket once it runs, wait for it
+//with upgrade_ack from the event loop
+int upgrade_start(char *argv[], pid_t *pid)
+{
+	int fds[2];
+	int max_fd;
+	char path[PATH_MAX];
+	char entry[32];
+	char **envp;
+
+	if (upgrade_path(argv[0], path, sizeof(path)) == -1)
+	{
+		LOGERROR("upgrade binary not found(%s)\n", argv[0]);
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1)
+	{
+		LOGERROR("socketpair error:%s\n", strerror(errno));
+		return -1;
+	}
+
+	snprintf(entry, sizeof(entry), UPGRADE_ENV "=%d", fds[1]);
+	envp = upgrade_env(entry);
+	max_fd = sysconf(_SC_OPEN_MAX);
+
+	*pid = fork();
+	if (*pid == -1)
+	{
+		LOGERROR("fork error:%s\n", strerror(errno));
+		free(envp);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (*pid == 0)
+		upgrade_exec(fds[1], max_fd, path, argv, envp);
+
+	free(envp);
+	close(fds[1]);
+
+	return fds[0];
+}
+
+//1 the new process runs, 0 not yet, -1 it failed
+int upgrade_ack(int sock)
+{
+	char ack;
+	int ret;
+
+	ret = recv(sock, &ack, 1, MSG_DONTWAIT);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+
+	return ret == 1 ? 1 : -1;
+}
+
+void upgrade_abort(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+int upgrade_get_fd()
+{
+	char *value;
+	int sock;
+	char ack;
+
+	value = getenv(UPGRADE_ENV);
+	if (value == NULL)
+		return -1;
+
+	sock = atoi(value);
+	unsetenv(UPGRADE_ENV);
+
+	ack = 1;
+	if (sock <= 2 || write(sock, &ack, 1) != 1)
+	{
+		LOGERROR("upgrade socket(%d) error\n", sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int upgrade_send(int sock, int type, int fd, int value)
+{
+	upgrade_record_t record;
+
+	record.type = type;
+	record.value = value;
+
+	return unix_send_fd(sock, fd, &record, sizeof(record));
+}
+
+int upgrade_recv(int sock, int *type, int *fd, int *value)
+{
+	upgrade_record_t record;
+
+	if (unix_recv_fd(sock, fd, &record, sizeof(record)) == -1)
+	{
+		if (*fd >= 0)
+			close(*fd);
+
+		return -1;
+	}
+
+	*type = record.type;
+	*value = record.value;
+
+	return 0;
+}
\ No newline at end of file
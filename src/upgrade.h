@@ -0,0 +1,42 @@
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+
+#include <sys/types.h>
+
+
+#define UPGRADE_ENV				"CAMLITE_UPGRADE_FD"
+#define UPGRADE_ACK_TIMEOUT		5000
+
+#define UPGRADE_RECORD_LISTEN	1
+#define UPGRADE_RECORD_CLIENT	2
+#define UPGRADE_RECORD_DONE		3
+#define UPGRADE_RECORD_DEVICES	5	//multi camera stream, align << 16 | device mask
+#define UPGRADE_RECORD_CROP		6	//x << 16 | y in pixels, applies to the following client
+#define UPGRADE_RECORD_CROP_SIZE	7	//width << 16 | height, after UPGRADE_RECORD_CROP
+
+
+typedef struct _upgrade_record
+{
+	int type;
+	int value;
+} upgrade_record_t;
+
+
+void upgrade_request();
+
+int upgrade_pending();
+
+int upgrade_start(char *argv[], pid_t *pid);
+
+int upgrade_ack(int sock);
+
+void upgrade_abort(pid_t pid);
+
+int upgrade_get_fd();
+
+int upgrade_send(int sock, int type, int fd, int value);
+
+int upgrade_recv(int sock, int *type, int *fd, int *value);
+
+#endif
\ No newline at end of file
@@ -6,7 +6,9 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/procfs.h>
+#include <sys/socket.h>
 #include <linux/types.h>
 
 typedef struct _memory_alloc_info
@@ -247,4 +249,72 @@ unsigned long read_cpu_jiffies()
 	fclose(fp);
 
 	return user + sys + current + cs;
+}
+
+int unix_send_fd(int sock, int fd, const void *data, int size)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)data;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd >= 0)
+	{
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	while (ret == -1 && errno == EINTR);
+
+	return ret == size ? 0 : -1;
+}
+
+int unix_recv_fd(int sock, int *fd, void *data, int size)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	int ret;
+
+	*fd = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	do ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	while (ret == -1 && errno == EINTR);
+
+	if (ret <= 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+
+	return ret == size ? 0 : -1;
 }
\ No newline at end of file
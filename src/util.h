@@ -3,13 +3,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include "log.h"
 
 #define STATIC_STRLEN(x) (sizeof(x) - 1)
 
-#define LOGINFO(...)	fprintf(stderr, __VA_ARGS__)
-#define LOGDEBUG(...)	//fprintf(stderr, __VA_ARGS__)
-#define LOGWARN(...)	fprintf(stderr, __VA_ARGS__)
-#define LOGERROR(...)	fprintf(stderr, "error (%s, %s(), %d): ", __FILE__, __FUNCTION__, __LINE__);fprintf(stderr, __VA_ARGS__)
+#define LOGINFO(...)	LOG_WRITE(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGDEBUG(...)	LOG_WRITE(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOGWARN(...)	LOG_WRITE(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOGERROR(...)	LOG_WRITE(LOG_LEVEL_ERROR, __VA_ARGS__)
 
 
 //#define MEMORY_ALLOC_REPORT
@@ -59,4 +60,8 @@ int read_memory_status();
 
 unsigned long read_cpu_jiffies();
 
+int unix_send_fd(int sock, int fd, const void *data, int size);
+
+int unix_recv_fd(int sock, int *fd, void *data, int size);
+
 #endif
\ No newline at end of file
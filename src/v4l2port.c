@@ -9,6 +9,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include "util.h"
+#include "jpeg.h"
 
 
 
@@ -423,6 +424,7 @@ int v4l2port_read(v4l2port_t *video,
 	v4l2_read_callback read_callback, void *ptr)
 {
 	struct v4l2_buffer buf;
+	int size;
 
 	if (!video->stream_flag)
 	{
@@ -454,8 +456,17 @@ int v4l2port_read(v4l2port_t *video,
 		}
 	}
 
-	if (read_callback != NULL)
-		read_callback(video->reqbufs[buf.index].start, buf.bytesused, &buf.timestamp, ptr);
+	++video->frames;
+
+	//truncated frames glitch every decoder downstream, they are dropped
+	size = jpeg_frame_size(video->reqbufs[buf.index].start, buf.bytesused);
+	if (size == -1)
+		++video->corrupt;
+	else if (size < buf.bytesused)
+		++video->trimmed;
+
+	if (read_callback != NULL && size != -1)
+		read_callback(video->reqbufs[buf.index].start, size, &buf.timestamp, ptr);
 
 	if (xioctl(video->fd, VIDIOC_QBUF, &buf) == -1)
 	{
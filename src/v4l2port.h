@@ -44,6 +44,10 @@ typedef struct _v4l2port
 
 	unsigned int reqbufs_count;
 	struct reqbuffer reqbufs[REQ_BUFFER_MAX];
+
+	unsigned int frames;
+	unsigned int trimmed;	//padding cut behind EOI
+	unsigned int corrupt;	//dropped without SOI or EOI
 } v4l2port_t;
 
 
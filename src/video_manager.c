@@ -6,8 +6,6 @@
 #include "v4l2port.h"
 #include "pevent.h"
 
-#define MAX_VIDEO_COUNT		10	
-
 
 typedef struct _video_data
 {
@@ -71,7 +69,7 @@ unsigned int video_manager_get_timeout()
 
 v4l2port_t * video_manager_get(int index)
 {
-	if (index >= MAX_VIDEO_COUNT)
+	if (index < 0 || index >= MAX_VIDEO_COUNT)
 		return NULL;
 
 	return g_video_manage.videos[index].video;
@@ -82,7 +80,7 @@ int video_manager_stream_start(int index)
 	video_data_t *data;
 	pevent_t *pevent;
 
-	if (index >= MAX_VIDEO_COUNT)
+	if (index < 0 || index >= MAX_VIDEO_COUNT)
 		return -1;
 
 	data = &g_video_manage.videos[index];
@@ -118,6 +116,9 @@ int video_manager_stream_start(int index)
 	pevent = pevent_new(g_video_manage.base,
 		v4l2port_getfd(data->video), (pevent_callback)on_video_event, data);
 
+	//a buffer dequeued late is a frame dropped, the sockets can wait
+	pevent_set_priority(pevent, PEVENT_PRIORITY_HIGH);
+
 	if (pevent_set(pevent, PEVENT_READ) == -1)
 	{
 		LOGERROR("pevent_set failed device:%d\n", index);
@@ -158,7 +159,7 @@ int video_manager_init_video(int index)
 {
 	video_data_t *data;
 
-	if (index >= MAX_VIDEO_COUNT)
+	if (index < 0 || index >= MAX_VIDEO_COUNT)
 		return -1;
 
 	data = &g_video_manage.videos[index];
@@ -208,6 +209,22 @@ void video_manager_set_check_time(v4l2port_t *video)
 	}
 }
 
+int video_manager_reload()
+{
+	int i;
+	int failure;
+
+	failure = 0;
+
+	for (i = 0; i < g_video_manage.count; ++i)
+	{
+		if (video_manager_init_video(i) == -1)
+			++failure;
+	}
+
+	return failure;
+}
+
 void video_manager_cleanup()
 {
 	int i;
@@ -226,5 +243,10 @@ void video_manager_cleanup()
 
 		v4l2port_uninit(data->video);
 		v4l2port_free(data->video);
+
+		data->pevent = NULL;
+		data->video = NULL;
 	}
+
+	g_video_manage.count = 0;
 }
\ No newline at end of file
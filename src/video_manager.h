@@ -4,6 +4,8 @@
 
 #include <sys/time.h>
 
+#define MAX_VIDEO_COUNT		10
+
 typedef struct _pevent_base pevent_base_t;
 
 typedef struct _v4l2port v4l2port_t;
@@ -26,6 +28,8 @@ int video_manager_add(const char *device, int width, int height, int fps);
 
 void video_manager_set_check_time(v4l2port_t *video);
 
+int video_manager_reload();
+
 void video_manager_cleanup();
 
 #endif
\ No newline at end of file